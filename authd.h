@@ -15,6 +15,11 @@
 #include <grace/thread.h>
 #include <grace/tcpsocket.h>
 #include <grace/lock.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "eventlog.h"
+#include "statuspage.h"
+#include "probes.h"
 
 #define ERR_INVALID_SCRIPT	4001
 #define ERR_NOT_FOUND		4002
@@ -23,6 +28,165 @@
 #define ERR_NOT_IMPL		4005
 #define ERR_CMD_FAILED		4006
 
+#define PATH_MODULES		"/var/openpanel/modules"
+#define PATH_METASTORE		"/var/openpanel/cache/authd"
+#define PATH_STAGING		"/var/openpanel/conf/staging"
+#define PATH_ROLLBACK		"/var/openpanel/conf/rollback"
+#define PATH_TOOLS			"/var/openpanel/tools"
+#define PATH_SOCKET			"/var/openpanel/sockets/authd/authd.sock"
+
+#define DATA_TIMEOUT		30 ///< Seconds a data transfer may stall.
+
+extern volatile int LOGMASK;
+extern string ROOTPREFIX;
+
+//  -------------------------------------------------------------------------
+/// Map a path on the panel filesystem to the path that is actually
+/// used for I/O. Normally these are the same, but with --root every
+/// path is relocated under ROOTPREFIX, so that the full I/O path can
+/// be exercised in a sandbox directory without privileges. Policy
+/// matching always uses the unprefixed path.
+/// \param path The absolute path as seen by the modules.
+/// \return The path to use for I/O.
+//  -------------------------------------------------------------------------
+string *rootPath (const string &path);
+
+//  -------------------------------------------------------------------------
+/// Write to the event log, but only if the level is enabled in LOGMASK.
+/// Unlike a plain log::write, the message (and whatever %format it
+/// contains) is not even evaluated for a disabled level.
+//  -------------------------------------------------------------------------
+#define AUTHDLOG(lvl,mod,msg) \
+	do { if (LOGMASK & (lvl)) log::write ((lvl), (mod), (msg)); } while (0)
+
+//  -------------------------------------------------------------------------
+/// Monotonic clock in microseconds, for timing measurements.
+//  -------------------------------------------------------------------------
+inline unsigned long long usecnow (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long) ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+#define LOCKMETER_MAX		16 ///< Number of distinct lock names.
+#define LOCKMETER_SAMPLES	4 ///< Slowest holds kept per name.
+#define LOCKMETER_DEPTH		8 ///< Nested sections tracked per thread.
+
+extern volatile bool LOCKSTATS; ///< True if lock metering is enabled.
+
+//  -------------------------------------------------------------------------
+/// Contention statistics for all locks that share a name: acquisition
+/// counts, time spent waiting for the lock and time it was held, plus
+/// the call sites of the slowest holds. Call sites are return addresses,
+/// addr2line turns them into a function and line.
+//  -------------------------------------------------------------------------
+class LockMeter
+{
+public:
+						 /// Find or create the meter for a name.
+						 /// \param name A static string.
+						 /// \return The meter, or NULL if there are
+						 ///         already LOCKMETER_MAX of them.
+	static LockMeter	*get (const char *name);
+	
+						 /// Record an acquired lock.
+						 /// \param obj The lock object.
+						 /// \param waited Microseconds spent waiting.
+						 /// \param excl True for an exclusive lock.
+						 /// \param caller Return address of the caller.
+	void				 acquired (const void *obj, unsigned long long waited,
+								   bool excl, void *caller);
+	
+						 /// Record a lock about to be released.
+						 /// Sections are matched up per thread, so
+						 /// this works for shared locks as well.
+	void				 released (const void *obj);
+	
+						 /// Add the statistics of all meters.
+	static void			 reportAll (value &into);
+
+protected:
+						 LockMeter (const char *n);
+	
+						 /// Keep a hold if it is among the slowest.
+	void				 sample (unsigned long long held, void *caller);
+
+	const char			*name; ///< Lock name.
+	unsigned long long	 shared; ///< Shared acquisitions.
+	unsigned long long	 exclusive; ///< Exclusive acquisitions.
+	unsigned long long	 contended; ///< Acquisitions that had to wait.
+	unsigned long long	 waitusec; ///< Total wait time.
+	unsigned long long	 maxwait; ///< Longest wait.
+	unsigned long long	 holdusec; ///< Total hold time.
+	unsigned long long	 maxhold; ///< Longest hold.
+	unsigned int		 slowusec[LOCKMETER_SAMPLES]; ///< Slowest holds.
+	void				*slowcaller[LOCKMETER_SAMPLES]; ///< Their callers.
+	lock<value>			 samplelock; ///< Protects the samples.
+};
+
+//  -------------------------------------------------------------------------
+/// A lock around a T that reports to a LockMeter, once it has been given
+/// a name with meter(). Sections work on it as they do on a lock<T>.
+/// With LOCKSTATS off, the only cost is a test before every lock and
+/// unlock. It is not a lock<T> itself, the lock is a private member, so
+/// it can't be taken through a lock<T> reference behind the meter's
+/// back.
+//  -------------------------------------------------------------------------
+template<class T>
+class meteredlock : public T
+{
+public:
+						 meteredlock (void) : T(), m (NULL) {}
+						~meteredlock (void) {}
+	
+						 /// Attach the lock to a named meter.
+	void				 meter (const char *name)
+						 {
+							m = LockMeter::get (name);
+						 }
+	
+	void				 lockr (void) __attribute__ ((noinline))
+						 {
+							if (! (LOCKSTATS && m))
+							{
+								l.lockr ();
+								return;
+							}
+							unsigned long long start = usecnow ();
+							l.lockr ();
+							m->acquired (this, usecnow() - start, false,
+										 __builtin_return_address (0));
+						 }
+	
+	void				 lockw (void) __attribute__ ((noinline))
+						 {
+							if (! (LOCKSTATS && m))
+							{
+								l.lockw ();
+								return;
+							}
+							unsigned long long start = usecnow ();
+							l.lockw ();
+							m->acquired (this, usecnow() - start, true,
+										 __builtin_return_address (0));
+						 }
+	
+	void				 unlock (void)
+						 {
+							if (LOCKSTATS && m) m->released (this);
+							l.unlock ();
+						 }
+
+protected:
+	LockMeter			*m; ///< The meter, NULL if not metered.
+
+private:
+	lock<value>			 l; ///< The actual lock, its value is unused.
+};
+
+#define SOCKET_WORKERS		8 ///< Connection handler threads.
+
 //  -------------------------------------------------------------------------
 /// A collection of worker threads that handle inbound connections.
 //  -------------------------------------------------------------------------
@@ -44,10 +208,674 @@ public:
 	tcpsocket			*accept (void);
 
 protected:
-	lock<tcplistener>	 listenSock;
+	meteredlock<tcplistener> listenSock;
 	bool				 shouldShutdown;
 };
 
+#define POLICYCACHE_SHARDS		16
+#define POLICYCACHE_SHARDSIZE	2048
+
+//  -------------------------------------------------------------------------
+/// A bounded cache for decisions made by the PathGuard. Keys include
+/// the generation number of the module's metadata, so decisions made
+/// against an older module.xml are never handed out again. The cache
+/// is split up into shards with their own locks to keep the worker
+/// threads out of each other's way. A shard that fills up is emptied
+/// out as a whole.
+//  -------------------------------------------------------------------------
+class PolicyCache
+{
+public:
+						 /// Constructor.
+						 PolicyCache (void);
+						 
+						 /// Destructor.
+						~PolicyCache (void);
+	
+						 /// Create a lookup key for a decision.
+						 /// \param moduleName The module.
+						 /// \param op The type of check.
+						 /// \param a First argument of the check.
+						 /// \param b Second argument of the check.
+						 /// \return The key, or an empty string if the
+						 ///         module could not be loaded.
+	string				*makeKey (const statstring &moduleName,
+								  const char *op, const string &a,
+								  const string &b = "");
+	
+						 /// Look up a decision.
+						 /// \param key The key, as created by makeKey().
+						 /// \param into Receives the cached decision.
+						 /// \return True on a cache hit.
+	bool				 lookup (const string &key, value &into);
+	
+						 /// Store a decision.
+	void				 store (const string &key, const value &decision);
+	
+						 /// Get hit/miss counters and an estimate of
+						 /// the memory in use.
+	value				*stats (void);
+
+protected:
+						 /// Select the shard for a key.
+	int					 shardFor (const string &key);
+
+	meteredlock<value>	 shards[POLICYCACHE_SHARDS]; ///< The cache shards.
+	unsigned int		 sizes[POLICYCACHE_SHARDS]; ///< Bytes per shard.
+	unsigned long long	 hits; ///< Lookups that found a decision.
+	unsigned long long	 misses; ///< Lookups that didn't.
+	unsigned long long	 evictions; ///< Entries thrown out.
+};
+
+extern PolicyCache PCache;
+
+#define OBJECTCACHE_SLOTS	4096 ///< Maximum number of cached objects.
+
+//  -------------------------------------------------------------------------
+/// An in-memory cache for the contents of object files served by
+/// getobject. Entries are keyed by path and are only handed out while
+/// the device, inode, mtime and size of the file on disk still match.
+/// The total size of all entries is capped; when the cap is reached,
+/// the least recently used entries are thrown out. Lookups share the
+/// lock, their LRU stamps live outside of the entries so they can be
+/// updated without an exclusive lock.
+//  -------------------------------------------------------------------------
+class ObjectCache
+{
+public:
+						 /// Constructor.
+						 ObjectCache (void);
+						 
+						 /// Destructor.
+						~ObjectCache (void);
+	
+						 /// Set the memory cap.
+						 /// \param bytes The maximum size of all
+						 ///              cached data, 0 to disable.
+	void				 setLimit (unsigned int bytes);
+	
+						 /// Check if a file of a given size is
+						 /// eligible for caching.
+	bool				 wants (off_t size);
+	
+						 /// Look up the contents of a file.
+						 /// \param path The path of the file.
+						 /// \param st The stat data of the open file.
+						 /// \param into Receives the contents.
+						 /// \return True on a cache hit.
+	bool				 lookup (const string &path, const struct stat &st,
+								 string &into);
+	
+						 /// Store the contents of a file.
+	void				 store (const string &path, const struct stat &st,
+								const string &data);
+	
+						 /// Get hit/miss counters and memory use.
+	value				*stats (void);
+
+protected:
+						 /// Remove the entry in a slot.
+	void				 evict (int slot);
+	
+	meteredlock<value>	 entries; ///< Cached objects, by path.
+	unsigned int		 ticks[OBJECTCACHE_SLOTS]; ///< LRU stamp per slot,
+												   ///  0 if free.
+	string				 slotpath[OBJECTCACHE_SLOTS]; ///< Path per slot.
+	unsigned int		 limit; ///< Memory cap.
+	unsigned int		 size; ///< Memory in use.
+	unsigned int		 tick; ///< LRU clock.
+	unsigned long long	 hits; ///< Lookups served from memory.
+	unsigned long long	 misses; ///< Lookups that weren't.
+};
+
+extern ObjectCache OCache;
+
+//  -------------------------------------------------------------------------
+/// An in-memory index of /etc/passwd and /etc/group, so user and group
+/// lookups, including group membership, cost a hash probe instead of a
+/// pass over the files. The index is reloaded when either file has
+/// changed on disk, and after we create or delete a user ourselves.
+/// Names that are not in the files, such as those of network users,
+/// fall through to the regular NSS lookups. The files are read from
+/// under the sandbox root; a root without them sends everything to
+/// NSS.
+//  -------------------------------------------------------------------------
+class UserDB
+{
+public:
+						 /// Constructor.
+						 UserDB (void);
+						 
+						 /// Destructor.
+						~UserDB (void);
+	
+						 /// Look up a user.
+						 /// \return The uid, gid and home of the user,
+						 ///         or an empty value.
+	value				*getpwnam (const string &name);
+	
+						 /// Look up a group by name.
+						 /// \return The gid of the group, or an empty
+						 ///         value. Use isMember() for the
+						 ///         members, they are not copied.
+	value				*getgrnam (const string &name);
+	
+						 /// Look up a group by gid.
+						 /// \return The name and gid of the group, or
+						 ///         an empty value.
+	value				*getgrgid (gid_t gid);
+	
+						 /// Check if a user is listed as a member
+						 /// of a group.
+	bool				 isMember (const string &group,
+								   const string &user);
+	
+						 /// Force a reload on the next lookup.
+	void				 invalidate (void);
+	
+						 /// Get hit, fallback and reload counters.
+	value				*stats (void);
+
+protected:
+						 /// Reload the index if the files changed.
+	void				 refresh (void);
+	
+						 /// Read both files into db.
+	void				 load (void);
+	
+	meteredlock<value>	 db; ///< Users, groups and gids.
+	unsigned long long	 stamp; ///< Files as last loaded.
+	unsigned long long	 hits; ///< Lookups served from the index.
+	unsigned long long	 fallbacks; ///< Lookups passed on to NSS.
+	unsigned long long	 reloads; ///< Times the index was loaded.
+};
+
+extern UserDB UDB;
+
+#define STAT_BUCKETS		240 ///< Buckets per latency histogram.
+#define STAT_SLOTS			256 ///< Commands plus modules per shard.
+#define STAT_OTHER_COMMAND	"c:(other)" ///< Commands that didn't fit.
+#define STAT_OTHER_MODULE	"m:(other)" ///< Unknown or surplus modules.
+#define STAT_SHARDS			16 ///< Number of shards.
+
+extern __thread unsigned long long STATPOLICY; ///< Policy time, this thread.
+extern __thread unsigned long long STATSCRIPT; ///< Script time, this thread.
+
+//  -------------------------------------------------------------------------
+/// Adds the time spent in its scope to a per-thread counter.
+//  -------------------------------------------------------------------------
+class StatTimer
+{
+public:
+						 StatTimer (unsigned long long &acc)
+							: into (acc), start (usecnow()) {}
+						~StatTimer (void) { into += usecnow() - start; }
+
+protected:
+	unsigned long long	&into; ///< The counter.
+	unsigned long long	 start; ///< Start of the scope.
+};
+
+//  -------------------------------------------------------------------------
+/// Latency histogram with logarithmic buckets, eight per power of two,
+/// so every bucket is accurate to within 12.5%.
+//  -------------------------------------------------------------------------
+class StatHistogram
+{
+public:
+						 StatHistogram (void);
+						~StatHistogram (void);
+	
+						 /// Count a single measurement.
+	void				 add (unsigned int usec);
+	
+						 /// Add the counts of another histogram.
+	void				 merge (const StatHistogram &other);
+	
+						 /// Remove the counts of an earlier snapshot
+						 /// of the same histogram, leaving only what
+						 /// was added since.
+	void				 since (const StatHistogram &base);
+	
+						 /// Estimate a percentile.
+						 /// \param pct The percentile (0-100).
+	unsigned int		 percentile (double pct) const;
+	
+						 /// Upper edge of a bucket.
+	static unsigned int	 bucketLimit (int bucket);
+	
+						 /// Fill a value with count, mean, max and
+						 /// the common percentiles.
+	void				 report (value &into) const;
+
+	unsigned int		 counts[STAT_BUCKETS]; ///< Bucket counts.
+	unsigned long long	 count; ///< Number of measurements.
+	unsigned long long	 sum; ///< Sum of all measurements.
+	unsigned int		 max; ///< Largest measurement.
+};
+
+//  -------------------------------------------------------------------------
+/// Counters and histograms for a single command or module.
+//  -------------------------------------------------------------------------
+class StatEntry
+{
+public:
+						 StatEntry (void);
+						~StatEntry (void);
+	
+	void				 merge (const StatEntry &other);
+	void				 report (value &into) const;
+	
+	unsigned long long	 calls; ///< Commands handled.
+	unsigned long long	 ok; ///< Status OK.
+	unsigned long long	 fail; ///< Status FAIL.
+	unsigned long long	 unknown; ///< Status UNKNOWN.
+	unsigned long long	 denied; ///< Failures due to policy.
+	StatHistogram		 policy; ///< Time spent on policy checks.
+	StatHistogram		 script; ///< Time spent in scripts.
+	StatHistogram		 total; ///< Total time.
+};
+
+//  -------------------------------------------------------------------------
+/// One shard of the StatsCollector. Each thread sticks to its own
+/// shard, so the lock is only ever contended by a report.
+//  -------------------------------------------------------------------------
+class StatShard
+{
+public:
+						 StatShard (void);
+						~StatShard (void);
+	
+	lock<value>			 index; ///< Slot number by key.
+	StatEntry			*slots[STAT_SLOTS]; ///< Allocated on first use.
+	int					 used; ///< Slots in use.
+};
+
+//  -------------------------------------------------------------------------
+/// Per-command and per-module statistics.
+//  -------------------------------------------------------------------------
+class StatsCollector
+{
+public:
+						 StatsCollector (void);
+						~StatsCollector (void);
+	
+						 /// Record a handled command.
+						 /// \param cmd The command.
+						 /// \param module The module.
+						 /// \param status One of the EVSTATUS_* codes.
+						 /// \param denied True if policy said no.
+						 /// \param usec Total time.
+						 /// \param policyusec Time in policy checks.
+						 /// \param scriptusec Time in scripts.
+	void				 record (const string &cmd, const string &module,
+								 int status, bool denied,
+								 unsigned int usec,
+								 unsigned int policyusec,
+								 unsigned int scriptusec);
+	
+						 /// Merge all shards into a report with a
+						 /// commands and a modules section, plus
+						 /// counters for what ended up in (other).
+	value				*report (void);
+	
+						 /// Merge the total time of all commands
+						 /// into one histogram.
+	void				 totals (StatHistogram &into);
+
+protected:
+	void				 recordKey (StatShard &shard,
+									const statstring &key, int status,
+									bool denied, unsigned int usec,
+									unsigned int policyusec,
+									unsigned int scriptusec);
+	
+	StatShard			 shards[STAT_SHARDS]; ///< The shards.
+	int					 nextshard; ///< For handing out shards.
+	unsigned long long	 dropped; ///< Records moved to (other).
+};
+
+extern StatsCollector Stats;
+
+//  -------------------------------------------------------------------------
+/// Publishes the daemon's state in a memory mapped file, so monitoring
+/// can read it without talking to the daemon. See statuspage.h for the
+/// layout. The counters are updated in place by the workers, update()
+/// copies them to the page.
+//  -------------------------------------------------------------------------
+class StatusPage
+{
+public:
+						 /// Constructor.
+						 StatusPage (void);
+						 
+						 /// Destructor.
+						~StatusPage (void);
+	
+						 /// Create and map the page.
+	bool				 open (const string &path);
+	
+						 /// Write the current state to the page.
+	void				 update (void);
+	
+	unsigned int		 workers; ///< Socket worker threads.
+	unsigned int		 busy; ///< Workers with a connection.
+	unsigned int		 transactions; ///< Transactions in flight.
+	unsigned long long	 accepted; ///< Connections accepted.
+	unsigned long long	 commands; ///< Commands handled.
+
+protected:
+	authdstatus			*page; ///< The mapped page.
+	unsigned long long	 started; ///< Start time.
+	StatHistogram		 base; ///< Latency snapshot at window start.
+	unsigned long long	 basetime; ///< Start of the window.
+};
+
+extern StatusPage Status;
+
+//  -------------------------------------------------------------------------
+/// Keeps one of the StatusPage counters raised for as long as it is in
+/// scope.
+//  -------------------------------------------------------------------------
+class StatusCount
+{
+public:
+						 StatusCount (unsigned int &c)
+							: counter (c) { __sync_add_and_fetch (&counter, 1); }
+						~StatusCount (void)
+							{ __sync_sub_and_fetch (&counter, 1); }
+
+protected:
+	unsigned int		&counter; ///< The counter.
+};
+
+//  -------------------------------------------------------------------------
+/// Keeps the StatusPage up to date.
+//  -------------------------------------------------------------------------
+class StatusThread : public thread
+{
+public:
+						 StatusThread (void);
+						~StatusThread (void);
+	
+						 /// Spawn the thread.
+	void				 start (void);
+	
+						 /// Wait for the thread to finish, after
+						 /// shouldRun was cleared.
+	void				 stop (void);
+	
+	void				 run (void);
+
+protected:
+	volatile bool		 running; ///< True while run() is busy.
+};
+
+//  -------------------------------------------------------------------------
+/// Writer for the binary event log, see eventlog.h for the format.
+/// Every record goes out with a single append. The file is rotated
+/// once it grows past its size limit, keeping a few old generations.
+//  -------------------------------------------------------------------------
+class EventLog
+{
+public:
+						 /// Constructor.
+						 EventLog (void);
+						 
+						 /// Destructor.
+						~EventLog (void);
+	
+						 /// Start logging to a file.
+						 /// \param path The file to append to.
+						 /// \param maxsize Rotate beyond this size.
+	bool				 open (const string &path, unsigned int maxsize);
+	
+						 /// Write a command record. Does nothing if
+						 /// the log is not open.
+	void				 command (const string &tid, const string &module,
+								  const string &cmd, const string &path,
+								  int status, unsigned int code,
+								  unsigned int usec);
+
+protected:
+						 /// Move the current file out of the way
+						 /// and start a new one.
+	void				 rotate (void);
+	
+	meteredlock<value>	 fdlock; ///< Shared for writes, exclusive
+								 ///  for rotation.
+	int					 fd; ///< The open log file.
+	string				 path; ///< Path of the log file.
+	unsigned int		 maxsize; ///< Rotation size.
+	unsigned int		 cursize; ///< Bytes in the current file.
+};
+
+extern EventLog ELog;
+
+#define TRACE_BUFSZ			16384 ///< Per-thread event buffer.
+
+//  -------------------------------------------------------------------------
+/// Optional span tracing in the Chrome trace-event format, which can be
+/// loaded into chrome://tracing or Perfetto. Each worker thread collects
+/// its events in a fixed buffer that is written out with a single
+/// append when it fills up or the connection ends. Spans carry the
+/// module and transaction id of the thread's current connection.
+//  -------------------------------------------------------------------------
+class TraceLog
+{
+public:
+						 /// Constructor.
+						 TraceLog (void);
+						 
+						 /// Destructor.
+						~TraceLog (void);
+	
+						 /// Start tracing to a file.
+						 /// \param path The file to append to.
+						 /// \param maxsize Tracing stops once the file
+						 ///                grows beyond this size.
+	bool				 open (const string &path, unsigned int maxsize);
+	
+						 /// Set the module and transaction id for
+						 /// the spans of the current thread.
+	void				 setContext (const string &module,
+									 const string &tid);
+	
+						 /// Add a complete span to the current
+						 /// thread's buffer.
+						 /// \param name Span name.
+						 /// \param cat Span category.
+						 /// \param detail Optional extra argument.
+						 /// \param start Start time (usecnow).
+						 /// \param end End time (usecnow).
+	void				 span (const char *name, const char *cat,
+							   const char *detail,
+							   unsigned long long start,
+							   unsigned long long end);
+	
+						 /// Write out the current thread's buffer.
+	void				 flush (void);
+	
+	volatile bool		 enabled; ///< True if a trace file is open.
+
+protected:
+	int					 fd; ///< The open trace file.
+	unsigned int		 maxsize; ///< Size limit.
+	unsigned int		 cursize; ///< Bytes written.
+};
+
+extern TraceLog Trace;
+
+//  -------------------------------------------------------------------------
+/// Records its scope as a span, if tracing is enabled. When it is not,
+/// this costs a single test of Trace.enabled.
+//  -------------------------------------------------------------------------
+class TraceSpan
+{
+public:
+						 TraceSpan (const char *n, const char *c,
+									const char *d = NULL)
+							: name (n), cat (c), detail (d),
+							  start (Trace.enabled ? usecnow() : 0) {}
+						~TraceSpan (void)
+						 {
+							if (start)
+								Trace.span (name, cat, detail, start,
+											usecnow());
+						 }
+
+protected:
+	const char			*name; ///< Span name.
+	const char			*cat; ///< Span category.
+	const char			*detail; ///< Extra argument, or NULL.
+	unsigned long long	 start; ///< Start of the scope, 0 if disabled.
+};
+
+//  -------------------------------------------------------------------------
+/// Records a connection as a span and writes out the thread's trace
+/// buffer when the connection is done, however it ends.
+//  -------------------------------------------------------------------------
+class TraceConnection
+{
+public:
+						 TraceConnection (void)
+							: start (Trace.enabled ? usecnow() : 0) {}
+						~TraceConnection (void)
+						 {
+							if (! start) return;
+							Trace.span ("connection", "worker", NULL,
+										start, usecnow());
+							Trace.flush ();
+							Trace.setContext ("", "");
+						 }
+
+protected:
+	unsigned long long	 start; ///< Accept time, 0 if disabled.
+};
+
+//  -------------------------------------------------------------------------
+/// Optional capture of the command stream, for replaying production
+/// traffic against a test instance with bench/authd-replay. Every line
+/// holds a wall clock timestamp in microseconds, a connection number
+/// and a command line as received, or "." when the connection closed.
+/// Passwords are replaced before anything is written.
+//  -------------------------------------------------------------------------
+class CaptureLog
+{
+public:
+						 /// Constructor.
+						 CaptureLog (void);
+						 
+						 /// Destructor.
+						~CaptureLog (void);
+	
+						 /// Start capturing to a file.
+						 /// \param path The file to append to.
+						 /// \param maxsize Capturing stops once the
+						 ///                file grows beyond this size.
+	bool				 open (const string &path, unsigned int maxsize);
+	
+						 /// Record the greeting of a new connection
+						 /// on the current thread.
+	void				 hello (const string &line);
+	
+						 /// Record a command of the current thread's
+						 /// connection.
+						 /// \param cmd The split command line.
+						 /// \param line The command line as received.
+	void				 command (const value &cmd, const string &line);
+	
+						 /// Record the end of the current thread's
+						 /// connection, if it was captured.
+	void				 close (void);
+	
+	volatile bool		 enabled; ///< True if a capture file is open.
+
+protected:
+						 /// Append a single record.
+	void				 write (unsigned int conn, const char *line);
+	
+	int					 fd; ///< The open capture file.
+	unsigned int		 maxsize; ///< Size limit.
+	unsigned int		 cursize; ///< Bytes written.
+	unsigned int		 nextconn; ///< Last connection number used.
+};
+
+extern CaptureLog Capture;
+
+//  -------------------------------------------------------------------------
+/// Closes the current thread's captured connection, however it ends.
+//  -------------------------------------------------------------------------
+class CaptureConnection
+{
+public:
+						 CaptureConnection (void) {}
+						~CaptureConnection (void)
+						 {
+							if (Capture.enabled) Capture.close ();
+						 }
+};
+
+#define DEMO_MAXCMDS		32 ///< Commands in a demo latency profile.
+
+#define DEMO_FIXED			0 ///< Always the same latency.
+#define DEMO_UNIFORM		1 ///< Uniform between two bounds.
+#define DEMO_EXP			2 ///< Exponential with a given mean.
+#define DEMO_LOGNORMAL		3 ///< Log-normal from a median and p99.
+
+//  -------------------------------------------------------------------------
+/// Simulated command latency for --demo mode, so a demo run behaves
+/// like a system where scripts and services take their time. The
+/// profile is a text file with a line per command:
+///
+///     # command      distribution  parameters (usec)  [spin]
+///     runscript      lognormal     200000 1500000
+///     reloadservice  fixed         5000000
+///     installfile    uniform       100 2000           spin
+///     default        exp           500
+///
+/// Distributions are fixed <usec>, uniform <min> <max>, exp <mean> and
+/// lognormal <p50> <p99>. A delay is slept away, unless spin is given,
+/// in which case the worker keeps its CPU busy instead. Commands are
+/// named as in the protocol; commit and rollback cover the end of a
+/// transaction, default covers everything not listed.
+//  -------------------------------------------------------------------------
+class DemoProfile
+{
+public:
+						 /// Constructor.
+						 DemoProfile (void);
+						 
+						 /// Destructor.
+						~DemoProfile (void);
+	
+						 /// Load a profile.
+						 /// \param path The profile file.
+						 /// \param err Set to the problem on failure.
+	bool				 load (const string &path, string &err);
+	
+						 /// Wait for the simulated duration of a
+						 /// command.
+						 /// \param cmd The command name.
+						 /// \return Always true, so a demo handler
+						 ///         can return the result directly.
+	bool				 simulate (const char *cmd);
+
+protected:
+						 /// Draw a latency for an entry.
+	unsigned int		 draw (int idx);
+	
+	int					 ncmds; ///< Entries in use.
+	char				 names[DEMO_MAXCMDS][32]; ///< Command names.
+	int					 types[DEMO_MAXCMDS]; ///< DEMO_* distribution.
+	double				 p1[DEMO_MAXCMDS]; ///< First parameter.
+	double				 p2[DEMO_MAXCMDS]; ///< Second parameter.
+	bool				 spin[DEMO_MAXCMDS]; ///< Busy-wait if true.
+	int					 defidx; ///< Index of default, or -1.
+};
+
+extern DemoProfile Demo;
+
 //  -------------------------------------------------------------------------
 /// Guardian for file operations. Uses the global MetaCache to
 /// read module.xml meta-files and make sense of the fileops statements
@@ -63,8 +891,22 @@ public:
 						 /// Destructor.
 						~PathGuard (void);
 						
+						 /// Find and verify a staged source file.
+						 /// The file is opened (without following
+						 /// symlinks) and checked through the open
+						 /// descriptor, which is handed back to the
+						 /// caller for reading.
+						 /// \param moduleName The module.
+						 /// \param fileName The file, relative to the
+						 ///                 module's staging directory.
+						 /// \param fd Receives the open descriptor,
+						 ///           or -1 on failure. The caller
+						 ///           should close it.
+						 /// \param error Receives the error text.
+						 /// \return The full path, or an empty string.
 	string				*translateSource (const statstring &moduleName,
 										  const string &fileName,
+										  int &fd,
 										  string &error);
 										  
 	bool				 checkDestination (const statstring &moduleName,
@@ -99,9 +941,310 @@ public:
 											 string &error);
 									
 protected:
+						 /// The uncached versions of the checks above,
+						 /// their decisions are kept in the PolicyCache.
+	bool				 evalSource (const statstring &moduleName,
+									 const string &fileName,
+									 string &error);
+	
+	bool				 evalDestination (const statstring &moduleName,
+										  const string &sourceFile,
+										  const string &filePath,
+										  value &perms,
+										  string &error);
+	
+	bool				 evalScriptAccess (const string &moduleName,
+										   const string &scriptName,
+										   string &userName,
+										   string &error);
+	
+	bool				 evalCommandAccess (const string &moduleName,
+											const string &cmdName,
+											const string &cmdClass,
+											string &error);
+
 	class MetaCache		&cache;
 };
 
+//  -------------------------------------------------------------------------
+/// Switches the filesystem credentials of the calling thread for as
+/// long as the object is alive. This makes the kernel check file
+/// access as if the target user was doing it, without affecting the
+/// other threads.
+//  -------------------------------------------------------------------------
+class FsCredentials
+{
+public:
+						 /// Constructor.
+						 /// \param uid The uid to act as.
+						 /// \param gid The gid to act as.
+						 FsCredentials (uid_t uid, gid_t gid);
+						 
+						 /// Destructor. Restores the original
+						 /// credentials.
+						~FsCredentials (void);
+
+protected:
+	uid_t				 olduid; ///< Previous fsuid.
+	gid_t				 oldgid; ///< Previous fsgid.
+};
+
+//  -------------------------------------------------------------------------
+/// Installs a single file as part of a transaction. The new content
+/// is written to a temporary file next to the destination, which is
+/// renamed into place on commit(). All access to the destination
+/// directory is done with the credentials of the file's new owner.
+/// A rollback-file in the same format used by the opencore-tools is
+/// written before the destination is touched.
+//  -------------------------------------------------------------------------
+class FileInstaller
+{
+public:
+						 /// Constructor.
+						 /// \param transactionid The transaction.
+						 /// \param destPath Full path of the destination.
+						 /// \param uid Owner of the new file.
+						 /// \param gid Group of the new file.
+						 /// \param mode Access bits for the new file.
+						 FileInstaller (const string &transactionid,
+										const string &destPath,
+										uid_t uid, gid_t gid,
+										unsigned int mode);
+										
+						 /// Destructor. Aborts the installation if
+						 /// it was not committed.
+						~FileInstaller (void);
+	
+						 /// Check if the destination already holds
+						 /// the same data, ownership and mode as the
+						 /// source file. If so, the installation is
+						 /// done.
+						 /// \param fd The source file.
+						 /// \return True if the file was unchanged.
+	bool				 skipUnchanged (int fd);
+	
+						 /// Write the rollback-file and set up the
+						 /// temporary file.
+	bool				 prepare (void);
+	
+						 /// Copy the contents of an open file into
+						 /// the temporary file.
+	bool				 copyFrom (int fd);
+	
+						 /// Add data to the temporary file.
+	bool				 write (const char *data, size_t sz);
+	
+						 /// Move the temporary file into place.
+	bool				 commit (void);
+	
+						 /// Remove the temporary file and
+						 /// rollback-file.
+	void				 abort (void);
+	
+						 /// Save only the original content of the
+						 /// destination to a file, instead of writing
+						 /// a full rollback-file. Used by callers that
+						 /// keep their own rollback records.
+	void				 setSavePath (const string &path);
+	
+						 /// Flush the data of the temporary file
+						 /// before it replaces the destination.
+	void				 setSyncData (bool sync);
+	
+						 /// Get the base name for rollback-files of
+						 /// a path, creating the transaction's
+						 /// rollback directory if needed.
+	static string		*rollbackBase (const string &transactionid,
+									   const string &path,
+									   string &error);
+	
+	string				 error; ///< Error text of the last failure.
+	bool				 existed; ///< True if the destination existed.
+	unsigned int		 oldmode; ///< Original mode of the destination.
+	
+	static unsigned long long skippedFiles; ///< Unchanged files skipped.
+	static unsigned long long skippedBytes; ///< Bytes not rewritten.
+
+protected:
+						 /// Write out the rollback-file.
+	bool				 writeRollback (void);
+	
+						 /// Compare the contents of two files.
+	bool				 sameContent (int afd, int bfd, off_t sz);
+
+	string				 transactionid; ///< The transaction.
+	string				 dest; ///< Destination path.
+	string				 tmpname; ///< Path of the temporary file.
+	string				 rbfile; ///< Path of the rollback-file.
+	string				 savepath; ///< See setSavePath().
+	uid_t				 uid; ///< Owner of the new file.
+	gid_t				 gid; ///< Group of the new file.
+	unsigned int		 mode; ///< Mode of the new file.
+	int					 tmpfd; ///< Open temporary file.
+	bool				 done; ///< True if committed or aborted.
+	bool				 syncdata; ///< See setSyncData().
+};
+
+#define DURABLE_NONE		0 ///< Leave flushing to the kernel.
+#define DURABLE_FILE		1 ///< Flush installed files.
+#define DURABLE_DIR			2 ///< Flush files and their directories.
+
+//  -------------------------------------------------------------------------
+/// Keeps track of the files changed in a transaction, so they and their
+/// directories can be flushed to disk in one go when the transaction is
+/// finished, instead of paying for a directory fsync on every single
+/// install. The data of installed files was already flushed before it
+/// replaced the old file.
+//  -------------------------------------------------------------------------
+class SyncBatch
+{
+public:
+						 /// Constructor.
+						 SyncBatch (void);
+						 
+						 /// Destructor.
+						~SyncBatch (void);
+	
+						 /// Remember a file or directory that was
+						 /// installed or created.
+	void				 add (const string &path);
+	
+						 /// Forget about all pending paths.
+	void				 clear (void);
+	
+						 /// Flush all pending paths to disk.
+						 /// \param level One of the DURABLE_* levels.
+						 /// \return The number of paths that could not
+						 ///         be flushed.
+	int					 flush (int level);
+	
+						 /// Translate a level name (none, file, dir).
+						 /// \return The level, or -1 if invalid.
+	static int			 parseLevel (const string &name);
+
+protected:
+	bool				 syncPath (const string &path, bool wholefs);
+	
+	value				 paths; ///< Pending paths and their device.
+	value				 devices; ///< Number of paths per device.
+};
+
+//  -------------------------------------------------------------------------
+/// Installs a whole staged directory tree in one operation. The caller
+/// walks the tree with scan() and checks every entry against the
+/// policy before anything is added, after which run() creates the
+/// missing directories and copies the files using a number of
+/// TreeWorker threads. A single rollback manifest covers the tree.
+//  -------------------------------------------------------------------------
+class TreeInstaller : public threadgroup
+{
+public:
+						 /// Constructor.
+						 /// \param tid The transaction id.
+						 TreeInstaller (const string &tid);
+						 
+						 /// Destructor.
+						~TreeInstaller (void);
+	
+						 /// Walk a staged directory.
+						 /// \param moduleName The module.
+						 /// \param srcDir The directory, relative to
+						 ///               the module's staging area.
+						 /// \param destDir The destination directory.
+						 /// \param into Receives a list of entries
+						 ///             with type, src and dest. Only
+						 ///             directories that don't exist
+						 ///             yet are listed.
+						 /// \return False on error, see error.
+	bool				 scan (const statstring &moduleName,
+							   const string &srcDir,
+							   const string &destDir,
+							   value &into);
+	
+						 /// Queue a directory for creation. Parents
+						 /// should be added before their children.
+	void				 addDir (const string &path, uid_t uid,
+								 gid_t gid, unsigned int mode);
+	
+						 /// Queue a file for installation.
+						 /// \param src The source, as understood by
+						 ///            PathGuard::translateSource().
+						 /// \param dest The full destination path.
+	void				 addFile (const string &src, const string &dest,
+								  uid_t uid, gid_t gid, unsigned int mode);
+	
+						 /// Perform the installation.
+						 /// \param moduleName The module.
+						 /// \param nthreads Number of copy threads.
+						 /// \return False if a directory or file could
+						 ///         not be installed, see error.
+	bool				 run (const statstring &moduleName,
+							  int nthreads);
+	
+						 /// Get the next file for a worker.
+						 /// \param idx Receives the job index.
+						 /// \param job Receives the job.
+						 /// \return False if there's nothing left.
+	bool				 next (int &idx, value &job);
+	
+						 /// Report the result for a file.
+	void				 done (int idx, const value &res);
+	
+						 /// A line per file with its status.
+	string				*summary (void);
+	
+						 /// Add the installed files and created
+						 /// directories to a SyncBatch.
+	void				 collect (class SyncBatch &into);
+	
+	string				 error; ///< Error text of the last failure.
+	statstring			 module; ///< The module, for the workers.
+	string				 savedir; ///< Directory for original content.
+	bool				 syncdata; ///< Flush files before renaming.
+
+protected:
+	bool				 walk (const string &rel, int depth,
+							   value &into);
+	bool				 writeManifest (void);
+	
+						 /// Create a queued directory.
+						 /// \param topfd The deepest existing ancestor.
+						 /// \param rel The path below it.
+						 /// \param d The queued directory.
+	bool				 makeDir (int topfd, const string &rel, value &d);
+	
+	string				 transactionid; ///< The transaction.
+	string				 srcbase; ///< The staged directory.
+	string				 srcrel; ///< Same, relative to staging.
+	string				 destbase; ///< Destination directory.
+	value				 dirs; ///< Directories to create.
+	lock<value>			 files; ///< File jobs and their results.
+	int					 nextjob; ///< Next file job to hand out.
+	bool				 failed; ///< True once a file failed.
+};
+
+//  -------------------------------------------------------------------------
+/// Copy thread for a TreeInstaller.
+//  -------------------------------------------------------------------------
+class TreeWorker : public groupthread
+{
+public:
+						 /// Constructor.
+						 /// \param grp The parent group.
+						 TreeWorker (class TreeInstaller *grp);
+						 
+						 /// Destructor.
+						~TreeWorker (void);
+	
+						 /// Run-method, installs files until the
+						 /// queue is empty.
+	void				 run (void);
+
+protected:
+	class TreeInstaller	*group; ///< The parent group.
+	PathGuard			 guard; ///< Our own guard.
+};
+
 //  -------------------------------------------------------------------------
 /// A collection of handlers for command sent to the daemon.
 //  -------------------------------------------------------------------------
@@ -131,6 +1274,24 @@ public:
 									  uid_t uid=0,
 									  gid_t gid=0);
 						 
+						 /// Install a file with data sent over the
+						 /// connection, instead of taking it from
+						 /// the staging directory.
+						 /// \param destPath Full path of the file.
+						 /// \param sz Number of bytes that follow.
+						 /// \param in The connection to read from.
+	bool				 installData (const string &destPath,
+									  unsigned int sz, file &in);
+						 
+						 /// Install a staged directory tree, replying
+						 /// with a summary of the installed files.
+						 /// \param srcDir The staged directory.
+						 /// \param destPath The directory to copy to.
+						 /// \param out The connection to reply to.
+	bool				 installTree (const string &srcDir,
+									  const string &destPath,
+									  file &out);
+						 
 						 /// Remove a file from the filesystem.
 						 /// \param fileName The name of the file to
 						 ///                 delete.
@@ -202,8 +1363,15 @@ public:
 	bool				 setServiceOnBoot (const string &serviceName,
 										   bool onBoot);
 	
+						 /// Send the contents of an object file to
+						 /// the client, prefixed by an "+OK <size>"
+						 /// line.
 	bool				 getObject (const string &, file &);
 	
+						 /// Send the statistics as XML, prefixed by an
+						 /// "+OK <size>" line.
+	bool				 sendStats (file &out);
+	
 						 /// Run a specific script from the allowed
 						 /// scripts directory.
 	bool				 runScript (const string &scriptName,
@@ -220,17 +1388,80 @@ public:
 						 /// Send an update-trigger to the swupd process.
 	bool				 triggerSoftwareUpdate (void);
 	
+						 /// Flush the directories and remaining paths
+						 /// of this transaction and run the
+						 /// end-transaction script.
 	void				 finishTransaction (void);
 	
 	bool				 rollbackTransaction (void);
 	
+						 /// Change the durability level for the rest
+						 /// of the transaction. Above none, file data
+						 /// is flushed before it replaces the old
+						 /// file; directories are flushed at the end
+						 /// of the transaction.
+						 /// \param level The level name (none, file
+						 ///              or dir).
+	bool				 setDurability (const string &level);
+	
 	string				 lasterror; ///< Last generated error text.
 	int					 lasterrorcode; ///< Last generated error code.
 	string				 transactionid; ///< The transaction-id.
 	statstring			 module; ///< Associated module name.
 	
 protected:
+						 /// Figure out ownership and mode for a new
+						 /// file from the attributes of a fileop.
+						 /// \param perms The fileop attributes.
+						 /// \param uid Default owner in, owner out.
+						 /// \param gid Default group in, group out.
+						 /// \param mode Receives the mode.
+	bool				 resolveFilePerms (const value &perms, uid_t &uid,
+										   gid_t &gid, unsigned int &mode);
+	
+						 /// Read and discard data from the connection.
+	bool				 skipData (file &in, unsigned int sz);
+	
+						 /// Create the missing directories of a path
+						 /// as a user, without following symlinks
+						 /// below a trusted prefix. On failure, the
+						 /// directories created so far are removed.
+						 /// \param path The full path.
+						 /// \param trusted Leading part of the path
+						 ///                that may hold symlinks.
+						 /// \param uid The user.
+						 /// \param gid The user's group.
+						 /// \param mode Mode of new directories.
+						 /// \param created Receives the paths of the
+						 ///                new directories, parents
+						 ///                first.
+	bool				 walkUserDir (const string &path,
+									  const string &trusted,
+									  uid_t uid, gid_t gid, int mode,
+									  value &created);
+	
+						 /// Write a single rollback-file for the
+						 /// directories created by makeuserdir.
+	bool				 writeUserDirRollback (const string &path,
+											   uid_t uid, gid_t gid,
+											   const value &created);
+	
+						 /// Read the contents of an object file.
+	bool				 readObject (int fd, off_t sz, string &into);
+	
+						 /// Write a buffer to a socket.
+	bool				 sendAll (int sock, const char *data, size_t sz);
+	
+						 /// Send a file to a socket using sendfile().
+	bool				 sendFile (int sock, int fd, off_t sz);
+	
+						 /// Wait for a socket to accept more data.
+	bool				 waitWritable (int sock);
+
 	class PathGuard		 guard; ///< Our personal psychologist.
+	class SyncBatch		 pending; ///< Changes that need flushing.
+	int					 durability; ///< DURABLE_* level.
+	unsigned long long	 txstart; ///< Start of the transaction.
 };
 
 //  -------------------------------------------------------------------------
@@ -240,6 +1471,13 @@ protected:
 /// expected to work better than building a static list at start-up time,
 /// because it will allow the daemon to keep on running despite changes
 /// to a module's meta-data or the installation of a new module.
+///
+/// Only the authdops part of a module.xml is of any interest to us. After
+/// a module.xml has been parsed and validated, that subset is written
+/// to a compiled SHoX file under PATH_METASTORE, tagged with the mtime
+/// and size of the module.xml it came from. Later loads (including the
+/// ones after a daemon restart) use the compiled copy for as long as the
+/// module.xml stays untouched.
 //  -------------------------------------------------------------------------
 class MetaCache
 {
@@ -249,13 +1487,229 @@ public:
 						
 						 /// Get a specific module's metadata.
 	value				*get (const statstring &moduleName);
+	
+						 /// Parse and validate a module.xml and write
+						 /// out its compiled form.
+						 /// \param moduleName The module to compile.
+						 /// \param into Receives the compiled metadata.
+						 /// \return False if the module.xml could not
+						 ///         be loaded.
+	bool				 compile (const statstring &moduleName,
+								  value &into);
+	
+						 /// Get the names of all installed modules.
+	value				*listModules (void);
+	
+						 /// Get the generation number of a module's
+						 /// current metadata. This number changes
+						 /// every time the metadata is reloaded from
+						 /// a changed module.xml.
+						 /// \return The generation, or 0 if the module
+						 ///         could not be loaded.
+	unsigned int		 generation (const statstring &moduleName);
+	
+						 /// Number of modules in the cache.
+	unsigned int		 count (void);
+	
+	unsigned long long	 hits; ///< Served from memory.
+	unsigned long long	 reloads; ///< Loaded from disk.
+	unsigned long long	 compiles; ///< Parsed from module.xml.
+	unsigned long long	 failures; ///< Modules that failed to load.
 
 protected:
-	lock<value>			 cache; ///< cached metabase.
+						 /// Load the compiled metadata for a module,
+						 /// if it is still in sync with its module.xml.
+	bool				 loadCompiled (const statstring &moduleName,
+									   const struct stat &st,
+									   value &into);
+	
+						 /// Tag metadata with the identity of the
+						 /// module.xml it was read from.
+	static void			 setSource (value &meta, const struct stat &st);
+	
+						 /// Check if metadata was read from the
+						 /// module.xml as it is now.
+	static bool			 sameSource (const value &meta,
+									 const struct stat &st);
+
+	meteredlock<value>	 cache; ///< cached metabase.
+	meteredlock<value>	 gens; ///< Generation per module.
+	unsigned int		 lastgen; ///< Last handed out generation.
 };
 
 extern MetaCache MCache;
 
+//  -------------------------------------------------------------------------
+/// A set of threads that load the metadata for all installed modules
+/// into the MetaCache, so the first request for each module after a
+/// restart does not have to wait for it.
+//  -------------------------------------------------------------------------
+class PrewarmGroup : public threadgroup
+{
+public:
+						 /// Constructor.
+						 PrewarmGroup (void);
+						 
+						 /// Destructor.
+						~PrewarmGroup (void);
+	
+						 /// Load all modules, using a number of
+						 /// worker threads.
+						 /// \param nthreads The number of threads.
+						 /// \return The number of modules loaded.
+	int					 run (int nthreads);
+	
+						 /// Get the next module to load.
+						 /// \param into Receives the module name.
+						 /// \return False if there's nothing left.
+	bool				 next (statstring &into);
+	
+						 /// Report a loaded module.
+	void				 done (bool success);
+
+protected:
+	lock<value>			 queue; ///< Modules that still need loading.
+	lock<value>			 results; ///< Load counters.
+};
+
+//  -------------------------------------------------------------------------
+/// Worker thread for the PrewarmGroup.
+//  -------------------------------------------------------------------------
+class PrewarmWorker : public groupthread
+{
+public:
+						 /// Constructor.
+						 /// \param grp The parent group.
+						 PrewarmWorker (class PrewarmGroup *grp);
+						 
+						 /// Destructor.
+						~PrewarmWorker (void);
+	
+						 /// Run-method, loads modules until the queue
+						 /// is empty.
+	void				 run (void);
+
+protected:
+	class PrewarmGroup	*group; ///< The parent group.
+};
+
+//  -------------------------------------------------------------------------
+/// Thread that performs the cache prewarm in the background, if the
+/// configuration asks for that.
+//  -------------------------------------------------------------------------
+class PrewarmThread : public thread
+{
+public:
+						 PrewarmThread (void);
+						~PrewarmThread (void);
+	
+						 /// Spawn the thread.
+	void				 start (void);
+	
+						 /// Wait for the thread to finish. Modules
+						 /// stop being loaded once shouldRun is
+						 /// cleared.
+	void				 stop (void);
+	
+	void				 run (void);
+
+protected:
+	volatile bool		 running; ///< True while run() is busy.
+};
+
+#define MB_COMPILE		0
+#define MB_GETCOLD		1
+#define MB_GETWARM		2
+#define MB_DESTHIT		3
+#define MB_DESTMISS		4
+#define MB_SOURCE		5
+#define MB_DELETE		6
+#define MB_SCRIPTHIT	7
+#define MB_SCRIPTMISS	8
+#define MB_NUMOPS		9
+
+//  -------------------------------------------------------------------------
+/// Microbenchmark for the MetaCache and PathGuard (--microbench).
+/// Synthetic modules with a growing number of fileops, objects and
+/// scripts are generated under a scratch root, after which every
+/// operation is timed with 1 to 64 threads hammering the same module.
+/// Allocations per operation are only counted by the separate build
+/// from "make microbench".
+//  -------------------------------------------------------------------------
+class MicroBench : public threadgroup
+{
+public:
+						 /// Constructor.
+						 MicroBench (void);
+						 
+						 /// Destructor.
+						~MicroBench (void);
+	
+						 /// Run the full benchmark and print the
+						 /// results.
+						 /// \return Exit code for the application.
+	int					 run (void);
+	
+						 /// Worker body: wait for the start signal,
+						 /// then run the current operation.
+						 /// \param idx The worker's index.
+	void				 work (int idx);
+
+protected:
+						 /// Write a synthetic module.xml and its
+						 /// staged source file.
+						 /// \param name The module name.
+						 /// \param n Number of fileops, objects and
+						 ///          scripts.
+	bool				 makeModule (const statstring &name, int n);
+	
+						 /// Time one operation on the current module.
+						 /// \param op The MB_* operation.
+						 /// \param nthreads Number of threads.
+	void				 measure (int op, int nthreads);
+	
+						 /// Perform a single operation.
+						 /// \param idx Worker index, for unique keys.
+						 /// \param iter Iteration, for unique keys.
+	bool				 once (int op, int idx, unsigned int iter);
+	
+						 /// Find an iteration count that keeps a
+						 /// single thread busy for about 100ms.
+	unsigned int		 calibrate (int op);
+
+	statstring			 module; ///< The module under test.
+	int					 nops; ///< Its number of fileops.
+	string				 srcname; ///< Staged file matching the last fileop.
+	string				 destpath; ///< Path of the last fileop.
+	string				 scriptname; ///< The last script.
+	int					 curop; ///< Operation being measured.
+	unsigned int		 iterations; ///< Per thread.
+	unsigned int		 pass; ///< Measurement number, for unique keys.
+	volatile bool		 go; ///< Start signal for the workers.
+	lock<value>			 results; ///< Per-thread timings.
+};
+
+//  -------------------------------------------------------------------------
+/// Worker thread for the MicroBench.
+//  -------------------------------------------------------------------------
+class MicroWorker : public groupthread
+{
+public:
+						 /// Constructor.
+						 /// \param grp The parent group.
+						 /// \param idx The worker's index.
+						 MicroWorker (class MicroBench *grp, int idx);
+						 
+						 /// Destructor.
+						~MicroWorker (void);
+	
+	void				 run (void);
+
+protected:
+	class MicroBench	*group; ///< The parent group.
+	int					 index; ///< Worker index.
+};
+
 class RestartScheduler : public thread
 {
 public:
@@ -307,13 +1761,38 @@ public:
 		 	
 	int					 main (void);
 	
+						 /// Write out compiled metadata for every
+						 /// installed module (--compile-modules).
+	int					 compileModules (void);
+	
+						 /// Load metadata for all installed modules
+						 /// into the MetaCache.
+	static void			 prewarmCache (void);
+	
+						 /// Run the policy microbenchmark
+						 /// (--microbench).
+	int					 microBench (void);
+	
 	bool				 shouldRun;
+	bool				 reloadConf; ///< Set on SIGHUP.
+	
+						 /// Translate a log level name into a mask.
+						 /// \return The mask, or -1 if unknown.
+	static int			 logLevelMask (const string &name);
 	
 protected:
 	bool				 confLog (config::action act, keypath &path,
 								  const value &nval, const value &oval);
+	
+	bool				 confLogLevel (config::action act, keypath &path,
+									   const value &nval,
+									   const value &oval);
+
+	bool				 daemonized; ///< True once the log is set up.
 
 	appconfig			 conf;
 };
 
+extern AuthdApp *AUTHD;
+
 #endif
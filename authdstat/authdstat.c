@@ -0,0 +1,111 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+/* ======================================================================== *\
+ | authdstat: print the status page published by openpanel-authd. Only the  |
+ |            mapped file is read, the daemon itself is never contacted.    |
+\* ======================================================================== */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "../statuspage.h"
+
+int main (int argc, char *argv[])
+{
+	const char *path = STATUSPAGE_PATH;
+	const volatile authdstatus *page;
+	authdstatus st;
+	struct timeval tv;
+	unsigned long long now;
+	uint32_t seq;
+	int fd;
+	int tries;
+	
+	if (argc > 2)
+	{
+		fprintf (stderr, "%% Usage: %s [statusfile]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 2) path = argv[1];
+	
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf (stderr, "%% Could not open %s: %s\n", path, strerror (errno));
+		return 1;
+	}
+	
+	page = mmap (NULL, sizeof (authdstatus), PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (page == MAP_FAILED)
+	{
+		fprintf (stderr, "%% Could not map %s: %s\n", path, strerror (errno));
+		return 1;
+	}
+	
+	/* Copy the page, retrying while the daemon is writing to it */
+	for (tries=0; tries<1000; ++tries)
+	{
+		seq = page->seq;
+		__sync_synchronize ();
+		if (seq & 1)
+		{
+			sched_yield ();
+			continue;
+		}
+		memcpy (&st, (const void *) page, sizeof (st));
+		__sync_synchronize ();
+		if (page->seq == seq) break;
+	}
+	
+	if (tries == 1000)
+	{
+		fprintf (stderr, "%% Could not get a consistent copy\n");
+		return 1;
+	}
+	
+	if ((st.magic != STATUSPAGE_MAGIC) || (st.version != STATUSPAGE_VERSION))
+	{
+		fprintf (stderr, "%% Not a status page, or an unknown version\n");
+		return 1;
+	}
+	
+	gettimeofday (&tv, NULL);
+	now = ((unsigned long long) tv.tv_sec * 1000000ULL) + tv.tv_usec;
+	
+	printf ("pid:            %u\n", st.pid);
+	printf ("uptime:         %llu s\n",
+			(unsigned long long) (now - st.started) / 1000000ULL);
+	printf ("last update:    %llu ms ago\n",
+			(unsigned long long) (now - st.updated) / 1000ULL);
+	printf ("workers:        %u (%u busy)\n", st.workers, st.busy);
+	printf ("transactions:   %u\n", st.transactions);
+	printf ("accepted:       %llu\n", (unsigned long long) st.accepted);
+	printf ("commands:       %llu\n", (unsigned long long) st.commands);
+	printf ("modules:        %u\n", st.modules);
+	printf ("metacache:      hits=%llu reloads=%llu compiles=%llu "
+			"failures=%llu\n", (unsigned long long) st.metahits,
+			(unsigned long long) st.metareloads,
+			(unsigned long long) st.metacompiles,
+			(unsigned long long) st.metafailures);
+	printf ("policycache:    hits=%llu misses=%llu\n",
+			(unsigned long long) st.policyhits,
+			(unsigned long long) st.policymisses);
+	printf ("latency (%us):  n=%u p50=%uus p90=%uus p99=%uus max=%uus\n",
+			st.window, st.wcommands, st.p50, st.p90, st.p99, st.max);
+	
+	return 0;
+}
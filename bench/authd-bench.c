@@ -0,0 +1,269 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+/* ======================================================================== *\
+ | authd-bench: load generator for openpanel-authd. Opens a number of       |
+ |              concurrent connections to the daemon's socket, replays a    |
+ |              weighted mix of commands and reports throughput and         |
+ |              latency percentiles. Run it against a daemon started with   |
+ |              --demo to measure protocol, dispatch and policy overhead    |
+ |              without touching the system.                                |
+\* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+
+#define MAXMIX		32
+
+typedef struct
+{
+	int			 weight;
+	char		 line[LINESZ];
+} mixentry;
+
+typedef struct
+{
+	pthread_t	 thread;
+	int			 id;
+	uint32_t	*lat;			/* Latencies in microseconds */
+	size_t		 nlat;
+	size_t		 maxlat;
+	unsigned long ok;
+	unsigned long fail;
+	unsigned long connfail;
+} worker;
+
+static const char *SOCKPATH = "/var/openpanel/sockets/authd/authd.sock";
+static const char *MODULE = "Bench.module";
+static mixentry MIX[MAXMIX];
+static int NMIX = 0;
+static int TOTALWEIGHT = 0;
+static int PERCONN = 100;
+static volatile int RUNNING = 1;
+
+/* The default mix, as sent by a typical module. The arguments only have
+   to make sense to a daemon running with --demo. */
+static const char *DEFAULTMIX[] = {
+	"4:installfile bench.conf /etc/bench",
+	"1:makedir /etc/bench/conf.d",
+	"2:runscript bench-script",
+	"2:getobject bench.object",
+	"1:reloadservice bench",
+	NULL
+};
+
+static int addmix (const char *spec)
+{
+	const char *colon = strchr (spec, ':');
+	
+	if ((! colon) || (NMIX >= MAXMIX) || (strlen (colon+1) >= LINESZ-2))
+	{
+		fprintf (stderr, "%% Invalid mix entry: %s\n", spec);
+		return 0;
+	}
+	
+	MIX[NMIX].weight = atoi (spec);
+	if (MIX[NMIX].weight < 1) MIX[NMIX].weight = 1;
+	snprintf (MIX[NMIX].line, LINESZ, "%s\n", colon+1);
+	TOTALWEIGHT += MIX[NMIX].weight;
+	NMIX++;
+	return 1;
+}
+
+static void record (worker *w, uint32_t usec)
+{
+	if (w->nlat == w->maxlat)
+	{
+		w->maxlat = w->maxlat ? (w->maxlat * 2) : 65536;
+		w->lat = realloc (w->lat, w->maxlat * sizeof (uint32_t));
+		if (! w->lat)
+		{
+			fprintf (stderr, "%% Out of memory\n");
+			exit (1);
+		}
+	}
+	w->lat[w->nlat++] = usec;
+}
+
+static const char *pick (unsigned int *seed)
+{
+	int r = rand_r (seed) % TOTALWEIGHT;
+	int i;
+	
+	for (i=0; i<NMIX; ++i)
+	{
+		r -= MIX[i].weight;
+		if (r < 0) return MIX[i].line;
+	}
+	return MIX[0].line;
+}
+
+static void *run (void *arg)
+{
+	worker *w = (worker *) arg;
+	unsigned int seed = w->id * 7919 + 1;
+	struct sockaddr_un sun;
+	char hello[LINESZ];
+	conn c;
+	int i;
+	
+	memset (&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	strncpy (sun.sun_path, SOCKPATH, sizeof (sun.sun_path) - 1);
+	snprintf (hello, LINESZ, "hello %s\n", MODULE);
+	
+	while (RUNNING)
+	{
+		c.len = 0;
+		c.fd = socket (AF_UNIX, SOCK_STREAM, 0);
+		if ((c.fd < 0) ||
+			connect (c.fd, (struct sockaddr *) &sun, sizeof (sun)) ||
+			(command (&c, hello) != 1))
+		{
+			if (c.fd >= 0) close (c.fd);
+			w->connfail++;
+			usleep (10000);
+			continue;
+		}
+		
+		for (i=0; RUNNING && (i<PERCONN); ++i)
+		{
+			unsigned long long start = usecnow ();
+			int res = command (&c, pick (&seed));
+			
+			if (res < 0)
+			{
+				w->connfail++;
+				break;
+			}
+			
+			record (w, (uint32_t) (usecnow() - start));
+			if (res) w->ok++;
+			else w->fail++;
+		}
+		
+		if (i == PERCONN) command (&c, "quit\n");
+		close (c.fd);
+	}
+	
+	return NULL;
+}
+
+static void usage (const char *cmd)
+{
+	fprintf (stderr,
+		"%% Usage: %s [options]\n"
+		"  -s path    Socket path (default %s)\n"
+		"  -m module  Module name to send in the greeting (default %s)\n"
+		"  -c num     Concurrent connections (default 8)\n"
+		"  -t secs    Duration of the run (default 10)\n"
+		"  -r num     Commands per connection (default 100)\n"
+		"  -x w:cmd   Add a command with weight w to the mix, replaces\n"
+		"             the default mix\n", cmd, SOCKPATH, MODULE);
+}
+
+int main (int argc, char *argv[])
+{
+	int nconn = 8;
+	int secs = 10;
+	int opt;
+	int i;
+	worker *workers;
+	unsigned long long start, elapsed;
+	unsigned long ok = 0, fail = 0, connfail = 0;
+	size_t nlat = 0;
+	uint32_t *lat;
+	
+	while ((opt = getopt (argc, argv, "s:m:c:t:r:x:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': SOCKPATH = optarg; break;
+			case 'm': MODULE = optarg; break;
+			case 'c': nconn = atoi (optarg); break;
+			case 't': secs = atoi (optarg); break;
+			case 'r': PERCONN = atoi (optarg); break;
+			case 'x': if (! addmix (optarg)) return 1; break;
+			default: usage (argv[0]); return 1;
+		}
+	}
+	
+	if ((nconn < 1) || (secs < 1) || (PERCONN < 1))
+	{
+		usage (argv[0]);
+		return 1;
+	}
+	
+	if (! NMIX)
+	{
+		for (i=0; DEFAULTMIX[i]; ++i) addmix (DEFAULTMIX[i]);
+	}
+	
+	workers = calloc (nconn, sizeof (worker));
+	if (! workers) return 1;
+	
+	start = usecnow ();
+	for (i=0; i<nconn; ++i)
+	{
+		workers[i].id = i;
+		if (pthread_create (&workers[i].thread, NULL, run, &workers[i]))
+		{
+			fprintf (stderr, "%% Could not start thread\n");
+			return 1;
+		}
+	}
+	
+	sleep (secs);
+	RUNNING = 0;
+	
+	for (i=0; i<nconn; ++i)
+	{
+		pthread_join (workers[i].thread, NULL);
+		ok += workers[i].ok;
+		fail += workers[i].fail;
+		connfail += workers[i].connfail;
+		nlat += workers[i].nlat;
+	}
+	elapsed = usecnow() - start;
+	
+	lat = malloc ((nlat ? nlat : 1) * sizeof (uint32_t));
+	if (! lat) return 1;
+	
+	nlat = 0;
+	for (i=0; i<nconn; ++i)
+	{
+		memcpy (lat + nlat, workers[i].lat, workers[i].nlat * sizeof (uint32_t));
+		nlat += workers[i].nlat;
+		free (workers[i].lat);
+	}
+	
+	printf ("connections:  %d\n", nconn);
+	printf ("duration:     %.2f s\n", elapsed / 1000000.0);
+	printf ("commands:     %lu ok, %lu failed, %lu connection errors\n",
+			ok, fail, connfail);
+	printf ("throughput:   %.1f commands/s\n",
+			(ok + fail) / (elapsed / 1000000.0));
+	
+	printlatency (lat, nlat);
+	
+	free (lat);
+	free (workers);
+	return 0;
+}
@@ -0,0 +1,350 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+/* ======================================================================== *\
+ | authd-replay: plays a command stream captured by openpanel-authd (see    |
+ |               system/capture) back against a daemon, keeping the         |
+ |               original timing and concurrency, optionally sped up.       |
+ |               Every captured connection gets its own connection and      |
+ |               thread. Meant for a daemon running with --demo or with     |
+ |               --root on a sandbox, never for a live system.              |
+\* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+
+typedef struct
+{
+	unsigned long long	 ts;		/* Capture time, microseconds */
+	char				*line;
+} entry;
+
+typedef struct
+{
+	pthread_t	 thread;
+	entry		*entries;
+	size_t		 nentries;
+	size_t		 maxentries;
+	int			 closed;
+	uint32_t	*lat;			/* Latencies in microseconds */
+	size_t		 nlat;
+	unsigned long ok;
+	unsigned long fail;
+	unsigned long connfail;
+} session;
+
+static const char *SOCKPATH = "/var/openpanel/sockets/authd/authd.sock";
+static double SPEED = 1.0;
+static session *SESSIONS = NULL;
+static size_t NSESSIONS = 0;
+static unsigned long long CAPSTART = 0;
+static unsigned long long RUNSTART = 0;
+
+/* Sleep until the replay time that corresponds to a capture time */
+static void waituntil (unsigned long long capts)
+{
+	unsigned long long due, now;
+	
+	if (SPEED <= 0.0) return;
+	
+	due = RUNSTART + (unsigned long long) ((capts - CAPSTART) / SPEED);
+	now = usecnow ();
+	
+	while (now < due)
+	{
+		unsigned long long left = due - now;
+		usleep ((left > 1000000) ? 1000000 : left);
+		now = usecnow ();
+	}
+}
+
+static void *xrealloc (void *p, size_t sz)
+{
+	void *res = realloc (p, sz);
+	if (! res)
+	{
+		fprintf (stderr, "%% Out of memory\n");
+		exit (1);
+	}
+	return res;
+}
+
+/* Read a capture file into sessions. Connection numbers start over when
+   the daemon restarts, so a greeting always starts a new session. */
+static int load (const char *path)
+{
+	FILE *f = fopen (path, "r");
+	char buf[LINESZ];
+	size_t *active = NULL;		/* Session index + 1, by connection */
+	size_t nactive = 0;
+	unsigned long lineno = 0;
+	
+	if (! f)
+	{
+		fprintf (stderr, "%% Could not open %s: %s\n", path, strerror (errno));
+		return 0;
+	}
+	
+	while (fgets (buf, LINESZ, f))
+	{
+		unsigned long long ts;
+		unsigned int connid;
+		int pos = 0;
+		size_t len;
+		session *s;
+		char *line;
+		
+		lineno++;
+		len = strlen (buf);
+		if (len && (buf[len-1] == '\n')) buf[--len] = 0;
+		
+		if ((sscanf (buf, "%llu %u %n", &ts, &connid, &pos) < 2) || (! pos))
+		{
+			fprintf (stderr, "%% Skipping malformed line %lu\n", lineno);
+			continue;
+		}
+		line = buf + pos;
+		
+		if (connid >= nactive)
+		{
+			size_t n = connid + 1024;
+			active = xrealloc (active, n * sizeof (size_t));
+			memset (active + nactive, 0, (n - nactive) * sizeof (size_t));
+			nactive = n;
+		}
+		
+		if (! strncmp (line, "hello ", 6))
+		{
+			SESSIONS = xrealloc (SESSIONS, (NSESSIONS+1) * sizeof (session));
+			memset (SESSIONS + NSESSIONS, 0, sizeof (session));
+			active[connid] = ++NSESSIONS;
+		}
+		
+		/* Commands of a connection whose greeting was not captured */
+		if (! active[connid]) continue;
+		
+		s = &SESSIONS[active[connid] - 1];
+		if (s->closed) continue;
+		
+		if (s->nentries == s->maxentries)
+		{
+			s->maxentries = s->maxentries ? (s->maxentries * 2) : 16;
+			s->entries = xrealloc (s->entries, s->maxentries * sizeof (entry));
+		}
+		
+		s->entries[s->nentries].ts = ts;
+		s->entries[s->nentries].line = strdup (line);
+		s->nentries++;
+		
+		if (! strcmp (line, ".")) s->closed = 1;
+		if ((! CAPSTART) || (ts < CAPSTART)) CAPSTART = ts;
+	}
+	
+	fclose (f);
+	free (active);
+	return 1;
+}
+
+/* The data of installdata is not captured, send filler of the right
+   size so the protocol stays in sync. */
+static int sendfiller (conn *c, const char *line)
+{
+	char filler[LINESZ];
+	const char *sp = strrchr (line, ' ');
+	size_t sz = sp ? strtoul (sp+1, NULL, 10) : 0;
+	
+	memset (filler, 0, LINESZ);
+	
+	while (sz)
+	{
+		size_t chunk = (sz > LINESZ) ? LINESZ : sz;
+		if (! sendbuf (c, filler, chunk)) return 0;
+		sz -= chunk;
+	}
+	return 1;
+}
+
+/* Send a captured command and wait for its reply, see readreply() */
+static int replay (conn *c, const char *line)
+{
+	if (! (sendline (c, line) && sendbuf (c, "\n", 1))) return -1;
+	
+	if (! strncmp (line, "installdata ", 12))
+	{
+		if (! sendfiller (c, line)) return -1;
+	}
+	
+	return readreply (c);
+}
+
+static void *run (void *arg)
+{
+	session *s = (session *) arg;
+	struct sockaddr_un sun;
+	conn c;
+	size_t i;
+	
+	s->lat = xrealloc (NULL, (s->nentries + 1) * sizeof (uint32_t));
+	
+	memset (&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	strncpy (sun.sun_path, SOCKPATH, sizeof (sun.sun_path) - 1);
+	
+	c.len = 0;
+	c.fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if ((c.fd < 0) || connect (c.fd, (struct sockaddr *) &sun, sizeof (sun)))
+	{
+		if (c.fd >= 0) close (c.fd);
+		s->connfail++;
+		return NULL;
+	}
+	
+	for (i=0; i<s->nentries; ++i)
+	{
+		unsigned long long start;
+		int res;
+		
+		if (! strcmp (s->entries[i].line, ".")) break;
+		
+		/* Never earlier than captured, later if the daemon is slower */
+		waituntil (s->entries[i].ts);
+		
+		start = usecnow ();
+		res = replay (&c, s->entries[i].line);
+		
+		if (res < 0)
+		{
+			s->connfail++;
+			break;
+		}
+		
+		s->lat[s->nlat++] = (uint32_t) (usecnow() - start);
+		if (res) s->ok++;
+		else s->fail++;
+		
+		/* Without a greeting the daemon hangs up */
+		if ((! res) && (i == 0)) break;
+	}
+	
+	close (c.fd);
+	return NULL;
+}
+
+static int cmpsession (const void *a, const void *b)
+{
+	unsigned long long x = ((const session *) a)->entries[0].ts;
+	unsigned long long y = ((const session *) b)->entries[0].ts;
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+static void usage (const char *cmd)
+{
+	fprintf (stderr,
+		"%% Usage: %s [options] <capture file>\n"
+		"  -s path    Socket path (default %s)\n"
+		"  -x factor  Speed up the replay by this factor, 0 replays as fast\n"
+		"             as possible (default 1)\n", cmd, SOCKPATH);
+}
+
+int main (int argc, char *argv[])
+{
+	int opt;
+	size_t i;
+	unsigned long long elapsed, captured = 0;
+	unsigned long ok = 0, fail = 0, connfail = 0;
+	size_t nlat = 0;
+	uint32_t *lat;
+	
+	while ((opt = getopt (argc, argv, "s:x:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': SOCKPATH = optarg; break;
+			case 'x': SPEED = atof (optarg); break;
+			default: usage (argv[0]); return 1;
+		}
+	}
+	
+	if ((optind != (argc-1)) || (SPEED < 0.0))
+	{
+		usage (argv[0]);
+		return 1;
+	}
+	
+	if (! load (argv[optind])) return 1;
+	if (! NSESSIONS)
+	{
+		fprintf (stderr, "%% No connections in %s\n", argv[optind]);
+		return 1;
+	}
+	
+	qsort (SESSIONS, NSESSIONS, sizeof (session), cmpsession);
+	
+	RUNSTART = usecnow ();
+	for (i=0; i<NSESSIONS; ++i)
+	{
+		session *s = &SESSIONS[i];
+		unsigned long long last = s->entries[s->nentries - 1].ts;
+		
+		if ((last - CAPSTART) > captured) captured = last - CAPSTART;
+		
+		waituntil (s->entries[0].ts);
+		if (pthread_create (&s->thread, NULL, run, s))
+		{
+			fprintf (stderr, "%% Could not start thread\n");
+			return 1;
+		}
+	}
+	
+	for (i=0; i<NSESSIONS; ++i)
+	{
+		pthread_join (SESSIONS[i].thread, NULL);
+		ok += SESSIONS[i].ok;
+		fail += SESSIONS[i].fail;
+		connfail += SESSIONS[i].connfail;
+		nlat += SESSIONS[i].nlat;
+	}
+	elapsed = usecnow() - RUNSTART;
+	
+	lat = malloc ((nlat ? nlat : 1) * sizeof (uint32_t));
+	if (! lat) return 1;
+	
+	nlat = 0;
+	for (i=0; i<NSESSIONS; ++i)
+	{
+		memcpy (lat + nlat, SESSIONS[i].lat,
+				SESSIONS[i].nlat * sizeof (uint32_t));
+		nlat += SESSIONS[i].nlat;
+		free (SESSIONS[i].lat);
+	}
+	
+	printf ("connections:  %lu\n", (unsigned long) NSESSIONS);
+	printf ("captured:     %.2f s\n", captured / 1000000.0);
+	printf ("duration:     %.2f s\n", elapsed / 1000000.0);
+	printf ("commands:     %lu ok, %lu failed, %lu connection errors\n",
+			ok, fail, connfail);
+	printf ("throughput:   %.1f commands/s\n",
+			(ok + fail) / (elapsed / 1000000.0));
+	
+	printlatency (lat, nlat);
+	
+	free (lat);
+	return 0;
+}
@@ -0,0 +1,30 @@
+# This file is part of OpenPanel - The Open Source Control Panel
+# OpenPanel is free software: you can redistribute it and/or modify it 
+# under the terms of the GNU General Public License as published by the Free 
+# Software Foundation, using version 3 of the License.
+#
+# Please note that use of the OpenPanel trademark may be subject to additional 
+# restrictions. For more information, please visit the Legal Information 
+# section of the OpenPanel website on http://www.openpanel.com/
+
+# Latency profile for openpanel-authd --demo-profile, roughly what a
+# loaded production system looks like. All times in microseconds.
+#
+# command         distribution  parameters        [spin]
+runscript         lognormal     200000 1500000
+runuserscript     lognormal     200000 1500000
+reloadservice     lognormal     2000000 5000000
+startservice      lognormal     1000000 5000000
+stopservice       lognormal     500000 3000000
+setonboot         fixed         50000
+createuser        lognormal     30000 200000
+deleteuser        lognormal     30000 200000
+setuserpass       lognormal     20000 100000
+setusershell      lognormal     20000 100000
+setquota          lognormal     10000 50000
+installfile       uniform       100 2000          spin
+installdata       uniform       100 2000          spin
+installtree       lognormal     2000 20000
+commit            lognormal     5000 50000
+rollback          lognormal     50000 500000
+default           exp           500
@@ -0,0 +1,128 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "protocol.h"
+
+unsigned long long usecnow (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long) ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+int readline (conn *c, char *into, size_t sz)
+{
+	while (1)
+	{
+		char *nl = memchr (c->buf, '\n', c->len);
+		if (nl)
+		{
+			size_t l = nl - c->buf;
+			if (l >= sz) l = sz-1;
+			memcpy (into, c->buf, l);
+			into[l] = 0;
+			c->len -= (nl - c->buf) + 1;
+			memmove (c->buf, nl+1, c->len);
+			return 1;
+		}
+		if (c->len == LINESZ) return 0;
+		
+		ssize_t r = read (c->fd, c->buf + c->len, LINESZ - c->len);
+		if ((r < 0) && (errno == EINTR)) continue;
+		if (r <= 0) return 0;
+		c->len += r;
+	}
+}
+
+int skipbody (conn *c, size_t sz)
+{
+	char tmp[LINESZ];
+	size_t take = (c->len < sz) ? c->len : sz;
+	
+	c->len -= take;
+	memmove (c->buf, c->buf + take, c->len);
+	sz -= take;
+	
+	while (sz)
+	{
+		ssize_t r = read (c->fd, tmp, (sz > LINESZ) ? LINESZ : sz);
+		if ((r < 0) && (errno == EINTR)) continue;
+		if (r <= 0) return 0;
+		sz -= r;
+	}
+	return 1;
+}
+
+int sendbuf (conn *c, const char *buf, size_t len)
+{
+	size_t done = 0;
+	
+	while (done < len)
+	{
+		ssize_t w = write (c->fd, buf + done, len - done);
+		if ((w < 0) && (errno == EINTR)) continue;
+		if (w <= 0) return 0;
+		done += w;
+	}
+	return 1;
+}
+
+int sendline (conn *c, const char *line)
+{
+	return sendbuf (c, line, strlen (line));
+}
+
+int readreply (conn *c)
+{
+	char reply[LINESZ];
+	
+	if (! readline (c, reply, LINESZ)) return -1;
+	
+	if (! strncmp (reply, "+OK", 3))
+	{
+		/* Some commands send a body after "+OK <size>" */
+		if (reply[3] == ' ')
+		{
+			if (! skipbody (c, strtoul (reply+4, NULL, 10))) return -1;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+int command (conn *c, const char *line)
+{
+	if (! sendline (c, line)) return -1;
+	return readreply (c);
+}
+
+static int cmpu32 (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+void printlatency (uint32_t *lat, size_t nlat)
+{
+	if (! nlat) return;
+	
+	qsort (lat, nlat, sizeof (uint32_t), cmpu32);
+	printf ("latency:      p50=%uus p99=%uus p999=%uus max=%uus\n",
+			lat[nlat / 2], lat[(nlat * 99) / 100],
+			lat[(nlat * 999) / 1000], lat[nlat - 1]);
+}
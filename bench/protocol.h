@@ -0,0 +1,56 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+/* ======================================================================== *\
+ | protocol: the client side of the authd socket protocol, shared by the    |
+ |           bench tools: line reading, sending commands, reading their     |
+ |           replies and reporting latency percentiles.                     |
+\* ======================================================================== */
+
+#ifndef _AUTHD_BENCH_PROTOCOL_H
+#define _AUTHD_BENCH_PROTOCOL_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINESZ		4096
+
+/* Buffered line reader on a socket */
+typedef struct
+{
+	int		 fd;
+	char	 buf[LINESZ];
+	size_t	 len;
+} conn;
+
+/* Monotonic clock in microseconds */
+unsigned long long usecnow (void);
+
+/* Read a line without its newline, returns 0 if the connection broke */
+int readline (conn *c, char *into, size_t sz);
+
+/* Skip a reply body of sz bytes */
+int skipbody (conn *c, size_t sz);
+
+/* Write all of buf, returns 0 if the connection broke */
+int sendbuf (conn *c, const char *buf, size_t len);
+int sendline (conn *c, const char *line);
+
+/* Read the reply to a command. Returns 1 for +OK, 0 for an error reply,
+   -1 if the connection broke. A body after "+OK <size>" is skipped. */
+int readreply (conn *c);
+
+/* Send a command line, including its newline, and read its reply */
+int command (conn *c, const char *line);
+
+/* Sort the latencies and print their percentiles */
+void printlatency (uint32_t *lat, size_t nlat);
+
+#endif
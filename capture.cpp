@@ -0,0 +1,160 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CAPTURE_LINESZ	4096
+
+CaptureLog Capture;
+
+/// Connection number of the current thread, 0 if not captured.
+static __thread unsigned int CAPTURECONN = 0;
+
+/// Commands that carry a password, and the argument that holds it.
+static struct
+{
+	const char	*cmd;
+	int			 arg;
+} CAPTUREREDACT[] = {
+	{ "createuser", 2 },
+	{ "setuserpass", 2 },
+	{ NULL, 0 }
+};
+
+// ==========================================================================
+// CONSTRUCTOR CaptureLog
+// ==========================================================================
+CaptureLog::CaptureLog (void)
+{
+	enabled = false;
+	fd = -1;
+	maxsize = 0;
+	cursize = 0;
+	nextconn = 0;
+}
+
+// ==========================================================================
+// DESTRUCTOR CaptureLog
+// ==========================================================================
+CaptureLog::~CaptureLog (void)
+{
+	if (fd >= 0) ::close (fd);
+}
+
+// ==========================================================================
+// METHOD CaptureLog::open
+// ==========================================================================
+bool CaptureLog::open (const string &path, unsigned int sz)
+{
+	struct stat st;
+	
+	fd = ::open (path.str(), O_WRONLY|O_APPEND|O_CREAT|O_NOFOLLOW|O_CLOEXEC,
+				 0600);
+	if (fd < 0) return false;
+	
+	if (fstat (fd, &st))
+	{
+		::close (fd);
+		fd = -1;
+		return false;
+	}
+	
+	maxsize = sz;
+	cursize = st.st_size;
+	enabled = (! maxsize) || (cursize < maxsize);
+	return true;
+}
+
+// ==========================================================================
+// METHOD CaptureLog::hello
+// ==========================================================================
+void CaptureLog::hello (const string &line)
+{
+	if (! enabled) return;
+	
+	CAPTURECONN = __sync_add_and_fetch (&nextconn, 1);
+	write (CAPTURECONN, line.str());
+}
+
+// ==========================================================================
+// METHOD CaptureLog::command
+// ==========================================================================
+void CaptureLog::command (const value &cmd, const string &line)
+{
+	if (! (enabled && CAPTURECONN)) return;
+	
+	for (int i=0; CAPTUREREDACT[i].cmd; ++i)
+	{
+		if (cmd[0] != CAPTUREREDACT[i].cmd) continue;
+		
+		// Rebuild the line with the password left out. The other
+		// arguments are user names, which need no quoting.
+		string redacted;
+		for (int a=0; a<cmd.count(); ++a)
+		{
+			if (a) redacted.strcat (' ');
+			if (a == CAPTUREREDACT[i].arg) redacted.strcat ("redacted");
+			else redacted.strcat (cmd[a].sval());
+		}
+		
+		write (CAPTURECONN, redacted.str());
+		return;
+	}
+	
+	write (CAPTURECONN, line.str());
+}
+
+// ==========================================================================
+// METHOD CaptureLog::close
+// ==========================================================================
+void CaptureLog::close (void)
+{
+	if (! CAPTURECONN) return;
+	if (enabled) write (CAPTURECONN, ".");
+	CAPTURECONN = 0;
+}
+
+// ==========================================================================
+// METHOD CaptureLog::write
+// ==========================================================================
+void CaptureLog::write (unsigned int conn, const char *line)
+{
+	char rec[CAPTURE_LINESZ];
+	struct timeval tv;
+	int len;
+	
+	gettimeofday (&tv, NULL);
+	len = snprintf (rec, sizeof (rec), "%llu %u %s\n",
+					((unsigned long long) tv.tv_sec * 1000000ULL) +
+					tv.tv_usec, conn, line);
+	
+	// A line that does not fit could not be replayed anyway.
+	if ((len <= 0) || (len >= (int) sizeof (rec))) return;
+	
+	// One append per record keeps the lines of different connections
+	// from getting mixed up.
+	if (::write (fd, rec, len) == (ssize_t) len)
+	{
+		unsigned int sz = __sync_add_and_fetch (&cursize, len);
+		if (maxsize && (sz >= maxsize))
+		{
+			enabled = false;
+			AUTHDLOG (log::warning, "capture ", "Capture file full, "
+						"capturing stopped");
+		}
+	}
+}
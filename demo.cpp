@@ -0,0 +1,210 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+/// The 99th percentile of the standard normal distribution.
+#define DEMO_Z99	2.326348
+
+/// Upper bound for a single simulated delay, in microseconds.
+#define DEMO_MAXUSEC	600000000.0
+
+DemoProfile Demo;
+
+/// Random state of the current thread, 0 if not seeded yet.
+static __thread unsigned int DEMOSEED = 0;
+
+/// A uniform random number in (0,1) for the current thread.
+static double demoRandom (void)
+{
+	if (! DEMOSEED) DEMOSEED = (unsigned int) usecnow () ^ (unsigned int)
+							   (unsigned long) &DEMOSEED;
+	
+	return (rand_r (&DEMOSEED) + 0.5) / ((double) RAND_MAX + 1.0);
+}
+
+// ==========================================================================
+// CONSTRUCTOR DemoProfile
+// ==========================================================================
+DemoProfile::DemoProfile (void)
+{
+	ncmds = 0;
+	defidx = -1;
+}
+
+// ==========================================================================
+// DESTRUCTOR DemoProfile
+// ==========================================================================
+DemoProfile::~DemoProfile (void)
+{
+}
+
+// ==========================================================================
+// METHOD DemoProfile::load
+// ==========================================================================
+bool DemoProfile::load (const string &path, string &err)
+{
+	FILE *f = fopen (path.str(), "r");
+	char buf[256];
+	int lineno = 0;
+	
+	if (! f)
+	{
+		err = "Could not open %s" %format (path);
+		return false;
+	}
+	
+	while (fgets (buf, sizeof (buf), f))
+	{
+		char name[32];
+		char dist[16];
+		char opt[16];
+		double a = 0.0, b = 0.0;
+		int n;
+		
+		lineno++;
+		char *hash = strchr (buf, '#');
+		if (hash) *hash = 0;
+		
+		n = sscanf (buf, "%31s %15s %lf %lf %15s", name, dist, &a, &b, opt);
+		if (n <= 0) continue;
+		
+		if (ncmds >= DEMO_MAXCMDS)
+		{
+			err = "Too many commands in %s" %format (path);
+			fclose (f);
+			return false;
+		}
+		
+		int t = -1;
+		if (! strcmp (dist, "fixed")) t = DEMO_FIXED;
+		else if (! strcmp (dist, "exp")) t = DEMO_EXP;
+		else if (! strcmp (dist, "uniform")) t = DEMO_UNIFORM;
+		else if (! strcmp (dist, "lognormal")) t = DEMO_LOGNORMAL;
+		
+		int nparam = ((t == DEMO_UNIFORM) || (t == DEMO_LOGNORMAL)) ? 2 : 1;
+		
+		// With a single parameter, sscanf has taken a spin option
+		// for the second one and failed there.
+		bool dospin = false;
+		if ((nparam == 1) && (n == 3))
+		{
+			dospin = (sscanf (buf, "%*s %*s %*f %15s", opt) == 1) &&
+					 (! strcmp (opt, "spin"));
+		}
+		else if ((nparam == 2) && (n == 5))
+		{
+			dospin = (! strcmp (opt, "spin"));
+		}
+		
+		if ((t < 0) || (n < (2 + nparam)) || (a < 0.0) || (b < 0.0) ||
+			((t == DEMO_UNIFORM) && (b < a)) ||
+			((t == DEMO_LOGNORMAL) && ((a <= 0.0) || (b < a))))
+		{
+			err = "Invalid entry for %s at %s line %i"
+				  %format (name, path, lineno);
+			fclose (f);
+			return false;
+		}
+		
+		strcpy (names[ncmds], name);
+		types[ncmds] = t;
+		p1[ncmds] = a;
+		p2[ncmds] = b;
+		spin[ncmds] = dospin;
+		
+		// The log-normal is kept as its mu and sigma.
+		if (t == DEMO_LOGNORMAL)
+		{
+			p1[ncmds] = log (a);
+			p2[ncmds] = (log (b) - log (a)) / DEMO_Z99;
+		}
+		
+		if (! strcmp (name, "default")) defidx = ncmds;
+		ncmds++;
+	}
+	
+	fclose (f);
+	return true;
+}
+
+// ==========================================================================
+// METHOD DemoProfile::draw
+// ==========================================================================
+unsigned int DemoProfile::draw (int idx)
+{
+	double res = 0.0;
+	
+	switch (types[idx])
+	{
+		case DEMO_FIXED:
+			res = p1[idx];
+			break;
+		
+		case DEMO_UNIFORM:
+			res = p1[idx] + (demoRandom () * (p2[idx] - p1[idx]));
+			break;
+		
+		case DEMO_EXP:
+			res = -p1[idx] * log (demoRandom ());
+			break;
+		
+		case DEMO_LOGNORMAL:
+		{
+			// Box-Muller, one of the pair is enough.
+			double z = sqrt (-2.0 * log (demoRandom ())) *
+					   cos (2.0 * M_PI * demoRandom ());
+			res = exp (p1[idx] + (p2[idx] * z));
+			break;
+		}
+	}
+	
+	if (res > DEMO_MAXUSEC) res = DEMO_MAXUSEC;
+	return (unsigned int) res;
+}
+
+// ==========================================================================
+// METHOD DemoProfile::simulate
+// ==========================================================================
+bool DemoProfile::simulate (const char *cmd)
+{
+	int idx = defidx;
+	
+	for (int i=0; i<ncmds; ++i)
+	{
+		if (! strcmp (names[i], cmd))
+		{
+			idx = i;
+			break;
+		}
+	}
+	
+	if (idx < 0) return true;
+	
+	unsigned int usec = draw (idx);
+	if (! usec) return true;
+	
+	if (spin[idx])
+	{
+		unsigned long long end = usecnow () + usec;
+		while (usecnow () < end);
+	}
+	else
+	{
+		usleep (usec);
+	}
+	
+	return true;
+}
@@ -0,0 +1,160 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+/* ======================================================================== *\
+ | evdump: decode the binary event log written by openpanel-authd, as text  |
+ |         or as JSON, optionally filtered by transaction or module.        |
+\* ======================================================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../eventlog.h"
+
+static const char *STATUS[] = { "OK", "FAIL", "UNKNOWN" };
+
+/* Print a string with JSON escaping */
+static void jsonstr (const char *s, int len)
+{
+	int i;
+	
+	putchar ('"');
+	for (i=0; i<len; ++i)
+	{
+		unsigned char c = s[i];
+		if ((c == '"') || (c == '\\')) printf ("\\%c", c);
+		else if (c < 32) printf ("\\u%04x", c);
+		else putchar (c);
+	}
+	putchar ('"');
+}
+
+static int dumpfile (const char *fname, const char *tid, const char *mod,
+					 int json)
+{
+	FILE *f;
+	char magic[EVLOG_MAGICSZ];
+	char buf[65536];
+	evrecord rec;
+	
+	f = fopen (fname, "r");
+	if (! f)
+	{
+		fprintf (stderr, "%% Could not open %s\n", fname);
+		return 1;
+	}
+	
+	if ((fread (magic, EVLOG_MAGICSZ, 1, f) != 1) ||
+		memcmp (magic, EVLOG_MAGIC, EVLOG_MAGICSZ))
+	{
+		fprintf (stderr, "%% Not an event log: %s\n", fname);
+		fclose (f);
+		return 1;
+	}
+	
+	while (fread (&rec, sizeof (rec), 1, f) == 1)
+	{
+		size_t strsz;
+		const char *rtid, *rmod, *rcmd, *rpath;
+		char tbuf[32];
+		time_t t;
+		
+		strsz = rec.tidlen + rec.modlen + rec.cmdlen + rec.pathlen;
+		if ((rec.size != sizeof (rec) + strsz) ||
+			(fread (buf, 1, strsz, f) != strsz))
+		{
+			fprintf (stderr, "%% Truncated or corrupt record in %s\n",
+					 fname);
+			fclose (f);
+			return 1;
+		}
+		
+		rtid = buf;
+		rmod = rtid + rec.tidlen;
+		rcmd = rmod + rec.modlen;
+		rpath = rcmd + rec.cmdlen;
+		
+		/* Apply the filters */
+		if (tid && ((strlen (tid) != rec.tidlen) ||
+					memcmp (tid, rtid, rec.tidlen))) continue;
+		if (mod && ((strlen (mod) != rec.modlen) ||
+					memcmp (mod, rmod, rec.modlen))) continue;
+		
+		if (rec.status > 2) rec.status = 1;
+		
+		if (json)
+		{
+			printf ("{\"time\":%llu,\"transaction\":",
+					(unsigned long long) rec.when);
+			jsonstr (rtid, rec.tidlen);
+			printf (",\"module\":");
+			jsonstr (rmod, rec.modlen);
+			printf (",\"command\":");
+			jsonstr (rcmd, rec.cmdlen);
+			printf (",\"path\":");
+			jsonstr (rpath, rec.pathlen);
+			printf (",\"status\":\"%s\",\"code\":%u,\"usec\":%u}\n",
+					STATUS[rec.status], rec.code, rec.usec);
+		}
+		else
+		{
+			t = rec.when / 1000000;
+			strftime (tbuf, sizeof (tbuf), "%Y-%m-%d %H:%M:%S",
+					  localtime (&t));
+			printf ("%s.%06u %.*s %.*s %.*s %s %u %uus %.*s\n", tbuf,
+					(unsigned int) (rec.when % 1000000),
+					rec.tidlen, rtid, rec.modlen, rmod, rec.cmdlen, rcmd,
+					STATUS[rec.status], rec.code, rec.usec,
+					rec.pathlen, rpath);
+		}
+	}
+	
+	fclose (f);
+	return 0;
+}
+
+int main (int argc, char *argv[])
+{
+	const char *tid = NULL;
+	const char *mod = NULL;
+	int json = 0;
+	int res = 0;
+	int opt;
+	
+	while ((opt = getopt (argc, argv, "t:m:j")) != -1)
+	{
+		switch (opt)
+		{
+			case 't': tid = optarg; break;
+			case 'm': mod = optarg; break;
+			case 'j': json = 1; break;
+			default:
+				fprintf (stderr, "%% Usage: %s [-t transaction] [-m module] "
+						 "[-j] file...\n", argv[0]);
+				return 1;
+		}
+	}
+	
+	if (optind >= argc)
+	{
+		fprintf (stderr, "%% Usage: %s [-t transaction] [-m module] [-j] "
+				 "file...\n", argv[0]);
+		return 1;
+	}
+	
+	for (; optind < argc; ++optind)
+	{
+		if (dumpfile (argv[optind], tid, mod, json)) res = 1;
+	}
+	
+	return res;
+}
@@ -0,0 +1,178 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+#include <sys/types.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+
+#define EVLOG_KEEP		4
+#define EVLOG_MAXREC	4096
+
+EventLog ELog;
+
+// ==========================================================================
+// CONSTRUCTOR EventLog
+// ==========================================================================
+EventLog::EventLog (void)
+{
+	fd = -1;
+	maxsize = 0;
+	cursize = 0;
+	fdlock.meter ("eventlog");
+}
+
+// ==========================================================================
+// DESTRUCTOR EventLog
+// ==========================================================================
+EventLog::~EventLog (void)
+{
+	if (fd >= 0) ::close (fd);
+}
+
+// ==========================================================================
+// METHOD EventLog::open
+// ==========================================================================
+bool EventLog::open (const string &p, unsigned int sz)
+{
+	struct stat st;
+	int nfd;
+	
+	nfd = ::open (p.str(), O_WRONLY|O_APPEND|O_CREAT|O_NOFOLLOW|O_CLOEXEC,
+				  0600);
+	if (nfd < 0) return false;
+	
+	if (fstat (nfd, &st))
+	{
+		::close (nfd);
+		return false;
+	}
+	
+	// Without its magic the file is of no use to evdump.
+	if ((st.st_size == 0) &&
+		(::write (nfd, EVLOG_MAGIC, EVLOG_MAGICSZ) != EVLOG_MAGICSZ))
+	{
+		::close (nfd);
+		return false;
+	}
+	
+	exclusivesection (fdlock)
+	{
+		if (fd >= 0) ::close (fd);
+		fd = nfd;
+		path = p;
+		maxsize = sz;
+		cursize = (st.st_size == 0) ? EVLOG_MAGICSZ : st.st_size;
+	}
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD EventLog::command
+// ==========================================================================
+void EventLog::command (const string &tid, const string &module,
+						const string &cmd, const string &p, int status,
+						unsigned int code, unsigned int usec)
+{
+	char buf[EVLOG_MAXREC];
+	evrecord *rec = (evrecord *) buf;
+	struct timeval tv;
+	bool full = false;
+	
+	if (fd < 0) return;
+	
+	// Strings are cut off at the size their length field can hold,
+	// the path gets whatever room is left.
+	unsigned int tidlen = (tid.strlen() > 255) ? 255 : tid.strlen();
+	unsigned int modlen = (module.strlen() > 255) ? 255 : module.strlen();
+	unsigned int cmdlen = (cmd.strlen() > 255) ? 255 : cmd.strlen();
+	unsigned int left = EVLOG_MAXREC - sizeof (evrecord) - tidlen - modlen
+						- cmdlen;
+	unsigned int pathlen = (p.strlen() > left) ? left : p.strlen();
+	
+	gettimeofday (&tv, NULL);
+	memset (rec, 0, sizeof (evrecord));
+	rec->size = sizeof (evrecord) + tidlen + modlen + cmdlen + pathlen;
+	rec->type = EVTYPE_COMMAND;
+	rec->status = status;
+	rec->code = code;
+	rec->when = ((uint64_t) tv.tv_sec * 1000000ULL) + tv.tv_usec;
+	rec->usec = usec;
+	rec->tidlen = tidlen;
+	rec->modlen = modlen;
+	rec->cmdlen = cmdlen;
+	rec->pathlen = pathlen;
+	
+	char *o = buf + sizeof (evrecord);
+	memcpy (o, tid.str(), tidlen); o += tidlen;
+	memcpy (o, module.str(), modlen); o += modlen;
+	memcpy (o, cmd.str(), cmdlen); o += cmdlen;
+	memcpy (o, p.str(), pathlen);
+	
+	// Any number of workers can append at the same time, O_APPEND
+	// keeps their records apart. Only rotation needs them to wait.
+	sharedsection (fdlock)
+	{
+		if ((fd >= 0) && (::write (fd, buf, rec->size) == rec->size))
+		{
+			unsigned int sz = __sync_add_and_fetch (&cursize, rec->size);
+			if (maxsize && (sz > maxsize)) full = true;
+		}
+	}
+	
+	if (full) rotate ();
+}
+
+// ==========================================================================
+// METHOD EventLog::rotate
+// ==========================================================================
+void EventLog::rotate (void)
+{
+	exclusivesection (fdlock)
+	{
+		// Someone else may have beaten us to it.
+		if ((fd < 0) || (cursize <= maxsize)) breaksection return;
+		
+		for (int i=EVLOG_KEEP-1; i>0; --i)
+		{
+			string from = "%s.%i" %format (path, i);
+			string to = "%s.%i" %format (path, i+1);
+			rename (from.str(), to.str());
+		}
+		
+		string to = "%s.1" %format (path);
+		rename (path.str(), to.str());
+		
+		int nfd = ::open (path.str(), O_WRONLY|O_APPEND|O_CREAT|O_TRUNC|
+						  O_NOFOLLOW|O_CLOEXEC, 0600);
+		if ((nfd >= 0) &&
+			(::write (nfd, EVLOG_MAGIC, EVLOG_MAGICSZ) != EVLOG_MAGICSZ))
+		{
+			::close (nfd);
+			unlink (path.str());
+			nfd = -1;
+		}
+		
+		// Without a new file, event logging stops here.
+		if (nfd < 0)
+		{
+			AUTHDLOG (log::error, "eventlog", "Could not start new event "
+						"log, event logging stopped");
+		}
+		
+		::close (fd);
+		fd = nfd;
+		cursize = EVLOG_MAGICSZ;
+	}
+}
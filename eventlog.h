@@ -0,0 +1,52 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#ifndef _authd_eventlog_H
+#define _authd_eventlog_H 1
+
+/* ======================================================================== *\
+ | Format of the binary event log. This header is shared between the        |
+ | daemon and the evdump tool, so it should stay plain C.                   |
+ |                                                                          |
+ | The file starts with the 8 byte EVLOG_MAGIC, followed by records. Each   |
+ | record is an evrecord, followed by the transaction id, module, command   |
+ | and path strings, in that order, without terminating NUL characters.     |
+ | All numbers are in host byte order.                                      |
+\* ======================================================================== */
+
+#include <stdint.h>
+
+#define EVLOG_MAGIC			"AUTHDEV1"
+#define EVLOG_MAGICSZ		8
+
+#define EVTYPE_COMMAND		1
+
+#define EVSTATUS_OK			0
+#define EVSTATUS_FAIL		1
+#define EVSTATUS_UNKNOWN	2
+
+typedef struct
+{
+	uint16_t	size;		/* Size of the record, including strings */
+	uint8_t		type;		/* EVTYPE_* */
+	uint8_t		status;		/* EVSTATUS_* */
+	uint32_t	code;		/* Error code, 0 on success */
+	uint64_t	when;		/* Wall clock, microseconds since epoch */
+	uint32_t	usec;		/* Duration in microseconds */
+	uint8_t		tidlen;		/* Length of the transaction id */
+	uint8_t		modlen;		/* Length of the module name */
+	uint8_t		cmdlen;		/* Length of the command */
+	uint8_t		reserved;
+	uint16_t	pathlen;	/* Length of the path */
+	uint16_t	reserved2;
+	uint32_t	reserved3;
+} evrecord;
+
+#endif
@@ -0,0 +1,613 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+#include <sys/types.h>
+#include <sys/fsuid.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define COPYBUFSZ 65536
+
+unsigned long long FileInstaller::skippedFiles = 0;
+unsigned long long FileInstaller::skippedBytes = 0;
+
+#if defined (__GLIBC__) && \
+	((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 27)))
+  #define HAVE_COPY_FILE_RANGE 1
+#endif
+
+#if defined (__GLIBC__) && \
+	((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 14)))
+  #define HAVE_SYNCFS 1
+#endif
+
+/// From this many dirty paths on one filesystem, a single syncfs() is
+/// cheaper than flushing them one by one.
+#define SYNCFS_THRESHOLD 32
+
+// ==========================================================================
+// CONSTRUCTOR FsCredentials
+// ==========================================================================
+FsCredentials::FsCredentials (uid_t uid, gid_t gid)
+{
+	// Group first, changing the fsuid away from root first would
+	// leave us without the privilege to change the fsgid.
+	oldgid = setfsgid (gid);
+	olduid = setfsuid (uid);
+}
+
+// ==========================================================================
+// DESTRUCTOR FsCredentials
+// ==========================================================================
+FsCredentials::~FsCredentials (void)
+{
+	setfsuid (olduid);
+	setfsgid (oldgid);
+}
+
+// ==========================================================================
+// CONSTRUCTOR FileInstaller
+// ==========================================================================
+FileInstaller::FileInstaller (const string &tid, const string &destPath,
+							  uid_t fuid, gid_t fgid, unsigned int fmode)
+{
+	transactionid = tid;
+	dest = destPath;
+	uid = fuid;
+	gid = fgid;
+	mode = fmode;
+	tmpfd = -1;
+	done = false;
+	existed = false;
+	oldmode = 0;
+	syncdata = false;
+}
+
+// ==========================================================================
+// DESTRUCTOR FileInstaller
+// ==========================================================================
+FileInstaller::~FileInstaller (void)
+{
+	if (! done) abort ();
+}
+
+// ==========================================================================
+// METHOD FileInstaller::prepare
+// ==========================================================================
+bool FileInstaller::prepare (void)
+{
+	if (! writeRollback ())
+	{
+		abort ();
+		return false;
+	}
+
+	// Create a temporary file in the destination directory, we will
+	// write the new contents to this file first.
+	char tmpl[PATH_MAX];
+	const char *slash = strrchr (dest.str(), '/');
+	int dirlen = slash ? (slash - dest.str()) : 0;
+
+	if (snprintf (tmpl, PATH_MAX, "%.*s/.install_file.XXXXXX", dirlen,
+				  dest.str()) >= PATH_MAX)
+	{
+		error = "Destination path too long";
+		abort ();
+		return false;
+	}
+
+	FsCredentials creds (uid, gid);
+
+	tmpfd = mkstemp (tmpl);
+	if (tmpfd < 0)
+	{
+		error = "Error creating temporary file";
+		abort ();
+		return false;
+	}
+
+	tmpname = tmpl;
+
+	if (fchmod (tmpfd, mode))
+	{
+		error = "Tempfile chmod failed";
+		abort ();
+		return false;
+	}
+
+	return true;
+}
+
+// ==========================================================================
+// METHOD FileInstaller::skipUnchanged
+// ==========================================================================
+bool FileInstaller::skipUnchanged (int fd)
+{
+	struct stat sst;
+	struct stat dst;
+	int dfd;
+
+	if (fstat (fd, &sst)) return false;
+
+	{
+		FsCredentials creds (uid, gid);
+		dfd = open (dest.str(), O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
+	}
+
+	if (dfd < 0) return false;
+
+	if (fstat (dfd, &dst) || (! S_ISREG (dst.st_mode)) ||
+		(dst.st_nlink > 1) || (dst.st_size != sst.st_size) ||
+		(! sameContent (fd, dfd, sst.st_size)))
+	{
+		close (dfd);
+		return false;
+	}
+
+	close (dfd);
+
+	// Same data, but ownership or mode need fixing. Doing that here
+	// would mean a chown by root on whatever the user left at the
+	// path, so leave it to the normal install path.
+	if ((dst.st_uid != uid) || (dst.st_gid != gid) ||
+		((dst.st_mode & 07777) != mode))
+	{
+		return false;
+	}
+
+	done = true;
+
+	__sync_add_and_fetch (&skippedFiles, 1);
+	__sync_add_and_fetch (&skippedBytes, (unsigned long long) sst.st_size);
+	return true;
+}
+
+// ==========================================================================
+// METHOD FileInstaller::sameContent
+// ==========================================================================
+bool FileInstaller::sameContent (int afd, int bfd, off_t sz)
+{
+	char abuf[COPYBUFSZ];
+	char bbuf[COPYBUFSZ];
+	off_t offs = 0;
+
+	// A straight comparison is cheaper than hashing both sides, since
+	// both would have to be read in full anyway, and it can stop at
+	// the first difference.
+	while (offs < sz)
+	{
+		size_t want = ((sz - offs) > COPYBUFSZ) ? COPYBUFSZ : (sz - offs);
+		ssize_t asz = pread (afd, abuf, want, offs);
+		ssize_t bsz = pread (bfd, bbuf, want, offs);
+
+		if ((asz <= 0) || (asz != bsz)) return false;
+		if (memcmp (abuf, bbuf, asz)) return false;
+		offs += asz;
+	}
+
+	return true;
+}
+
+// ==========================================================================
+// METHOD FileInstaller::write
+// ==========================================================================
+bool FileInstaller::write (const char *data, size_t sz)
+{
+	size_t done = 0;
+
+	while (done < sz)
+	{
+		ssize_t wsz = ::write (tmpfd, data + done, sz - done);
+		if (wsz < 0)
+		{
+			if (errno == EINTR) continue;
+			error = "I/O error";
+			return false;
+		}
+		done += wsz;
+	}
+
+	return true;
+}
+
+// ==========================================================================
+// METHOD FileInstaller::copyFrom
+// ==========================================================================
+bool FileInstaller::copyFrom (int fd)
+{
+	char buf[COPYBUFSZ];
+	struct stat sst;
+	struct stat dst;
+
+	if (fstat (fd, &sst) || fstat (tmpfd, &dst))
+	{
+		error = "I/O error";
+		return false;
+	}
+
+#ifdef FICLONE
+	// On the same filesystem, try to let the new file share the data
+	// blocks of the source. It still gets its own inode, so owner and
+	// mode are not shared with the staged file.
+	if ((sst.st_dev == dst.st_dev) && (ioctl (tmpfd, FICLONE, fd) == 0))
+	{
+		return true;
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	// Otherwise let the kernel do the copying. Both descriptors keep
+	// their file offsets, so if this bails out halfway, the read/write
+	// loop below picks up where it left off.
+	while (true)
+	{
+		ssize_t csz = copy_file_range (fd, NULL, tmpfd, NULL,
+									   1 << 30, 0);
+		if (csz == 0) return true;
+		if (csz > 0) continue;
+		if (errno == EINTR) continue;
+		break;
+	}
+#endif
+
+	while (true)
+	{
+		ssize_t rsz = read (fd, buf, COPYBUFSZ);
+		if (rsz < 0)
+		{
+			if (errno == EINTR) continue;
+			error = "I/O error";
+			return false;
+		}
+		if (rsz == 0) break;
+		if (! write (buf, rsz)) return false;
+	}
+
+	return true;
+}
+
+// ==========================================================================
+// METHOD FileInstaller::commit
+// ==========================================================================
+bool FileInstaller::commit (void)
+{
+	if (tmpfd < 0) return false;
+
+	// The data has to be on disk before the rename does, or a crash
+	// could leave an empty file where the old one used to be.
+	if (syncdata && fdatasync (tmpfd))
+	{
+		error = "Tempfile sync failed";
+		abort ();
+		return false;
+	}
+
+	close (tmpfd);
+	tmpfd = -1;
+
+	FsCredentials creds (uid, gid);
+
+	// Make the temporary file the new active file.
+	if (rename (tmpname.str(), dest.str()))
+	{
+		error = "Tempfile install failed";
+		abort ();
+		return false;
+	}
+
+	done = true;
+	return true;
+}
+
+// ==========================================================================
+// METHOD FileInstaller::abort
+// ==========================================================================
+void FileInstaller::abort (void)
+{
+	done = true;
+
+	if (tmpfd >= 0)
+	{
+		close (tmpfd);
+		tmpfd = -1;
+	}
+
+	if (tmpname)
+	{
+		FsCredentials creds (uid, gid);
+		unlink (tmpname.str());
+		tmpname.crop ();
+	}
+
+	if (rbfile)
+	{
+		unlink (rbfile.str());
+		rbfile.crop ();
+	}
+}
+
+// ==========================================================================
+// METHOD FileInstaller::setSyncData
+// ==========================================================================
+void FileInstaller::setSyncData (bool sync)
+{
+	syncdata = sync;
+}
+
+// ==========================================================================
+// METHOD FileInstaller::setSavePath
+// ==========================================================================
+void FileInstaller::setSavePath (const string &path)
+{
+	savepath = path;
+}
+
+// ==========================================================================
+// METHOD FileInstaller::rollbackBase
+// ==========================================================================
+string *FileInstaller::rollbackBase (const string &transactionid,
+									 const string &path, string &error)
+{
+	returnclass (string) res retain;
+	string rbdir;
+
+	// Create the rollback directory for this session if it didn't exist.
+	rbdir = rootPath (PATH_ROLLBACK "/%s" %format (transactionid));
+	if (mkdir (rbdir.str(), 0700) && (errno != EEXIST))
+	{
+		error = "Error creating rollback directory";
+		return &res;
+	}
+
+	// Generate the filename for the rollback-file, this should come out
+	// the same as the one the opencore-tools would use.
+	res = rbdir;
+	res.strcat ('/');
+	for (int i=0; i<path.strlen(); ++i)
+	{
+		char c = path[i];
+		if ((c == '.') || (c == '/') || (c == ' ')) c = '_';
+		if ((i == 0) && (c == '_')) continue;
+		res.strcat (c);
+	}
+
+	return &res;
+}
+
+// ==========================================================================
+// METHOD FileInstaller::writeRollback
+// ==========================================================================
+bool FileInstaller::writeRollback (void)
+{
+	int rbfd;
+	int ofd;
+	struct stat st;
+	bool header = true;
+
+	// With a save path set, the caller takes care of the bookkeeping
+	// and just wants a copy of the original content.
+	if (savepath)
+	{
+		rbfile = savepath;
+		header = false;
+	}
+	else
+	{
+		rbfile = rollbackBase (transactionid, dest, error);
+		if (! rbfile) return false;
+		rbfile.strcat (".rollback");
+	}
+
+	rbfd = open (rbfile.str(), O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0600);
+	if (rbfd < 0)
+	{
+		rbfile.crop ();
+		error = "I/O error";
+		return false;
+	}
+
+	// Read the original file with the credentials of the new owner. We
+	// already hold the rollback-file open, so we can still write to it.
+	FsCredentials creds (uid, gid);
+
+	ofd = open (dest.str(), O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
+	if ((ofd < 0) && (errno == ENOENT))
+	{
+		existed = false;
+		if (! header)
+		{
+			close (rbfd);
+			unlink (rbfile.str());
+			rbfile.crop ();
+			return true;
+		}
+
+		string hdr = "CREATE %u %u %s\n" %format (uid, gid, dest);
+		bool res = (::write (rbfd, hdr.str(), hdr.strlen()) == hdr.strlen());
+		close (rbfd);
+		if (! res) error = "I/O error";
+		return res;
+	}
+
+	// Same rules as fcat: only plain files, no symlinks or hardlinks.
+	if ((ofd < 0) || fstat (ofd, &st) || (! S_ISREG (st.st_mode)) ||
+		(st.st_nlink > 1))
+	{
+		if (ofd >= 0) close (ofd);
+		close (rbfd);
+		error = "I/O error";
+		return false;
+	}
+
+	// We'll preserve the access bits. The worst that can happen is that
+	// the user would end up with a copy of the file he could already read
+	// since we're getting the original file contents as that user.
+	existed = true;
+	oldmode = st.st_mode & 07777;
+
+	bool res = true;
+	if (header)
+	{
+		string hdr = "UPDATE %u %u %o %s\n" %format (uid, gid, oldmode, dest);
+		res = (::write (rbfd, hdr.str(), hdr.strlen()) == hdr.strlen());
+	}
+
+	char buf[COPYBUFSZ];
+	while (res)
+	{
+		ssize_t rsz = read (ofd, buf, COPYBUFSZ);
+		if ((rsz < 0) && (errno == EINTR)) continue;
+		if (rsz <= 0)
+		{
+			res = (rsz == 0);
+			break;
+		}
+		if (::write (rbfd, buf, rsz) != rsz) res = false;
+	}
+
+	close (ofd);
+	close (rbfd);
+	if (! res) error = "I/O error";
+	return res;
+}
+
+// ==========================================================================
+// CONSTRUCTOR SyncBatch
+// ==========================================================================
+SyncBatch::SyncBatch (void)
+{
+}
+
+// ==========================================================================
+// DESTRUCTOR SyncBatch
+// ==========================================================================
+SyncBatch::~SyncBatch (void)
+{
+}
+
+// ==========================================================================
+// METHOD SyncBatch::parseLevel
+// ==========================================================================
+int SyncBatch::parseLevel (const string &name)
+{
+	if (name == "none") return DURABLE_NONE;
+	if (name == "file") return DURABLE_FILE;
+	if (name == "dir") return DURABLE_DIR;
+	return -1;
+}
+
+// ==========================================================================
+// METHOD SyncBatch::add
+// ==========================================================================
+void SyncBatch::add (const string &path)
+{
+	struct stat st;
+	
+	// Installing the same file twice only needs one flush.
+	if (paths.exists (path)) return;
+	if (lstat (path.str(), &st)) return;
+	
+	statstring dev = "%u" %format ((unsigned int) st.st_dev);
+	paths[path] = dev;
+	devices[dev] = devices[dev].uval() + 1;
+}
+
+// ==========================================================================
+// METHOD SyncBatch::clear
+// ==========================================================================
+void SyncBatch::clear (void)
+{
+	paths.clear ();
+	devices.clear ();
+}
+
+// ==========================================================================
+// METHOD SyncBatch::flush
+// ==========================================================================
+int SyncBatch::flush (int level)
+{
+	value dirs;
+	value wholefs;
+	int failed = 0;
+	
+	if (level == DURABLE_NONE)
+	{
+		clear ();
+		return 0;
+	}
+	
+#ifdef HAVE_SYNCFS
+	foreach (d, devices)
+	{
+		if (d.uval() >= SYNCFS_THRESHOLD) wholefs[d.id()] = false;
+	}
+#endif
+	
+	foreach (p, paths)
+	{
+		string path = p.id().sval();
+		statstring dev = p.sval();
+		
+		if (level == DURABLE_DIR)
+		{
+			int slash = path.strrchr ('/');
+			if (slash > 0) dirs[path.left (slash)] = dev;
+		}
+		
+		// One syncfs covers every other path on the same filesystem,
+		// directory entries included.
+		if (wholefs.exists (dev))
+		{
+			if (wholefs[dev].bval()) continue;
+			if (syncPath (path, true))
+			{
+				wholefs[dev] = true;
+				continue;
+			}
+		}
+		
+		if (! syncPath (path, false)) failed++;
+	}
+	
+	foreach (d, dirs)
+	{
+		if (wholefs.exists (d.sval()) && wholefs[d.sval()].bval()) continue;
+		if (! syncPath (d.id().sval(), false)) failed++;
+	}
+	
+	clear ();
+	return failed;
+}
+
+// ==========================================================================
+// METHOD SyncBatch::syncPath
+// ==========================================================================
+bool SyncBatch::syncPath (const string &path, bool wholefs)
+{
+	bool res;
+	int fd = open (path.str(), O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_NOCTTY);
+	if (fd < 0) return false;
+	
+#ifdef HAVE_SYNCFS
+	if (wholefs) res = (syncfs (fd) == 0);
+	else
+#endif
+	res = (fdatasync (fd) == 0);
+	
+	close (fd);
+	return res;
+}
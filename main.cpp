@@ -14,20 +14,52 @@
 #include <grace/system.h>
 #include <grace/tcpsocket.h>
 #include <grp.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 APPOBJECT(AuthdApp);
 
 MetaCache MCache;
 AuthdApp *AUTHD;
 bool DEMO;
+uid_t COREUID = (uid_t) -1; ///< Owner of staged files.
+gid_t COREGID = (gid_t) -1; ///< Group of staged files.
+int DURABILITY = DURABLE_FILE; ///< Default durability level.
+volatile int LOGMASK = 0xff; ///< Enabled log levels.
+string ROOTPREFIX; ///< Filesystem root for all I/O, empty for /.
 
 #define PATH_SWUPD_SOCKET "/var/openpanel/sockets/swupd/swupd.sock"
 
+// ==========================================================================
+// FUNCTION rootPath
+// ==========================================================================
+string *rootPath (const string &path)
+{
+	returnclass (string) res retain;
+	
+	res = ROOTPREFIX;
+	res.strcat (path);
+	return &res;
+}
+
 void handle_SIGTERM (int sig)
 {
 	AUTHD->shouldRun = false;
 }
 
+void handle_SIGHUP (int sig)
+{
+	AUTHD->reloadConf = true;
+}
+
 //  =========================================================================
 /// Constructor.
 /// Calls daemon constructor, initializes the configdb.
@@ -37,6 +69,8 @@ AuthdApp::AuthdApp (void)
 	  conf (this)
 {
 	shouldRun = true;
+	reloadConf = false;
+	daemonized = false;
 	AUTHD = this;
 }
 
@@ -63,11 +97,55 @@ int AuthdApp::main (void)
 	DEMO = false;
 	if (argv.exists ("--demo")) DEMO = true;
 	
+	// A latency profile makes demo handlers take their time.
+	if (argv.exists ("--demo-profile"))
+	{
+		string err;
+		if (! Demo.load (argv["--demo-profile"].sval(), err))
+		{
+			ferr.writeln ("%% %s" %format (err));
+			return 1;
+		}
+		DEMO = true;
+	}
+	
+	// Relocate all filesystem access under an alternative root. The
+	// tools find the same root through the environment. It is resolved
+	// here, we change directories when daemonizing and the scripts
+	// that get it run as root.
+	if (argv.exists ("--root"))
+	{
+		string root = argv["--root"].sval();
+		char *resolved = NULL;
+		
+		if ((root[0] != '/') || (! (resolved = realpath (root.str(), NULL))))
+		{
+			ferr.writeln ("%% Root must be an existing absolute path");
+			return 1;
+		}
+		
+		ROOTPREFIX = resolved;
+		free (resolved);
+		if (ROOTPREFIX == "/") ROOTPREFIX.crop ();
+		setenv ("OPENPANEL_ROOT", ROOTPREFIX.str(), 1);
+	}
+	
+	if (argv.exists ("--compile-modules"))
+	{
+		return compileModules ();
+	}
+	
+	if (argv.exists ("--microbench"))
+	{
+		return microBench ();
+	}
+	
 	string conferr; ///< Error return from configuration class.
 	
 	// Add watcher value for event log. System will daemonize after
 	// configuration was validated.
 	conf.addwatcher ("system/eventlog", &AuthdApp::confLog);
+	conf.addwatcher ("system/loglevel", &AuthdApp::confLogLevel);
 	
 	// Load will fail if watchers did not valiate.
 	if (! conf.load ("com.openpanel.svc.authd", conferr))
@@ -78,7 +156,94 @@ int AuthdApp::main (void)
 	
 	log (log::info, "main    ", "OpenPanel authd %s started", AUTHD_VERSION);
 	
-	string fname = "/var/openpanel/sockets/authd/authd.sock";
+	OCache.setLimit (conf["system"]["objectcache"].uval());
+	
+	// The binary event log is optional, next to the text log.
+	if (conf["system"]["binlog"].sval())
+	{
+		unsigned int binlogsize = 16*1024*1024;
+		if (conf["system"].exists ("binlogsize"))
+		{
+			binlogsize = conf["system"]["binlogsize"].uval();
+		}
+		
+		string binlog = rootPath (conf["system"]["binlog"].sval());
+		if (! ELog.open (binlog, binlogsize))
+		{
+			log (log::warning, "main    ", "Could not open binary event "
+				 "log %s" %format (conf["system"]["binlog"]));
+		}
+	}
+	
+	// Span tracing is optional as well, and costs next to nothing
+	// when it is off.
+	if (conf["system"]["trace"].sval())
+	{
+		unsigned int tracesize = 64*1024*1024;
+		if (conf["system"].exists ("tracesize"))
+		{
+			tracesize = conf["system"]["tracesize"].uval();
+		}
+		
+		string trace = rootPath (conf["system"]["trace"].sval());
+		if (! Trace.open (trace, tracesize))
+		{
+			log (log::warning, "main    ", "Could not open trace file %s"
+				 %format (conf["system"]["trace"]));
+		}
+	}
+	
+	// Lock metering adds two clock reads to every locked section, so
+	// it is opt-in.
+	if (conf["system"].exists ("lockstats"))
+	{
+		LOCKSTATS = conf["system"]["lockstats"].bval();
+	}
+	
+	// Capturing the command stream, for replay on a test system.
+	if (conf["system"]["capture"].sval())
+	{
+		unsigned int capturesize = 64*1024*1024;
+		if (conf["system"].exists ("capturesize"))
+		{
+			capturesize = conf["system"]["capturesize"].uval();
+		}
+		
+		string capture = rootPath (conf["system"]["capture"].sval());
+		if (! Capture.open (capture, capturesize))
+		{
+			log (log::warning, "main    ", "Could not open capture file %s"
+				 %format (conf["system"]["capture"]));
+		}
+	}
+	
+	if (conf["system"].exists ("durability"))
+	{
+		string dur = conf["system"]["durability"].sval();
+		DURABILITY = SyncBatch::parseLevel (dur);
+		if (DURABILITY < 0) DURABILITY = DURABLE_FILE;
+	}
+	
+	// Resolve the owner of staged files once, so we can compare ids
+	// instead of names for every file that gets installed. This also
+	// loads the user index.
+	value pw = UDB.getpwnam ("openpanel-core");
+	value gr = UDB.getgrnam ("openpanel-core");
+	if (pw) COREUID = (uid_t) pw["uid"].uval();
+	if (gr) COREGID = (gid_t) gr["gid"].uval();
+	if (ROOTPREFIX.strlen() && ((! pw) || (! gr)))
+	{
+		// A sandbox root is staged by whoever runs us.
+		COREUID = getuid ();
+		COREGID = getgid ();
+	}
+	else if ((! pw) || (! gr))
+	{
+		log (log::warning, "main    ", "Could not resolve openpanel-core, "
+			 "file installs will be denied");
+	}
+	
+	string fname = rootPath (PATH_SOCKET);
 	
 	if (fs.exists (fname))
 		fs.rm (fname);
@@ -98,19 +263,75 @@ int AuthdApp::main (void)
 	fs.chgrp (fname, "openpanel-authd");
 	fs.chmod (fname, 0770);
 	
-	for (int i=0; i<8; ++i)
+	for (int i=0; i<SOCKET_WORKERS; ++i)
 	{
 		new SocketWorker (&socks);
 	}
+	Status.workers = SOCKET_WORKERS;
+	
+	// Publish our state for monitoring tools.
+	StatusThread statusupdater;
+	if (Status.open (rootPath (STATUSPAGE_PATH))) statusupdater.start ();
+	else
+	{
+		log (log::warning, "main    ", "Could not create status page");
+	}
+	
+	// Load the metadata for all modules up front, unless the
+	// configuration asks us not to, or to do it in the background.
+	string prewarm = conf["system"]["prewarm"].sval();
+	PrewarmThread prewarmer;
+	
+	if (prewarm == "background") prewarmer.start ();
+	else if (prewarm != "off") prewarmCache ();
 	
 	delayedexitok ();
 	
 	signal (SIGTERM, handle_SIGTERM);
+	signal (SIGHUP, handle_SIGHUP);
 	
-	while (shouldRun) sleep (1);
+	while (shouldRun)
+	{
+		sleep (1);
+		
+		// Reloading the configuration runs the watchers, which is how
+		// the log level can be changed without a restart.
+		if (reloadConf)
+		{
+			reloadConf = false;
+			if (! conf.load ("com.openpanel.svc.authd", conferr))
+			{
+				log (log::error, "main    ", "Error reloading "
+					 "configuration: %s" %format (conferr));
+			}
+		}
+	}
 
 	log (log::info, "main", "Shutting down workers");
 	socks.shutdown ();
+	statusupdater.stop ();
+	prewarmer.stop ();
+	
+	value ocs = OCache.stats ();
+	log (log::info, "main", "Unchanged installs skipped: files=%u bytes=%u"
+		 %format ((unsigned int) FileInstaller::skippedFiles,
+				  (unsigned int) FileInstaller::skippedBytes));
+	
+	log (log::info, "main", "Object cache: hits=%u misses=%u entries=%u "
+		 "bytes=%u" %format (ocs["hits"].uval(), ocs["misses"].uval(),
+		 ocs["entries"].uval(), ocs["bytes"].uval()));
+	
+	value pcs = PCache.stats ();
+	log (log::info, "main", "Policy cache: hits=%u misses=%u ratio=%.3f "
+		 "entries=%u bytes=%u" %format (pcs["hits"].uval(),
+		 pcs["misses"].uval(), pcs["hitratio"].dval(), pcs["entries"].uval(),
+		 pcs["bytes"].uval()));
+	
+	value uds = UDB.stats ();
+	log (log::info, "main", "User index: hits=%u fallbacks=%u reloads=%u "
+		 "users=%u groups=%u" %format (uds["hits"].uval(),
+		 uds["fallbacks"].uval(), uds["reloads"].uval(), uds["users"].uval(),
+		 uds["groups"].uval()));
 	
 	// clean up the socket
 	fs.rm (fname);
@@ -120,6 +341,53 @@ int AuthdApp::main (void)
 	return 0;
 }
 
+//  =========================================================================
+/// Compile the metadata for all installed modules. Meant to be called
+/// from package scripts after a module was installed or upgraded, so
+/// the daemon doesn't have to parse its module.xml on first use.
+//  =========================================================================
+int AuthdApp::compileModules (void)
+{
+	int failed = 0;
+	value modules = MCache.listModules ();
+	
+	foreach (mname, modules)
+	{
+		value meta;
+		
+		if (MCache.compile (mname.sval(), meta))
+		{
+			fout.writeln ("Compiled module %s" %format (mname));
+		}
+		else
+		{
+			ferr.writeln ("%% Error compiling module %s" %format (mname));
+			failed++;
+		}
+	}
+	
+	return failed ? 1 : 0;
+}
+
+//  =========================================================================
+/// Load metadata for all installed modules into the MetaCache, spread
+/// out over the available cores.
+//  =========================================================================
+void AuthdApp::prewarmCache (void)
+{
+	unsigned long long tstart = usecnow ();
+	int nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > 16) nthreads = 16;
+	
+	PrewarmGroup grp;
+	int count = grp.run (nthreads);
+	
+	AUTHDLOG (log::info, "main    ", "Prewarmed metadata for %i modules "
+				"using %i threads in %i ms" %format (count, nthreads,
+				(int) ((usecnow() - tstart) / 1000)));
+}
+
 //  =========================================================================
 /// Configuration watcher for the event log.
 //  =========================================================================
@@ -134,6 +402,7 @@ bool AuthdApp::confLog (config::action act, keypath &kp,
 			// Check if the path for the event log exists.
 			tstr = strutil::makepath (nval.sval());
 			if (! tstr.strlen()) return true;
+			tstr = rootPath (tstr);
 			if (! fs.exists (tstr))
 			{
 				ferr.writeln ("%% Event log path %s does not exist" %format(tstr));
@@ -142,15 +411,74 @@ bool AuthdApp::confLog (config::action act, keypath &kp,
 			return true;
 			
 		case config::create:
-			// Set the event log target and daemonize.
-			addlogtarget (log::file, nval.sval(), 0xff, 1024*1024);
+			// Set the event log target and daemonize. This only
+			// happens once, a reload keeps the running log.
+			if (daemonized) return true;
+			daemonized = true;
+			addlogtarget (log::file, rootPath (nval.sval()), 0xff,
+						  1024*1024);
 			daemonize(true);
 			return true;
+		
+		case config::change:
+		case config::remove:
+			// Log targets can't be swapped out from under the running
+			// threads, the new setting waits for a restart.
+			log (log::warning, "main    ", "Event log setting changed, "
+				 "keeping the current log until restart");
+			return true;
+	}
+	
+	return false;
+}
+
+// ==========================================================================
+// METHOD AuthdApp::confLogLevel
+// ==========================================================================
+bool AuthdApp::confLogLevel (config::action act, keypath &kp,
+							 const value &nval, const value &oval)
+{
+	int mask = logLevelMask (nval.sval());
+	
+	switch (act)
+	{
+		case config::isvalid:
+			return (mask >= 0);
+		
+		case config::create:
+		case config::change:
+			if (mask < 0) return false;
+			if (mask != LOGMASK)
+			{
+				log (log::info, "main    ", "Log level set to %s"
+					 %format (nval));
+			}
+			LOGMASK = mask;
+			return true;
+		
+		case config::remove:
+			if (LOGMASK != 0xff)
+			{
+				log (log::info, "main    ", "Log level reset to info");
+			}
+			LOGMASK = 0xff;
+			return true;
 	}
 	
 	return false;
 }
 
+// ==========================================================================
+// METHOD AuthdApp::logLevelMask
+// ==========================================================================
+int AuthdApp::logLevelMask (const string &name)
+{
+	if (name == "info") return 0xff;
+	if (name == "warning") return 0xff & ~log::info;
+	if (name == "error") return 0xff & ~(log::info | log::warning);
+	return -1;
+}
+
 // ==========================================================================
 // CONSTRUCTOR SocketWorker
 // ==========================================================================
@@ -188,19 +516,34 @@ void SocketWorker::run (void)
 			caseselector (ev.type())
 			{
 				incaseof ("exit") :
-					log::write (log::info, "worker", "Shutting down on "
+					AUTHDLOG (log::info, "worker", "Shutting down on "
 								"request");
 					return;
 				
 				defaultcase :
-					log::write (log::warning, "worker", "Received unknown "
+					AUTHDLOG (log::warning, "worker", "Received unknown "
 								"event of type %S" %format (ev.type()));
 					break;
 			}
 			continue;
 		}
+		
+		StatusCount busy (Status.busy);
+		TraceConnection connspan;
+		CaptureConnection capconn;
+		__sync_add_and_fetch (&Status.accepted, 1);
+		
+		// Lines are waited for with a timeout, but the data behind
+		// installdata is read straight off the socket. Bound those reads
+		// too, so a client that stalls halfway can't pin the worker.
+		struct timeval rcvto;
+		rcvto.tv_sec = DATA_TIMEOUT;
+		rcvto.tv_usec = 0;
+		setsockopt (s.filno, SOL_SOCKET, SO_RCVTIMEO, &rcvto, sizeof (rcvto));
+		
 		try
 		{
+			unsigned long long hellostart = Trace.enabled ? usecnow() : 0;
 			int rounds = 0;
 			while (true)
 			{
@@ -214,13 +557,13 @@ void SocketWorker::run (void)
 					{
 						s.writeln ("-SHUTDOWN");
 						s.close ();
-						log::write (log::info, "worker", "Shutting down on "
+						AUTHDLOG (log::info, "worker", "Shutting down on "
 									"request");
 						return;
 					}
 					else if (ev)
 					{
-						log::write (log::error, "worker", "Unknown event "
+						AUTHDLOG (log::error, "worker", "Unknown event "
 									"with type <%S>" %format (ev.type()));
 					}
 				}
@@ -229,14 +572,14 @@ void SocketWorker::run (void)
 				{
 					s.writeln ("-TIMEOUT");
 					s.close ();
-					log::write (log::error, "worker", "Timeout");
+					AUTHDLOG (log::error, "worker", "Timeout");
 					break;
 				}
 			}
 			if (rounds > 30) continue;
 			if (line.strncmp ("hello ", 6))
 			{
-				log::write (log::warning, "worker",
+				AUTHDLOG (log::warning, "worker",
 							"Bogus greeting: %S" %format (line));
 				s.writeln ("-WTF?");
 				s.close();
@@ -247,8 +590,16 @@ void SocketWorker::run (void)
 				s.writeln ("+OK");
 			}
 			
+			Capture.hello (line);
+			
+			if (hellostart)
+			{
+				Trace.span ("hello", "worker", NULL, hellostart, usecnow());
+			}
+			
 			delete line.cutat (' ');
 			handler.setModule (line);
+			StatusCount intransaction (Status.transactions);
 			
 			handle (s);
 			if (handler.transactionid)
@@ -258,7 +609,7 @@ void SocketWorker::run (void)
 		}
 		catch (...)
 		{
-			log::write (log::error, "worker  ", "Connection closed, rolling "
+			AUTHDLOG (log::error, "worker  ", "Connection closed, rolling "
 						"back actions");
 			if (handler.transactionid)
 				handler.rollbackTransaction ();
@@ -274,7 +625,7 @@ void SocketWorker::handle (tcpsocket &s)
 {
 	bool shouldrun = true;
 	
-	log::write (log::info, "worker  ", "Handling connection for module <%S>"
+	AUTHDLOG (log::info, "worker  ", "Handling connection for module <%S>"
 				%format (handler.module));
 	
 	// Keep on going as long as there's stuff to do.
@@ -298,14 +649,14 @@ void SocketWorker::handle (tcpsocket &s)
 				{
 					s.writeln ("-SHUTDOWN");
 					s.close ();
-					log::write (log::info, "worker", "Shutting down on "
+					AUTHDLOG (log::info, "worker", "Shutting down on "
 								"request");
 					shouldShutdown = true;
 					return;
 				}
 				else if (ev)
 				{
-					log::write (log::error, "worker", "Unknown event "
+					AUTHDLOG (log::error, "worker", "Unknown event "
 								"with type <%S>" %format (ev.type()));
 				}
 			}
@@ -314,7 +665,7 @@ void SocketWorker::handle (tcpsocket &s)
 		}
 		if (rounds > 30)
 		{
-			log::write (log::error, "worker", "Timeout on socket");
+			AUTHDLOG (log::error, "worker", "Timeout on socket");
 			s.writeln ("-TIMEOUT");
 			throw (1);
 		}
@@ -331,8 +682,16 @@ void SocketWorker::handle (tcpsocket &s)
 			int errorcode = 1;
 			
 			cmd = strutil::splitquoted (line, ' ');
+			if (Capture.enabled) Capture.command (cmd, line);
+			unsigned long long cmdstart = usecnow ();
+			STATPOLICY = STATSCRIPT = 0;
 			
-			log::write (log::info, "worker", "Command line: %s" %format (line));
+			string cmdname = cmd[0];
+			TraceSpan cmdspan (cmdname.str(), "command");
+			AUTHD_PROBE2 (command__start, handler.module.str(),
+						  cmdname.str());
+			
+			AUTHDLOG (log::info, "worker", "Command line: %s" %format (line));
 
 			caseselector (cmd[0])
 			{
@@ -351,6 +710,18 @@ void SocketWorker::handle (tcpsocket &s)
 					if (handler.installFile (cmd[1], cmd[2])) cmdok = true;
 					break;
 				
+				incaseof ("installdata") :
+					if (cmd.count() != 3) break;
+					if (handler.installData (cmd[1], cmd[2].uval(), s))
+						cmdok = true;
+					break;
+				
+				incaseof ("installtree") :
+					if (cmd.count() != 3) break;
+					cmdok = handler.installTree (cmd[1], cmd[2], s);
+					if (cmdok) skipreply = true;
+					break;
+				
 				incaseof ("installuserfile") :
 					if (cmd.count() != 4) break;
 					if (handler.installUserFile (cmd[1], cmd[2], cmd[3])) cmdok = true;
@@ -447,11 +818,22 @@ void SocketWorker::handle (tcpsocket &s)
 					if (handler.runScriptExt (cmd[2], tval, cmd[1])) cmdok = true;
 					break;
 
+				incaseof ("durability") :
+					if (cmd.count() != 2) break;
+					cmdok = handler.setDurability (cmd[1]);
+					break;
+				
 				incaseof ("rollback") :
 					if (cmd.count() > 1) break;
 					cmdok = handler.rollbackTransaction ();
 					break;
 				
+				incaseof ("stats") :
+					if (cmd.count() != 1) break;
+					cmdok = handler.sendStats (s);
+					if (cmdok) skipreply = true;
+					break;
+				
 				incaseof ("getobject") :
 					if (cmd.count() < 2) break;
 					cmdok = handler.getObject (cmd[1].sval(), s);
@@ -463,9 +845,17 @@ void SocketWorker::handle (tcpsocket &s)
 					break;
 				
 				incaseof ("quit") :
-					log::write (log::info, "worker", "Exit on module request");
+					AUTHDLOG (log::info, "worker", "Exit on module request");
 					cmdok = true;
 					shouldrun = false;
+					
+					// Installs are only flushed at the end of the
+					// transaction, the reply to quit is where the
+					// durability level holds.
+					if (handler.transactionid)
+					{
+						handler.finishTransaction ();
+					}
 					try
 					{
 						s.writeln ("+OK");
@@ -479,10 +869,50 @@ void SocketWorker::handle (tcpsocket &s)
 					break;
 			}
 			
-			log::write (log::info, "worker  ", "Module=<%S> command=<%S> "
+			AUTHDLOG (log::info, "worker  ", "Module=<%S> command=<%S> "
 						"status=<%s>" %format (handler.module, cmd[0],
 							cmdok ? "OK" : noerrordata ? "UNKNOWN" : "FAIL"));
 			
+			// For the commands that take a destination, that is the
+			// more interesting path. Other arguments are left out,
+			// some of them are passwords.
+			string evpath = cmd[1];
+			if ((cmd[0] == "installfile") || (cmd[0] == "installtree"))
+			{
+				evpath = cmd[2];
+			}
+			
+			int evstatus = EVSTATUS_FAIL;
+			unsigned int evcode = handler.lasterrorcode;
+			if (cmdok)
+			{
+				evstatus = EVSTATUS_OK;
+				evcode = 0;
+			}
+			else if (noerrordata)
+			{
+				evstatus = EVSTATUS_UNKNOWN;
+				evcode = errorcode;
+			}
+			
+			unsigned int cmdusec = (unsigned int) (usecnow() - cmdstart);
+			__sync_add_and_fetch (&Status.commands, 1);
+			AUTHD_PROBE4 (command__end, handler.module.str(), cmdname.str(),
+						  evstatus, cmdusec);
+			
+			ELog.command (handler.transactionid, handler.module, cmd[0],
+						  evpath, evstatus, evcode, cmdusec);
+			
+			// Unknown commands are lumped together, so a module can't
+			// fill up the statistics with made-up names.
+			string statcmd = cmd[0];
+			if (noerrordata) statcmd = "(unknown)";
+			
+			Stats.record (statcmd, handler.module, evstatus,
+						  (! cmdok) && (evcode == ERR_POLICY), cmdusec,
+						  (unsigned int) STATPOLICY,
+						  (unsigned int) STATSCRIPT);
+			
 			if (cmdok && (! skipreply)) s.writeln ("+OK");
 			else if (! skipreply)
 			{
@@ -492,7 +922,7 @@ void SocketWorker::handle (tcpsocket &s)
 					errorcode = handler.lasterrorcode;
 				}
 				s.writeln ("-ERR:%i:%S" %format (errorcode, errorstr));
-				log::write (log::error, "worker", "Error %i: %S"
+				AUTHDLOG (log::error, "worker", "Error %i: %S"
 							%format (errorcode, errorstr));
 			}
 		}
@@ -505,6 +935,7 @@ void SocketWorker::handle (tcpsocket &s)
 SocketGroup::SocketGroup (void)
 {
 	shouldShutdown = false;
+	listenSock.meter ("listener");
 }
 
 // ==========================================================================
@@ -559,6 +990,8 @@ void SocketGroup::shutdown (void)
 CommandHandler::CommandHandler (void)
 {
 	transactionid = strutil::uuid ();
+	durability = DURABILITY;
+	txstart = usecnow ();
 }
 
 // ==========================================================================
@@ -582,7 +1015,7 @@ bool CommandHandler::runScriptExt (const string &scriptName,
 								const value &arguments,
 								const string &asUser)
 {
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("runuserscript");
 	string realUser = asUser;
 	if (! guard.checkScriptAccess(module, scriptName, realUser, lasterror))
 	{
@@ -600,7 +1033,7 @@ bool CommandHandler::runScript (const string &scriptName,
 								const value &arguments,
 								const string &asUser)
 {
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("runscript");
 	static string AlphaNumeric ("abcdefghijklmnopqrstuvwxyz"
 								"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 								"0123456789_.-");
@@ -616,12 +1049,12 @@ bool CommandHandler::runScript (const string &scriptName,
 		return false;
 	}
 
-	log::write (log::info, "handler ", "Runscript module=<%S> id=<%S> "
+	AUTHDLOG (log::info, "handler ", "Runscript module=<%S> id=<%S> "
 				"name=<%S> argc=<%i>" %format (module, transactionid,
 											   scriptName, arguments.count()));
 	
 	// Fill in the fully qualified path to the script.
-	scriptPath = "/var/openpanel/tools/%s" %format (scriptName);
+	scriptPath = rootPath (PATH_TOOLS "/%s" %format (scriptName));
 	
 	// Croak if the script doesn't exist.
 	if (! fs.exists (scriptPath))
@@ -638,9 +1071,19 @@ bool CommandHandler::runScript (const string &scriptName,
 	}
 	
 	// Realize the system process.
+	StatTimer scripttime (STATSCRIPT);
+	unsigned long long spawnstart = usecnow ();
+	AUTHD_PROBE2 (script__spawn, module.str(), scriptName.str());
 	systemprocess proc (cmdLine, true, asUser);
 	proc.run ();
 	
+	if (Trace.enabled)
+	{
+		Trace.span ("spawn", "script", scriptName.str(), spawnstart,
+					usecnow());
+	}
+	TraceSpan waitspan ("wait", "script", scriptName.str());
+	
 	string line;
 	string rdata;
 	
@@ -661,6 +1104,8 @@ bool CommandHandler::runScript (const string &scriptName,
 	// Close the process and serialize the return value.
 	proc.close ();
 	proc.serialize ();
+	AUTHD_PROBE4 (script__exit, module.str(), scriptName.str(),
+				  proc.retval(), (unsigned int) (usecnow() - spawnstart));
 	
 	// Non-zero return: error condition.
 	if (proc.retval ())
@@ -685,8 +1130,8 @@ bool CommandHandler::runScript (const string &scriptName,
 bool CommandHandler::installUserFile (const string &fname, const string &dpath,
 									  const string &user)
 {
-	if (DEMO) return true;
-	log::write (log::info, "handler", "installUserFile (%s,%s,%s)"
+	if (DEMO) return Demo.simulate ("installuserfile");
+	AUTHDLOG (log::info, "handler", "installUserFile (%s,%s,%s)"
 						%format (fname, dpath, user));
 	string pdpath = (dpath[0] == '/') ? dpath.mid(1) : dpath;
 	if (dpath.strstr ("..") >= 0)
@@ -694,7 +1139,7 @@ bool CommandHandler::installUserFile (const string &fname, const string &dpath,
 		lasterrorcode = ERR_POLICY;
 		lasterror = "Destination directory contains illegal characters";
 		
-		log::write (log::error, "handler", "Illegal characters in "
+		AUTHDLOG (log::error, "handler", "Illegal characters in "
 					"makeuserdir argument");
 		return false;
 	}
@@ -706,45 +1151,45 @@ bool CommandHandler::installUserFile (const string &fname, const string &dpath,
 	uid_t destuid = 0;
 	gid_t destgid = 0;
 	
-	gr = kernel.userdb.getgrnam ("openpaneluser");
+	gr = UDB.getgrnam ("openpaneluser");
 	if (! gr)
 	{
 		lasterrorcode = ERR_NOT_FOUND;
 		lasterror = "The openpaneluser group was not found";
 		
-		log::write (log::error, "handler", "No openpaneluser group found");
+		AUTHDLOG (log::error, "handler", "No openpaneluser group found");
 		return false;
 	}
 	
-	pw = kernel.userdb.getpwnam (user);
+	pw = UDB.getpwnam (user);
 	if (! pw)
 	{
 		lasterrorcode = ERR_NOT_FOUND;
 		lasterror = "The user was not found";
-		log::write (log::error, "handler", "Unknown user <%S>" %format (user));
+		AUTHDLOG (log::error, "handler", "Unknown user <%S>" %format (user));
 		return false;
 	}
 	
 	destuid = pw["uid"].uval();
 	destgid = pw["gid"].uval();
 	
-	ugr = kernel.userdb.getgrgid (destgid);
+	ugr = UDB.getgrgid (destgid);
 	if ( ! ugr)
 	{
 		lasterrorcode = ERR_NOT_FOUND;
 		lasterror = "The user's primary group was not found";
 		
-		log::write (log::error, "handler", "Could not back-resolve gid #%u"
+		AUTHDLOG (log::error, "handler", "Could not back-resolve gid #%u"
 					%format (pw["gid"].uval()));
 		return false;
 	}
 	
-	if (! gr["members"].exists (user))
+	if (! UDB.isMember ("openpaneluser", user))
 	{
 		lasterrorcode = ERR_POLICY;
 		lasterror = "The user is not a member of group openpaneluser";
 		
-		log::write (log::error, "handler", "User <%S> not a member of "
+		AUTHDLOG (log::error, "handler", "User <%S> not a member of "
 					"group openpaneluser" %format (user));
 		return false;
 	}
@@ -762,52 +1207,103 @@ bool CommandHandler::installUserFile (const string &fname, const string &dpath,
 bool CommandHandler::installFile (const string &fname, const string &_dpath,
 								  uid_t destuid, gid_t destgid)
 {
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("installfile");
 	string tfname;
 	string tdname;
 	value perms;
 	string guarderr;
 	string dpath = _dpath;
+	int srcfd = -1;
 	
 	if (dpath.strlen() && (dpath[-1] == '/'))
 	{
 		dpath.crop (dpath.strlen() - 1);
 	}
 	
-	log::write (log::info, "handler ", "Installfile module=<%S> id=<%S> "
+	AUTHDLOG (log::info, "handler ", "Installfile module=<%S> id=<%S> "
 				"name=<%S> dpath=<%S>" %format (module, transactionid,
 					fname, dpath));
 	
-	tfname = guard.translateSource (module, fname, guarderr);
-	if (! tfname)
+	if (! guard.checkDestination (module, fname, dpath, perms, guarderr))
 	{
-		log::write (log::info, "handler ", "Source policy fail: %s"
+		AUTHDLOG (log::info, "handler ", "Dest policy fail: %s"
 						%format (guarderr));
 		lasterrorcode = ERR_POLICY;
-		lasterror = "Source file name does not match policy: ";
+		lasterror = "Destination file name does not match policy: ";
 		lasterror.strcat (guarderr);
 		return false;
 	}
 	
-	if (! guard.checkDestination (module, fname, dpath, perms, guarderr))
+	tfname = guard.translateSource (module, fname, srcfd, guarderr);
+	if (! tfname)
 	{
-		log::write (log::info, "handler ", "Dest policy fail: %s"
+		AUTHDLOG (log::info, "handler ", "Source policy fail: %s"
 						%format (guarderr));
 		lasterrorcode = ERR_POLICY;
-		lasterror = "Destination file name does not match policy: ";
+		lasterror = "Source file name does not match policy: ";
 		lasterror.strcat (guarderr);
 		return false;
 	}
 	
-	tdname = guard.translateDestination (dpath, fname);
+	tdname = rootPath (guard.translateDestination (dpath, fname));
+
+	uid_t uid = destuid;
+	gid_t gid = destgid;
+	unsigned int mode;
+	
+	if (! resolveFilePerms (perms, uid, gid, mode))
+	{
+		close (srcfd);
+		return false;
+	}
+	
+	// Copy straight from the descriptor that translateSource verified,
+	// unless the destination already has the same content.
+	FileInstaller inst (transactionid, tdname, uid, gid, mode);
+	inst.setSyncData (durability != DURABLE_NONE);
+	if (inst.skipUnchanged (srcfd))
+	{
+		close (srcfd);
+		AUTHDLOG (log::info, "handler ", "Installfile module=<%S> id=<%S> "
+					"dest=<%S> status=<unchanged>" %format (module,
+						transactionid, tdname));
+		
+		lasterrorcode = 0;
+		if (lasterror) lasterror.crop ();
+		return true;
+	}
+	
+	bool res = inst.prepare() && inst.copyFrom (srcfd) && inst.commit();
+	close (srcfd);
+	
+	if (! res)
+	{
+		AUTHDLOG (log::error, "handler ", "Error installing <%S>: %s"
+					%format (tdname, inst.error));
+		lasterrorcode = ERR_CMD_FAILED;
+		lasterror = inst.error;
+		return false;
+	}
+	
+	pending.add (tdname);
+	lasterrorcode = 0;
+	if (lasterror) lasterror.crop ();
+	return true;
+}
 
+// ==========================================================================
+// METHOD CommandHandler::resolveFilePerms
+// ==========================================================================
+bool CommandHandler::resolveFilePerms (const value &perms, uid_t &destuid,
+									   gid_t &destgid, unsigned int &mode)
+{
 	uid_t uid = 0;
 	gid_t gid = 0;
-	unsigned int mode = 0640;
+	mode = 0640;
 	
 	if (perms.exists ("user"))
 	{
-		value pw = kernel.userdb.getpwnam (perms["user"].sval());
+		value pw = UDB.getpwnam (perms["user"].sval());
 		if (pw)
 		{
 			uid = (uid_t) pw["uid"].uval();
@@ -816,14 +1312,14 @@ bool CommandHandler::installFile (const string &fname, const string &_dpath,
 	}
 	if (perms.exists ("group"))
 	{
-		value pw = kernel.userdb.getgrnam (perms["group"].sval());
+		value pw = UDB.getgrnam (perms["group"].sval());
 		if (pw)
 		{
 			gid = (gid_t) pw["gid"].uval();
 		}
 		else
 		{
-			log::write (log::error, "handler ", "Cannot find group %s"
+			AUTHDLOG (log::error, "handler ", "Cannot find group %s"
 							%format (perms["group"]));
 			lasterrorcode = ERR_NOT_FOUND;
 			lasterror = "Unknown group: ";
@@ -835,107 +1331,359 @@ bool CommandHandler::installFile (const string &fname, const string &_dpath,
 	if ( (!uid) && (destuid) ) uid = destuid;
 	if ( (!gid) && (destgid) ) gid = destgid;
 	
+	destuid = uid;
+	destgid = gid;
+	
 	if (perms.exists ("perms"))
 	{
 		mode = perms["perms"].sval().toint (8);
 	}
 	
-	value args;
-	string modestr;
-	modestr.printf ("%o", mode);
-	args.newval() = transactionid;
-	args.newval() = tfname;
-	args.newval() = tdname;
-	args.newval() = uid; args[-1].sval();
-	args.newval() = gid; args[-1].sval();
-	args.newval() = modestr;
-	
-	return runScript ("install-single-file", args);
+	return true;
 }
 
 // ==========================================================================
-// METHOD CommandHandler::makeDir
+// METHOD CommandHandler::installData
 // ==========================================================================
-bool CommandHandler::makeDir (const string &_dpath)
+bool CommandHandler::installData (const string &destPath, unsigned int sz,
+								  file &in)
 {
-	if (DEMO) return true;
-
-	string tdname;
+	string fname;
+	string dpath;
 	value perms;
 	string guarderr;
-	string dpath = _dpath;
 	
-	if (dpath.strlen() && (dpath[-1] == '/'))
+	AUTHDLOG (log::info, "handler ", "Installdata module=<%S> id=<%S> "
+				"path=<%S> size=<%u>" %format (module, transactionid,
+					destPath, sz));
+	
+	// Whatever happens, the data is coming our way, so make sure it is
+	// consumed to keep the protocol in sync.
+	if (DEMO)
 	{
-		dpath.crop (dpath.strlen() - 1);
+		return skipData (in, sz) && Demo.simulate ("installdata");
 	}
 	
-	log::write (log::info, "handler ", "Makedir module=<%S> id=<%S> "
-				"dpath=<%S>" %format (module, transactionid, dpath));
+	int slash = destPath.strrchr ('/');
+	if ((slash < 1) || (slash == (destPath.strlen() - 1)) ||
+		(destPath.strstr ("..") >= 0))
+	{
+		lasterrorcode = ERR_POLICY;
+		lasterror = "Invalid destination path";
+		skipData (in, sz);
+		return false;
+	}
 	
-	if (! guard.checkDestination (module, "", dpath, perms, guarderr))
+	dpath = destPath.left (slash);
+	fname = destPath.mid (slash+1);
+	
+	// The file name takes the role of the staged source file when
+	// matching against the fileops.
+	if (! guard.checkDestination (module, fname, dpath, perms, guarderr))
 	{
-		log::write (log::info, "handler ", "Dest policy fail: %s"
+		AUTHDLOG (log::info, "handler ", "Dest policy fail: %s"
 						%format (guarderr));
 		lasterrorcode = ERR_POLICY;
-		lasterror = "Destination directory does not match policy: ";
+		lasterror = "Destination file name does not match policy: ";
 		lasterror.strcat (guarderr);
+		skipData (in, sz);
 		return false;
 	}
 	
-	string fuser = "root";
-	string fgroup = "root";
-	unsigned int mode = 0600;
+	uid_t uid = 0;
+	gid_t gid = 0;
+	unsigned int mode;
 	
-	if (perms.exists ("user"))
+	if (! resolveFilePerms (perms, uid, gid, mode))
 	{
-		value pw = kernel.userdb.getpwnam (perms["user"].sval());
-		if (pw)
-		{
-			fuser = perms["user"];
-		}
+		skipData (in, sz);
+		return false;
 	}
-	if (perms.exists ("group"))
+	
+	string iopath = rootPath (destPath);
+	FileInstaller inst (transactionid, iopath, uid, gid, mode);
+	inst.setSyncData (durability != DURABLE_NONE);
+	if (! inst.prepare ())
 	{
-		value pw = kernel.userdb.getgrnam (perms["group"].sval());
-		if (pw)
-		{
-			fgroup = perms["group"];
-		}
-		else
-		{
-			log::write (log::error, "handler ", "Cannot find group %s"
-							%format (perms["group"]));
-			lasterrorcode = ERR_NOT_FOUND;
-			lasterror = "Unknown group: ";
-			lasterror.strcat (perms["group"].sval());
-			return false;
-		}
+		AUTHDLOG (log::error, "handler ", "Error installing <%S>: %s"
+					%format (destPath, inst.error));
+		lasterrorcode = ERR_CMD_FAILED;
+		lasterror = inst.error;
+		skipData (in, sz);
+		return false;
 	}
-	if (perms.exists ("perms"))
+	
+	// Stream the data from the socket straight into the temporary file.
+	unsigned int left = sz;
+	bool writeok = true;
+	
+	while (left)
 	{
-		mode = perms["perms"].sval().toint (8);
-		if (mode & 0700) mode |= 0100;
-		if (mode & 0070) mode |= 0010;
-		if (mode & 0007) mode |= 0001;
+		string chunk = in.read ((left > 65536) ? 65536 : left);
+		if (! chunk.strlen()) throw (1);
+		
+		if (writeok) writeok = inst.write (chunk.str(), chunk.strlen());
+		left -= chunk.strlen();
 	}
 	
-	if (fs.isdir (dpath))
+	if ((! writeok) || (! inst.commit ()))
 	{
-		log::write (log::warning, "handler", "Directory <%s> already "
-					"existed when trying to create" %format (dpath));
+		AUTHDLOG (log::error, "handler ", "Error installing <%S>: %s"
+					%format (destPath, inst.error));
+		lasterrorcode = ERR_CMD_FAILED;
+		lasterror = inst.error;
+		return false;
 	}
-	else if (!fs.mkdir (dpath))
-	{
-		log::write (log::error, "handler", "Cannot create dir <%s>"
+	
+	pending.add (iopath);
+	lasterrorcode = 0;
+	if (lasterror) lasterror.crop ();
+	return true;
+}
+
+// ==========================================================================
+// METHOD CommandHandler::skipData
+// ==========================================================================
+bool CommandHandler::skipData (file &in, unsigned int sz)
+{
+	unsigned int left = sz;
+	
+	while (left)
+	{
+		string chunk = in.read ((left > 65536) ? 65536 : left);
+		
+		// A connection that stops sending halfway through, or goes
+		// quiet for DATA_TIMEOUT, is of no further use to us.
+		if (! chunk.strlen()) throw (1);
+		left -= chunk.strlen();
+	}
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD CommandHandler::installTree
+// ==========================================================================
+bool CommandHandler::installTree (const string &_srcdir, const string &_dpath,
+								  file &out)
+{
+	string srcdir = _srcdir;
+	string dpath = _dpath;
+	string guarderr;
+	value entries;
+	
+	if (srcdir.strlen() && (srcdir[-1] == '/'))
+	{
+		srcdir.crop (srcdir.strlen() - 1);
+	}
+	if (dpath.strlen() && (dpath[-1] == '/'))
+	{
+		dpath.crop (dpath.strlen() - 1);
+	}
+	
+	AUTHDLOG (log::info, "handler ", "Installtree module=<%S> id=<%S> "
+				"src=<%S> dpath=<%S>" %format (module, transactionid,
+					srcdir, dpath));
+	
+	if ((! srcdir) || (srcdir[0] == '/') || (srcdir.strstr ("..") >= 0) ||
+		(dpath[0] != '/') || (dpath.strstr ("..") >= 0))
+	{
+		lasterrorcode = ERR_POLICY;
+		lasterror = "Invalid path";
+		return false;
+	}
+	
+	if (DEMO)
+	{
+		Demo.simulate ("installtree");
+		out.writeln ("+OK 0");
+		return true;
+	}
+	
+	TreeInstaller tree (transactionid);
+	if (! tree.scan (module, srcdir, dpath, entries))
+	{
+		lasterrorcode = ERR_NOT_FOUND;
+		lasterror = tree.error;
+		return false;
+	}
+	
+	// Check every entry against the fileops before anything is
+	// touched, so a tree is never installed halfway because of
+	// policy.
+	foreach (e, entries)
+	{
+		value perms;
+		uid_t uid = 0;
+		gid_t gid = 0;
+		unsigned int mode;
+		string epath = e["dest"];
+		
+		if (e["type"] == "dir")
+		{
+			if (! guard.checkDestination (module, "", epath, perms,
+										  guarderr))
+			{
+				lasterrorcode = ERR_POLICY;
+				lasterror = "Destination directory does not match "
+							"policy: %s: %s" %format (epath, guarderr);
+				return false;
+			}
+			
+			if (! resolveFilePerms (perms, uid, gid, mode)) return false;
+			
+			// Same defaults as makedir.
+			if (! perms.exists ("perms")) mode = 0600;
+			if (mode & 0700) mode |= 0100;
+			if (mode & 0070) mode |= 0010;
+			if (mode & 0007) mode |= 0001;
+			
+			tree.addDir (epath, uid, gid, mode);
+			continue;
+		}
+		
+		string fdir = epath.left (epath.strrchr ('/'));
+		int srcfd = -1;
+		
+		if (! guard.checkDestination (module, e["src"], fdir, perms,
+									  guarderr))
+		{
+			lasterrorcode = ERR_POLICY;
+			lasterror = "Destination file name does not match policy: "
+						"%s: %s" %format (epath, guarderr);
+			return false;
+		}
+		
+		string tfname;
+		tfname = guard.translateSource (module, e["src"], srcfd, guarderr);
+		if (! tfname)
+		{
+			lasterrorcode = ERR_POLICY;
+			lasterror = "Source file name does not match policy: "
+						"%s: %s" %format (e["src"], guarderr);
+			return false;
+		}
+		close (srcfd);
+		
+		if (! resolveFilePerms (perms, uid, gid, mode)) return false;
+		tree.addFile (e["src"], epath, uid, gid, mode);
+	}
+	
+	tree.syncdata = (durability != DURABLE_NONE);
+	bool treeok = tree.run (module, 4);
+	tree.collect (pending);
+	
+	if (! treeok)
+	{
+		AUTHDLOG (log::error, "handler ", "Error installing tree <%S>: %s"
+					%format (dpath, tree.error));
+		lasterrorcode = ERR_CMD_FAILED;
+		lasterror = tree.error;
+		return false;
+	}
+	
+	// Every file is in place, the summary tells the module which ones
+	// were left unchanged.
+	string body = tree.summary ();
+	string hdr = "+OK %u\n" %format (body.strlen());
+	
+	if (! (sendAll (out.filno, hdr.str(), hdr.strlen()) &&
+		   sendAll (out.filno, body.str(), body.strlen())))
+	{
+		AUTHDLOG (log::error, "handler", "Error sending tree summary");
+		throw (1);
+	}
+	
+	lasterrorcode = 0;
+	if (lasterror) lasterror.crop ();
+	return true;
+}
+
+// ==========================================================================
+// METHOD CommandHandler::makeDir
+// ==========================================================================
+bool CommandHandler::makeDir (const string &_dpath)
+{
+	if (DEMO) return Demo.simulate ("makedir");
+
+	string tdname;
+	value perms;
+	string guarderr;
+	string dpath = _dpath;
+	
+	if (dpath.strlen() && (dpath[-1] == '/'))
+	{
+		dpath.crop (dpath.strlen() - 1);
+	}
+	
+	AUTHDLOG (log::info, "handler ", "Makedir module=<%S> id=<%S> "
+				"dpath=<%S>" %format (module, transactionid, dpath));
+	
+	if (! guard.checkDestination (module, "", dpath, perms, guarderr))
+	{
+		AUTHDLOG (log::info, "handler ", "Dest policy fail: %s"
+						%format (guarderr));
+		lasterrorcode = ERR_POLICY;
+		lasterror = "Destination directory does not match policy: ";
+		lasterror.strcat (guarderr);
+		return false;
+	}
+	
+	string fuser = "root";
+	string fgroup = "root";
+	unsigned int mode = 0600;
+	
+	if (perms.exists ("user"))
+	{
+		value pw = UDB.getpwnam (perms["user"].sval());
+		if (pw)
+		{
+			fuser = perms["user"];
+		}
+	}
+	if (perms.exists ("group"))
+	{
+		value pw = UDB.getgrnam (perms["group"].sval());
+		if (pw)
+		{
+			fgroup = perms["group"];
+		}
+		else
+		{
+			AUTHDLOG (log::error, "handler ", "Cannot find group %s"
+							%format (perms["group"]));
+			lasterrorcode = ERR_NOT_FOUND;
+			lasterror = "Unknown group: ";
+			lasterror.strcat (perms["group"].sval());
+			return false;
+		}
+	}
+	if (perms.exists ("perms"))
+	{
+		mode = perms["perms"].sval().toint (8);
+		if (mode & 0700) mode |= 0100;
+		if (mode & 0070) mode |= 0010;
+		if (mode & 0007) mode |= 0001;
+	}
+	
+	string iopath = rootPath (dpath);
+	
+	if (fs.isdir (iopath))
+	{
+		AUTHDLOG (log::warning, "handler", "Directory <%s> already "
+					"existed when trying to create" %format (dpath));
+	}
+	else if (!fs.mkdir (iopath))
+	{
+		AUTHDLOG (log::error, "handler", "Cannot create dir <%s>"
 						%format (dpath));
 		return false;
 	}
 
-	log::write (log::info, "handler", "Setting up perms: %s/%s %o"
+	AUTHDLOG (log::info, "handler", "Setting up perms: %s/%s %o"
 					%format (fuser, fgroup, mode));
-	fs.chown (dpath, fuser, fgroup);
-	fs.chmod (dpath, mode);
+	fs.chown (iopath, fuser, fgroup);
+	fs.chmod (iopath, mode);
 	
 	return true;
 }
@@ -947,15 +1695,37 @@ bool CommandHandler::makeUserDir (const string &dpath,
 								  const string &user,
 								  const string &modestr)
 {
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("makeuserdir");
 	string pdpath = (dpath[0] == '/') ? dpath.mid(1) : dpath;
-	int mode = modestr.toint (8);
+	int mode = 0;
+	
+	// Only permission bits, in octal.
+	for (int i=0; i<modestr.strlen(); ++i)
+	{
+		if ((modestr[i] < '0') || (modestr[i] > '7') || (mode > 0777))
+		{
+			mode = -1;
+			break;
+		}
+		mode = (mode << 3) | (modestr[i] - '0');
+	}
+	
+	if ((! modestr) || (mode < 0))
+	{
+		lasterrorcode = ERR_POLICY;
+		lasterror = "Invalid directory mode";
+		
+		AUTHDLOG (log::error, "handler", "Invalid mode in makeuserdir "
+					"argument");
+		return false;
+	}
+	
 	if (dpath.strstr ("..") >= 0)
 	{
 		lasterrorcode = ERR_POLICY;
 		lasterror = "Destination directory contains illegal characters";
 		
-		log::write (log::error, "handler", "Illegal characters in "
+		AUTHDLOG (log::error, "handler", "Illegal characters in "
 					"makeuserdir argument");
 		return false;
 	}
@@ -967,45 +1737,45 @@ bool CommandHandler::makeUserDir (const string &dpath,
 	uid_t destuid;
 	gid_t destgid;
 	
-	gr = kernel.userdb.getgrnam ("openpaneluser");
+	gr = UDB.getgrnam ("openpaneluser");
 	if (! gr)
 	{
 		lasterrorcode = ERR_NOT_FOUND;
 		lasterror = "The openpaneluser group was not found";
 		
-		log::write (log::error, "handler", "No openpaneluser group found");
+		AUTHDLOG (log::error, "handler", "No openpaneluser group found");
 		return false;
 	}
 	
-	pw = kernel.userdb.getpwnam (user);
+	pw = UDB.getpwnam (user);
 	if (! pw)
 	{
 		lasterrorcode = ERR_NOT_FOUND;
 		lasterror = "The user was not found";
-		log::write (log::error, "handler", "Unknown user <%S>" %format (user));
+		AUTHDLOG (log::error, "handler", "Unknown user <%S>" %format (user));
 		return false;
 	}
 	
 	destuid = pw["uid"].uval();
 	destgid = pw["gid"].uval();
 	
-	ugr = kernel.userdb.getgrgid (destgid);
+	ugr = UDB.getgrgid (destgid);
 	if ( ! ugr)
 	{
 		lasterrorcode = ERR_NOT_FOUND;
 		lasterror = "The user's primary group was not found";
 		
-		log::write (log::error, "handler", "Could not back-resolve gid #%u "
+		AUTHDLOG (log::error, "handler", "Could not back-resolve gid #%u "
 						%format (pw["gid"].uval()));
 		return false;
 	}
 	
-	if (! gr["members"].exists (user))
+	if (! UDB.isMember ("openpaneluser", user))
 	{
 		lasterrorcode = ERR_POLICY;
 		lasterror = "The user is not a member of group openpaneluser";
 		
-		log::write (log::error, "handler", "User <%S> not a member of "
+		AUTHDLOG (log::error, "handler", "User <%S> not a member of "
 					"group openpaneluser" %format (user));
 		return false;
 	}
@@ -1013,36 +1783,182 @@ bool CommandHandler::makeUserDir (const string &dpath,
 	realpath = pw["home"];
 	if (realpath[-1] != '/') realpath.strcat ('/');
 	realpath.strcat (pdpath);
+	realpath = rootPath (realpath);
+	
+	// The home directory itself is the administrator's business, only
+	// the part below it is checked for symlinks.
+	string home = rootPath (pw["home"].sval());
+	while ((home.strlen() > 1) && (home[-1] == '/'))
+	{
+		home.crop (home.strlen() - 1);
+	}
+	
+	value created;
+	if (! walkUserDir (realpath, home, destuid, destgid, mode, created))
+	{
+		lasterrorcode = ERR_CMD_FAILED;
+		AUTHDLOG (log::error, "handler", "Error creating directory <%S> "
+					"for user <%S>: %s" %format (realpath, user, lasterror));
+		return false;
+	}
+	
+	if (! created.count()) return true;
+	
+	if (! writeUserDirRollback (realpath, destuid, destgid, created))
+	{
+		// Without a way back, don't leave anything behind.
+		FsCredentials creds (destuid, destgid);
+		for (int i=created.count()-1; i>=0; --i)
+		{
+			rmdir (created[i].sval().str());
+		}
+		
+		lasterrorcode = ERR_CMD_FAILED;
+		AUTHDLOG (log::error, "handler", "Error writing rollback for "
+					"<%S>: %s" %format (realpath, lasterror));
+		return false;
+	}
 	
-	string tpath = "/";
+	return true;
+}
+
+// ==========================================================================
+// METHOD CommandHandler::walkUserDir
+// ==========================================================================
+bool CommandHandler::walkUserDir (const string &path, const string &trusted,
+								  uid_t uid, gid_t gid, int mode,
+								  value &created)
+{
+	FsCredentials creds (uid, gid);
+	value elements = strutil::split (path, '/');
+	string tpath;
+	bool res = true;
+	
+	int dfd = open ("/", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd < 0)
+	{
+		lasterror = "Could not open root directory";
+		return false;
+	}
 	
-	value elements = strutil::split (realpath, '/');
 	foreach (elm, elements)
 	{
-		if (tpath) tpath.strcat ('/');
-		tpath.strcat (elm.sval());
+		string name = elm.sval();
+		if (! name) continue;
 		
-		if (! fs.exists (tpath))
+		tpath.strcat ('/');
+		tpath.strcat (name);
+		
+		int flags = O_RDONLY|O_DIRECTORY|O_CLOEXEC;
+		if (tpath.strlen() > trusted.strlen()) flags |= O_NOFOLLOW;
+		
+		int nfd = openat (dfd, name.str(), flags);
+		if ((nfd < 0) && (errno == ENOENT))
 		{
-			if (! runScript ("make-user-directory",
-								$(transactionid)->
-								$((unsigned int)destuid)->
-								$((unsigned int)destgid)->
-								$("%o" %format(mode))->
-								$(tpath)))
+			bool made = false;
+			if (mkdirat (dfd, name.str(), mode) == 0)
 			{
-				lasterror = "Could not create directory";
-				
-				log::write (log::error, "handler", "Error creating "
-							"directory <%S> for user <%S>"
-							%format (tpath,user));
-				return false;
+				created.newval() = tpath;
+				made = true;
+			}
+			else if (errno != EEXIST)
+			{
+				lasterror = "Could not create directory %s: %s"
+							%format (tpath, strerror (errno));
+				res = false;
+				break;
 			}
 			
+			// Set the mode through the descriptor, mkdir is subject to
+			// the umask and the name could have been swapped by now.
+			nfd = openat (dfd, name.str(), flags|O_NOFOLLOW);
+			if ((nfd >= 0) && made && fchmod (nfd, mode))
+			{
+				lasterror = "Could not set mode of %s" %format (tpath);
+				close (nfd);
+				res = false;
+				break;
+			}
 		}
+		
+		if (nfd < 0)
+		{
+			if ((errno == ELOOP) || (errno == ENOTDIR))
+			{
+				lasterror = "Not a directory or a symbolic link: %s"
+							%format (tpath);
+			}
+			else
+			{
+				lasterror = "Could not open %s: %s" %format (tpath,
+							strerror (errno));
+			}
+			res = false;
+			break;
+		}
+		
+		close (dfd);
+		dfd = nfd;
 	}
 	
-	return true;
+	close (dfd);
+	
+	if (! res)
+	{
+		for (int i=created.count()-1; i>=0; --i)
+		{
+			rmdir (created[i].sval().str());
+		}
+		created.clear ();
+	}
+	
+	return res;
+}
+
+// ==========================================================================
+// METHOD CommandHandler::writeUserDirRollback
+// ==========================================================================
+bool CommandHandler::writeUserDirRollback (const string &path, uid_t uid,
+										   gid_t gid, const value &created)
+{
+	string base = FileInstaller::rollbackBase (transactionid, path,
+											   lasterror);
+	if (! base) return false;
+	
+	// The header names the full path, the lines below it the
+	// directories that were created, parents first.
+	string out = "MKUSERDIR %u %u %s\n" %format ((unsigned int) uid,
+											   (unsigned int) gid, path);
+	foreach (c, created)
+	{
+		out.strcat (c.sval());
+		out.strcat ('\n');
+	}
+	
+	// Creating the same path twice in a transaction, after removing
+	// it in between, gets a rollback-file of its own.
+	int fd = -1;
+	for (int i=1; (fd < 0) && (i <= 64); ++i)
+	{
+		string fn = base;
+		if (i == 1) fn.strcat (".rollback");
+		else fn.strcat (".%i.rollback" %format (i));
+		
+		fd = open (fn.str(), O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+		if ((fd < 0) && (errno != EEXIST)) break;
+	}
+	
+	if (fd < 0)
+	{
+		lasterror = "Could not create rollback file";
+		return false;
+	}
+	
+	bool res = (::write (fd, out.str(), out.strlen()) == out.strlen());
+	close (fd);
+	
+	if (! res) lasterror = "Could not write rollback file";
+	return res;
 }
 
 // ==========================================================================
@@ -1057,34 +1973,189 @@ bool CommandHandler::getObject (const string &objname, file &out)
 	fname = guard.translateObject (module, objname, err);
 	if (! fname)
 	{
-		log::write (log::error, "handler", "Cannot find object <%S>: %s"
+		AUTHDLOG (log::error, "handler", "Cannot find object <%S>: %s"
 						%format (objname, err));
 		lasterrorcode = ERR_POLICY;
 		lasterror = "Object not defined";
 		return false;
 	}
 	
-	if (! fs.exists (fname))
+	fname = rootPath (fname);
+	
+	int fd;
+	struct stat st;
+	
+	fd = open (fname.str(), O_RDONLY|O_NOCTTY|O_NONBLOCK);
+	if ((fd >= 0) && (fstat (fd, &st) || (! S_ISREG (st.st_mode))))
+	{
+		close (fd);
+		fd = -1;
+	}
+	
+	if (fd < 0)
+	{
+		lasterrorcode = ERR_NOT_FOUND;
+		lasterror = "Could not find file: ";
+		lasterror.strcat (fname);
+		return false;
+	}
+	
+	string hdr;
+	string obj;
+	bool res;
+	
+	bool cached = OCache.lookup (fname, st, obj);
+	
+	if (cached || (OCache.wants (st.st_size) &&
+				   readObject (fd, st.st_size, obj)))
+	{
+		// Small, hot objects are served from memory.
+		if (! cached) OCache.store (fname, st, obj);
+		
+		hdr = "+OK %u\n" %format (obj.strlen());
+		res = sendAll (out.filno, hdr.str(), hdr.strlen()) &&
+			  sendAll (out.filno, obj.str(), obj.strlen());
+	}
+	else
+	{
+		// Let the kernel move the data to the socket, we never need
+		// to hold the object in memory.
+		hdr = "+OK %u\n" %format ((unsigned int) st.st_size);
+		res = sendAll (out.filno, hdr.str(), hdr.strlen()) &&
+			  sendFile (out.filno, fd, st.st_size);
+	}
+	
+	close (fd);
+	
+	// The client expects the number of bytes we promised, there is no
+	// way to recover the protocol if we could not deliver them.
+	if (! res)
+	{
+		AUTHDLOG (log::error, "handler", "Error sending object <%S>"
+					%format (objname));
+		throw (1);
+	}
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD CommandHandler::sendStats
+// ==========================================================================
+bool CommandHandler::sendStats (file &out)
+{
+	value st = Stats.report ();
+	if (LOCKSTATS) LockMeter::reportAll (st["locks"]);
+	string body = st.toxml ();
+	string hdr = "+OK %u\n" %format (body.strlen());
+	
+	if (! (sendAll (out.filno, hdr.str(), hdr.strlen()) &&
+		   sendAll (out.filno, body.str(), body.strlen())))
+	{
+		AUTHDLOG (log::error, "handler", "Error sending stats");
+		throw (1);
+	}
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD CommandHandler::readObject
+// ==========================================================================
+bool CommandHandler::readObject (int fd, off_t sz, string &into)
+{
+	file f;
+	int dfd = dup (fd);
+	
+	if (dfd < 0) return false;
+	if (! f.openread (dfd))
+	{
+		close (dfd);
+		return false;
+	}
+	
+	try
+	{
+		while ((into.strlen() < sz) && (! f.eof ()))
+		{
+			string chunk = f.read (sz - into.strlen());
+			if (chunk.strlen ()) into.strcat (chunk);
+			else break;
+		}
+	}
+	catch (...)
+	{
+	}
+	
+	f.close ();
+	return (into.strlen() == sz);
+}
+
+// ==========================================================================
+// METHOD CommandHandler::sendAll
+// ==========================================================================
+bool CommandHandler::sendAll (int sock, const char *data, size_t sz)
+{
+	size_t done = 0;
+	
+	while (done < sz)
+	{
+		ssize_t wsz = ::write (sock, data + done, sz - done);
+		if (wsz < 0)
+		{
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) && waitWritable (sock)) continue;
+			return false;
+		}
+		done += wsz;
+	}
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD CommandHandler::sendFile
+// ==========================================================================
+bool CommandHandler::sendFile (int sock, int fd, off_t sz)
+{
+	off_t offs = 0;
+	
+	while (offs < sz)
 	{
-		lasterrorcode = ERR_NOT_FOUND;
-		lasterror = "Could not find file: ";
-		lasterror.strcat (fname);
-		return false;
+		ssize_t wsz = sendfile (sock, fd, &offs, sz - offs);
+		if (wsz < 0)
+		{
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) && waitWritable (sock)) continue;
+			return false;
+		}
+		
+		// File got shorter on us.
+		if (wsz == 0) return false;
 	}
 	
-	string obj;
-	if (fs.exists (fname)) obj = fs.load (fname);
-	out.printf ("+OK %i\n", obj.strlen());
-	out.puts (obj);
 	return true;
 }
 
+// ==========================================================================
+// METHOD CommandHandler::waitWritable
+// ==========================================================================
+bool CommandHandler::waitWritable (int sock)
+{
+	struct pollfd pfd;
+	pfd.fd = sock;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	
+	return (poll (&pfd, 1, DATA_TIMEOUT * 1000) > 0);
+}
+
 // ==========================================================================
 // METHOD CommandHandler::deleteDir
 // ==========================================================================
 bool CommandHandler::deleteDir (const string &_dpath)
 {
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("deletedir");
 	
 	string tdname;
 	value perms;
@@ -1096,12 +2167,12 @@ bool CommandHandler::deleteDir (const string &_dpath)
 		dpath.crop (dpath.strlen() - 1);
 	}
 	
-	log::write (log::info, "handler ", "Deletedir module=<%S> id=<%S> "
+	AUTHDLOG (log::info, "handler ", "Deletedir module=<%S> id=<%S> "
 				"dpath=<%S>" %format (module, transactionid, dpath));
 	
 	if (! guard.checkDestination (module, "", dpath, perms, guarderr))
 	{
-		log::write (log::info, "handler ", "Dest policy fail: %s"
+		AUTHDLOG (log::info, "handler ", "Dest policy fail: %s"
 					%format (guarderr));
 		lasterrorcode = ERR_POLICY;
 		lasterror = "Destination directory does not match policy: ";
@@ -1109,12 +2180,13 @@ bool CommandHandler::deleteDir (const string &_dpath)
 		return false;
 	}
 	
-	value inf = fs.getinfo (dpath);
+	string iopath = rootPath (dpath);
+	value inf = fs.getinfo (iopath);
 	if (perms.exists ("user"))
 	{
 		if (perms["user"] != inf["user"])
 		{
-			log::write (log::error, "handler", "Directory <%S> does not match "
+			AUTHDLOG (log::error, "handler", "Directory <%S> does not match "
 						"ownership policies" %format (dpath));
 			lasterrorcode = ERR_POLICY;
 			lasterror = "Destination directory ownership mismatch";
@@ -1125,16 +2197,16 @@ bool CommandHandler::deleteDir (const string &_dpath)
 	{
 		if (perms["group"] != inf["group"])
 		{
-			log::write (log::error, "handler", "Directory <%S> does not match "
+			AUTHDLOG (log::error, "handler", "Directory <%S> does not match "
 						"ownership policies" %format (dpath));
 			lasterrorcode = ERR_POLICY;
 			lasterror = "Destination directory ownership mismatch";
 			return false;
 		}
-		value pw = kernel.userdb.getgrnam (perms["group"].sval());
+		value pw = UDB.getgrnam (perms["group"].sval());
 	}
 	
-	return runScript ("remove-directory", $(transactionid)->$(dpath));
+	return runScript ("remove-directory", $(transactionid)->$(iopath));
 }
 
 // ==========================================================================
@@ -1142,12 +2214,33 @@ bool CommandHandler::deleteDir (const string &_dpath)
 // ==========================================================================
 void CommandHandler::finishTransaction (void)
 {
-	if (DEMO) return;
 	if (! transactionid) return;
+	if (DEMO)
+	{
+		Demo.simulate ("commit");
+		return;
+	}
+	
+	TraceSpan commitspan ("commit", "transaction");
+	int failed;
+	
+	// Flush everything this transaction installed in one go, before
+	// the transaction is considered done.
+	{
+		TraceSpan syncspan ("sync", "transaction");
+		failed = pending.flush (durability);
+	}
+	if (failed)
+	{
+		AUTHDLOG (log::error, "handler ", "Could not flush %i paths "
+					"to disk" %format (failed));
+	}
 	
 	runScript ("end-transaction", $(transactionid));
+	AUTHD_PROBE3 (tx__commit, module.str(), transactionid.str(),
+				  (unsigned int) (usecnow() - txstart));
 	
-	log::write (log::info, "handler ", "Closing transaction module=<%S> "
+	AUTHDLOG (log::info, "handler ", "Closing transaction module=<%S> "
 				"id=<%S>" %format (module, transactionid));
 
 	transactionid = nokey;
@@ -1158,13 +2251,36 @@ void CommandHandler::finishTransaction (void)
 // ==========================================================================
 bool CommandHandler::rollbackTransaction (void)
 {
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("rollback");
 	if (! transactionid) return false;
 	
-	log::write (log::info, "handler ", "Rolling back transaction module=<%S> "
+	TraceSpan rollbackspan ("rollback", "transaction");
+	
+	AUTHDLOG (log::info, "handler ", "Rolling back transaction module=<%S> "
 				"id=<%S>" %format (module, transactionid));
 
-	return runScript ("rollback-transaction", $(transactionid));
+	pending.clear ();
+	bool res = runScript ("rollback-transaction", $(transactionid));
+	AUTHD_PROBE3 (tx__rollback, module.str(), transactionid.str(),
+				  (unsigned int) (usecnow() - txstart));
+	return res;
+}
+
+// ==========================================================================
+// METHOD CommandHandler::setDurability
+// ==========================================================================
+bool CommandHandler::setDurability (const string &level)
+{
+	int l = SyncBatch::parseLevel (level);
+	if (l < 0)
+	{
+		lasterrorcode = ERR_NOT_FOUND;
+		lasterror = "Unknown durability level";
+		return false;
+	}
+	
+	durability = l;
+	return true;
 }
 
 // ==========================================================================
@@ -1172,8 +2288,8 @@ bool CommandHandler::rollbackTransaction (void)
 // ==========================================================================
 bool CommandHandler::deleteFile (const string &path)
 {
-	if (DEMO) return true;
-	log::write (log::info, "handler ", "Delete file module=<%S> id=<%S> "
+	if (DEMO) return Demo.simulate ("deletefile");
+	AUTHDLOG (log::info, "handler ", "Delete file module=<%S> id=<%S> "
 				"path=<%S>" %format (module, transactionid, path));
 	
 	string guarderr;
@@ -1186,7 +2302,8 @@ bool CommandHandler::deleteFile (const string &path)
 		return false;
 	}
 	
-	return runScript ("remove-single-file", $(transactionid)->$(path));
+	string iopath = rootPath (path);
+	return runScript ("remove-single-file", $(transactionid)->$(iopath));
 }
 
 // ==========================================================================
@@ -1194,14 +2311,14 @@ bool CommandHandler::deleteFile (const string &path)
 // ==========================================================================
 bool CommandHandler::createUser (const string &userName, const string &ppass)
 {
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("createuser");
 	static string validUser ("abcdefghijklmnopqrstuvwxyz0123456789_-."
 							 "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
 	static string validPass ("abcdefghijklmnopqrstuvwxyz0123456789"
 							 "ABCDEFGHIJKLMNOPQRSTUVWXYZ!@#$%^&*()+="
 							 "<>,./?;:'|{}[]-_`~ ");
 	
-	log::write (log::info, "handler ", "Create user module=<%S> id=<%S> "
+	AUTHDLOG (log::info, "handler ", "Create user module=<%S> id=<%S> "
 				"name=<%S>" %format (module, transactionid, userName));
 	
 	if (! guard.checkCommandAccess(module, "createuser","user", lasterror))
@@ -1225,7 +2342,11 @@ bool CommandHandler::createUser (const string &userName, const string &ppass)
 	}
 	
 	value args = $(transactionid)->$(userName)->$(ppass);
-	return runScript ("create-system-user", args);
+	bool res = runScript ("create-system-user", args);
+	
+	// Don't wait for the next lookup to notice the new user.
+	UDB.invalidate ();
+	return res;
 }
 
 // ==========================================================================
@@ -1236,7 +2357,7 @@ bool CommandHandler::deleteUser (const string &userName)
 	static string validUser ("abcdefghijklmnopqrstuvwxyz0123456789_-."
 							 "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
 
-	log::write (log::info, "handler ", "Delete user module=<%S> id=<%S> "
+	AUTHDLOG (log::info, "handler ", "Delete user module=<%S> id=<%S> "
 				"name=<%S>" %format (module, transactionid, userName));
 	
 	if (! guard.checkCommandAccess(module, "deleteuser","user", lasterror))
@@ -1252,8 +2373,10 @@ bool CommandHandler::deleteUser (const string &userName)
 		return false;
 	}
 	
-	if (DEMO) return true;
-	return runScript ("remove-system-user", $(transactionid)->$(userName));
+	if (DEMO) return Demo.simulate ("deleteuser");
+	bool res = runScript ("remove-system-user", $(transactionid)->$(userName));
+	UDB.invalidate ();
+	return res;
 }
 
 // ==========================================================================
@@ -1265,7 +2388,7 @@ bool CommandHandler::setUserShell (	const string &userName,
 	static string validUser ("abcdefghijklmnopqrstuvwxyz0123456789_-."
 							 "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
 
-	log::write (log::info, "handler ", "Set User's Shell module=<%S> id=<%S> "
+	AUTHDLOG (log::info, "handler ", "Set User's Shell module=<%S> id=<%S> "
 				"name=<%S>" %format (module, transactionid, userName));
 	
 	if (! guard.checkCommandAccess(module, "setusershell", "user", lasterror))
@@ -1281,7 +2404,7 @@ bool CommandHandler::setUserShell (	const string &userName,
 		return false;
 	}
 
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("setusershell");
 	
 	value args = $(transactionid)->$(userName)->$(shell);
 	return runScript ("change-system-usershell", args);
@@ -1296,7 +2419,7 @@ bool CommandHandler::setUserPass (	const string &userName,
 	static string validUser ("abcdefghijklmnopqrstuvwxyz0123456789_-."
 							 "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
 
-	log::write (log::info, "handler ", "Set User's password module=<%S> id=<%S> "
+	AUTHDLOG (log::info, "handler ", "Set User's password module=<%S> id=<%S> "
 				"name=<%S>" %format (module, transactionid, userName));
 	
 	if (! guard.checkCommandAccess(module, "setuserpass", "user", lasterror))
@@ -1312,7 +2435,7 @@ bool CommandHandler::setUserPass (	const string &userName,
 		return false;
 	}
 
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("setuserpass");
 	
 	value args = $(transactionid)->$(userName)->$(password);
 	return runScript ("change-user-password", args);
@@ -1328,7 +2451,7 @@ bool CommandHandler::setQuota (const string &userName,
 	static string validUser ("abcdefghijklmnopqrstuvwxyz0123456789_-."
 							 "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
 
-	log::write (log::info, "handler ", "Set User's quota module=<%S> id=<%S> user=<%S> "
+	AUTHDLOG (log::info, "handler ", "Set User's quota module=<%S> id=<%S> user=<%S> "
 				"soft/hard=<%d/%d>" %format (module, transactionid,
 											 userName,softLimit, hardLimit));
 	
@@ -1345,7 +2468,7 @@ bool CommandHandler::setQuota (const string &userName,
 		return false;
 	}
 	
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("setquota");
 
 	value args = $(transactionid)->$(userName)->$(softLimit)->$(hardLimit);
 	return runScript ("change-user-quota", args);
@@ -1358,12 +2481,14 @@ bool PathGuard::checkServiceAccess (const string &moduleName,
 									const string &serviceName,
 									string &error)
 {
+	StatTimer policytime (STATPOLICY);
+	TraceSpan policyspan ("checkServiceAccess", "policy");
 	value meta;
 	meta = cache.get (moduleName);
 	if (! meta)
 	{
 		error = "Could not find module";
-		log::write (log::error, "srvaccs", "Could not load module <%S>"
+		AUTHDLOG (log::error, "srvaccs", "Could not load module <%S>"
 						%format (moduleName));
 		return false;
 	}
@@ -1384,24 +2509,57 @@ bool PathGuard::checkScriptAccess (const string &moduleName,
 								   const string &scriptName,
 								   string &userName,
 								   string &error)
+{
+	StatTimer policytime (STATPOLICY);
+	TraceSpan policyspan ("checkScriptAccess", "policy");
+	value dec;
+	string key = PCache.makeKey (moduleName, "script", scriptName, userName);
+	
+	if (PCache.lookup (key, dec))
+	{
+		if (! dec["ok"].bval())
+		{
+			error = dec["error"].sval();
+			return false;
+		}
+		
+		userName = dec["user"].sval();
+		return true;
+	}
+	
+	dec["ok"] = evalScriptAccess (moduleName, scriptName, userName, error);
+	if (dec["ok"].bval()) dec["user"] = userName;
+	else dec["error"] = error;
+	
+	PCache.store (key, dec);
+	return dec["ok"].bval();
+}
+
+// ==========================================================================
+// METHOD PathGuard::evalScriptAccess
+// ==========================================================================
+bool PathGuard::evalScriptAccess (const string &moduleName,
+								  const string &scriptName,
+								  string &userName,
+								  string &error)
 {
 	value meta;
 	
-	log::write (log::info, "scraccs ", "Checking script access module=<%S> "
+	AUTHDLOG (log::info, "scraccs ", "Checking script access module=<%S> "
 				"script=<%S>" %format (moduleName, scriptName));
 				
 	meta = cache.get (moduleName);
 	if (! meta)
 	{
 		error = "Could not find module";
-		log::write (log::error, "scraccs", "Could not load module <%S>"
+		AUTHDLOG (log::error, "scraccs", "Could not load module <%S>"
 					%format (moduleName));
 		return false;
 	}
 	
 	if (! meta["authdops"]["scripts"].exists(scriptName))
 	{
-		log::write (log::error, "scraccs", "Script not defined in "
+		AUTHDLOG (log::error, "scraccs", "Script not defined in "
 					"module.xml: <%S>" %format (scriptName));
 		error = "Script not defined in module.xml";
 		return false;
@@ -1412,7 +2570,7 @@ bool PathGuard::checkScriptAccess (const string &moduleName,
 	{
 		if ((scrip("asroot") == false) && (userName == "root"))
 		{
-			log::write (log::error, "scraccs", "Script <%S> may not be "
+			AUTHDLOG (log::error, "scraccs", "Script <%S> may not be "
 						"run as root as per the module.xml for <%S>"
 							%format (scriptName, moduleName));
 		}
@@ -1423,7 +2581,7 @@ bool PathGuard::checkScriptAccess (const string &moduleName,
 		userName = scrip("asuser");
 	}
 
-	log::write (log::info, "scraccs ", "Allowing script access module=<%S> sc"
+	AUTHDLOG (log::info, "scraccs ", "Allowing script access module=<%S> sc"
 				"ript=<%S> user=<%S>" %format (moduleName,scriptName,userName));
 	
 	return true;
@@ -1436,10 +2594,37 @@ bool PathGuard::checkCommandAccess (const string &moduleName,
 								    const string &cmdName,
 								    const string &cmdClass,
 								    string &error)
+{
+	StatTimer policytime (STATPOLICY);
+	TraceSpan policyspan ("checkCommandAccess", "policy");
+	value dec;
+	string key = PCache.makeKey (moduleName, "command", cmdName, cmdClass);
+	
+	if (PCache.lookup (key, dec))
+	{
+		if (dec["ok"].bval()) return true;
+		error = dec["error"].sval();
+		return false;
+	}
+	
+	dec["ok"] = evalCommandAccess (moduleName, cmdName, cmdClass, error);
+	if (! dec["ok"].bval()) dec["error"] = error;
+	
+	PCache.store (key, dec);
+	return dec["ok"].bval();
+}
+
+// ==========================================================================
+// METHOD PathGuard::evalCommandAccess
+// ==========================================================================
+bool PathGuard::evalCommandAccess (const string &moduleName,
+								   const string &cmdName,
+								   const string &cmdClass,
+								   string &error)
 {
 	value meta;
 	
-	log::write (log::info, "cmdaccs ", "Checking command access module=<%S> "
+	AUTHDLOG (log::info, "cmdaccs ", "Checking command access module=<%S> "
 				"command=<%S> commandclass=<%S>" %format (moduleName,
 					cmdName, cmdClass));
 				
@@ -1447,7 +2632,7 @@ bool PathGuard::checkCommandAccess (const string &moduleName,
 	if (! meta)
 	{
 		error = "Could not find module";
-		log::write (log::error, "cmdaccs", "Could not load module <%S>"
+		AUTHDLOG (log::error, "cmdaccs", "Could not load module <%S>"
 						%format (moduleName));
 		return false;
 	}
@@ -1455,13 +2640,13 @@ bool PathGuard::checkCommandAccess (const string &moduleName,
 	if (! meta["authdops"]["commands"].exists(cmdName)
 	&&  ! meta["authdops"]["commandclasses"].exists(cmdClass))
 	{
-		log::write (log::error, "cmdaccs", "Command or command class not "
+		AUTHDLOG (log::error, "cmdaccs", "Command or command class not "
 					"defined in module.xml");
 		error = "Command or command class not defined in module.xml";
 		return false;
 	}
 		
-	log::write (log::info, "cmdaccs ", "Allowing command access module=<%S> "
+	AUTHDLOG (log::info, "cmdaccs ", "Allowing command access module=<%S> "
 					%format (moduleName));
 	
 	return true;
@@ -1472,7 +2657,7 @@ bool PathGuard::checkCommandAccess (const string &moduleName,
 // ==========================================================================
 bool CommandHandler::startService (const string &serviceName)
 {
-	log::write (log::info, "handler ", "Start service module=<%S> id=<%S> "
+	AUTHDLOG (log::info, "handler ", "Start service module=<%S> id=<%S> "
 				"name=<%S>" %format (module, transactionid, serviceName));
 	
 	if (! guard.checkServiceAccess(module, serviceName, lasterror))
@@ -1481,187 +2666,579 @@ bool CommandHandler::startService (const string &serviceName)
 		return false;
 	}
 
-	if (DEMO) return true;
+	if (DEMO) return Demo.simulate ("startservice");
 	return runScript ("control-service", $("start")->$(serviceName));
 }
 
 // ==========================================================================
-// METHOD CommandHandler::stopService
+// METHOD CommandHandler::stopService
+// ==========================================================================
+bool CommandHandler::stopService (const string &serviceName)
+{
+	AUTHDLOG (log::info, "handler ", "Stop service module=<%S> id=<%S> "
+				"name=<%S>" %format (module, transactionid, serviceName));
+	
+	if (! guard.checkServiceAccess(module, serviceName, lasterror))
+	{
+		lasterrorcode = ERR_POLICY;
+		return false;
+	}
+
+	if (DEMO) return Demo.simulate ("stopservice");
+	return runScript ("control-service", $("stop")->$(serviceName));
+}
+
+// ==========================================================================
+// METHOD CommandHandler::reloadService
+// ==========================================================================
+bool CommandHandler::reloadService (const string &serviceName)
+{
+	AUTHDLOG (log::info, "handler ", "Reload service module=<%S> id=<%S> "
+				"name=<%S>" %format (module, transactionid, serviceName));
+	
+	if (! guard.checkServiceAccess(module, serviceName, lasterror))
+	{
+		lasterrorcode = ERR_POLICY;
+		return false;
+	}
+
+	if (DEMO) return Demo.simulate ("reloadservice");
+	return runScript ("control-service", $("reload")->$(serviceName));
+}
+
+// ==========================================================================
+// METHOD CommandHandler::setServiceOnBoot
+// ==========================================================================
+bool CommandHandler::setServiceOnBoot (const string &serviceName,
+									   bool onBoot)
+{
+	AUTHDLOG (log::info, "handler ", "Service onboot module=<%S> id=<%S> "
+				"name=<%S> status=<%s>" %format (module, transactionid,
+					serviceName, onBoot ? "on" : "off"));
+	
+	if (! guard.checkServiceAccess(module, serviceName, lasterror))
+	{
+		lasterrorcode = ERR_POLICY;
+		return false;
+	}
+	
+	if (DEMO) return Demo.simulate ("setonboot");
+	return runScript ("control-service-boot", $(serviceName)->$(onBoot?1:0));
+}
+
+// ==========================================================================
+// METHOD CommandHandler::setServiceOnBoot
+// ==========================================================================
+void CommandHandler::setModule (const string &moduleName)
+{
+	module = moduleName;
+	transactionid = strutil::uuid();
+	durability = DURABILITY;
+	pending.clear ();
+	txstart = usecnow ();
+	Trace.setContext (module, transactionid);
+	AUTHD_PROBE2 (tx__begin, module.str(), transactionid.str());
+	
+	AUTHDLOG (log::info, "handler ", "Started transaction module=<%S> "
+				"id=<%S>" %format (module, transactionid));
+}
+
+// ==========================================================================
+// METHOD CommandHandler::triggerSoftwareUpdate
+// ==========================================================================
+bool CommandHandler::triggerSoftwareUpdate (void)
+{
+	tcpsocket s;
+	
+	if (! guard.checkCommandAccess(module, "osupdate", "", lasterror))
+	{
+		lasterrorcode = ERR_POLICY;
+		return false;
+	}
+	
+	if (DEMO) return Demo.simulate ("osupdate");
+	
+	if (! s.uconnect (rootPath (PATH_SWUPD_SOCKET)))
+	{
+		AUTHDLOG (log::error, "handler", "Could not connect to swupd "
+					"socket");
+		return false;
+	}
+	
+	try
+	{
+		s.puts ("update\n");
+		string line = s.gets();
+		if (! line) line = s.gets();
+		s.close ();
+		if (line[0] == '+')
+		{
+			AUTHDLOG (log::info, "handler", "Triggered software "
+						"update");
+			return true;
+		}
+		else
+		{
+			AUTHDLOG (log::info, "handler", "Error from swupd: %S"
+						%format (line));
+		}
+	}
+	catch (exception e)
+	{
+		AUTHDLOG (log::info, "handler", "Exception: %S"
+					%format (e.description));
+	}
+	
+	s.close ();
+	AUTHDLOG (log::error, "handler", "Error from swupd");
+	return false;
+}
+
+// ==========================================================================
+// CONSTRUCTOR MetaCache
+// ==========================================================================
+MetaCache::MetaCache (void)
+{
+	lastgen = 0;
+	hits = reloads = compiles = failures = 0;
+	cache.meter ("metacache");
+	gens.meter ("metacache.gens");
+}
+
+// ==========================================================================
+// DESTRUCTOR MetaCache
+// ==========================================================================
+MetaCache::~MetaCache (void)
+{
+}
+
+// ==========================================================================
+// METHOD MetaCache::get
+// ==========================================================================
+value *MetaCache::get (const statstring &moduleName)
+{
+	static string AlphaNumeric ("abcdefghijklmnopqrstuvwxyz"
+								"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+								"0123456789_.-");
+	
+	unsigned int NOW = kernel.time.now ();
+	
+	if (! moduleName.sval().validate (AlphaNumeric))
+	{
+		return NULL;
+	}
+
+	returnclass (value) res retain;
+
+	sharedsection (cache)
+	{
+		if (cache.exists (moduleName))
+		{
+			res = cache[moduleName];
+			if ((NOW - res("time").uval()) < 60)
+			{
+				__sync_add_and_fetch (&hits, 1);
+				AUTHD_PROBE1 (metacache__hit, moduleName.str());
+				breaksection return &res;
+			}
+		}
+	}
+	
+	AUTHD_PROBE1 (metacache__miss, moduleName.str());
+	
+	string mxmlpath;
+	struct stat st;
+	
+	mxmlpath = rootPath (PATH_MODULES "/%s.module/module.xml"
+						 %format (moduleName));
+	if (stat (mxmlpath.str(), &st))
+	{
+		__sync_add_and_fetch (&failures, 1);
+		res.clear ();
+		return &res;
+	}
+	
+	// If the module.xml did not change since we last looked at it, the
+	// cached copy is still good.
+	if (res && sameSource (res, st))
+	{
+		res ("time") = NOW;
+	}
+	else
+	{
+		__sync_add_and_fetch (&reloads, 1);
+		unsigned long long loadstart = usecnow ();
+		
+		if (! loadCompiled (moduleName, st, res))
+		{
+			__sync_add_and_fetch (&compiles, 1);
+			if (! compile (moduleName, res))
+			{
+				__sync_add_and_fetch (&failures, 1);
+				res.clear ();
+				return &res;
+			}
+		}
+		
+		// New metadata gets a new generation number, which retires any
+		// policy decisions cached for the old one.
+		res ("gen") = __sync_add_and_fetch (&lastgen, 1);
+		AUTHD_PROBE2 (metacache__reload, moduleName.str(),
+					  (unsigned int) (usecnow() - loadstart));
+	}
+	
+	res ("time") = NOW;
+	
+	exclusivesection (cache)
+	{
+		cache[moduleName] = res;
+	}
+	
+	exclusivesection (gens)
+	{
+		gens[moduleName] = res("gen").uval();
+		gens[moduleName]("time") = NOW;
+	}
+	
+	return &res;
+}
+
+// ==========================================================================
+// METHOD MetaCache::count
+// ==========================================================================
+unsigned int MetaCache::count (void)
+{
+	unsigned int res = 0;
+	
+	sharedsection (cache)
+	{
+		res = cache.count();
+	}
+	
+	return res;
+}
+
+// ==========================================================================
+// METHOD MetaCache::generation
 // ==========================================================================
-bool CommandHandler::stopService (const string &serviceName)
+unsigned int MetaCache::generation (const statstring &moduleName)
 {
-	log::write (log::info, "handler ", "Stop service module=<%S> id=<%S> "
-				"name=<%S>" %format (module, transactionid, serviceName));
+	unsigned int NOW = kernel.time.now ();
+	unsigned int res = 0;
 	
-	if (! guard.checkServiceAccess(module, serviceName, lasterror))
+	sharedsection (gens)
 	{
-		lasterrorcode = ERR_POLICY;
-		return false;
+		if (gens.exists (moduleName))
+		{
+			if ((NOW - gens[moduleName]("time").uval()) < 60)
+			{
+				res = gens[moduleName].uval();
+			}
+		}
 	}
-
-	if (DEMO) return true;
-	return runScript ("control-service", $("stop")->$(serviceName));
+	
+	if (res) return res;
+	
+	// Unknown or expired, a get() will take care of that.
+	value meta;
+	meta = get (moduleName);
+	if (! meta) return 0;
+	return meta("gen").uval();
 }
 
 // ==========================================================================
-// METHOD CommandHandler::reloadService
+// METHOD MetaCache::listModules
 // ==========================================================================
-bool CommandHandler::reloadService (const string &serviceName)
+value *MetaCache::listModules (void)
 {
-	log::write (log::info, "handler ", "Reload service module=<%S> id=<%S> "
-				"name=<%S>" %format (module, transactionid, serviceName));
+	returnclass (value) res retain;
+	DIR *d;
+	struct dirent *de;
 	
-	if (! guard.checkServiceAccess(module, serviceName, lasterror))
+	string mpath = rootPath (PATH_MODULES);
+	d = opendir (mpath.str());
+	if (! d) return &res;
+	
+	while ((de = readdir (d)))
 	{
-		lasterrorcode = ERR_POLICY;
-		return false;
+		string mname = de->d_name;
+		if (mname[0] == '.') continue;
+		if (mname.strlen() < 8) continue;
+		if (mname.mid (mname.strlen() - 7) != ".module") continue;
+		
+		mname.crop (mname.strlen() - 7);
+		res.newval() = mname;
 	}
-
-	if (DEMO) return true;
-	return runScript ("control-service", $("reload")->$(serviceName));
+	
+	closedir (d);
+	return &res;
 }
 
 // ==========================================================================
-// METHOD CommandHandler::setServiceOnBoot
+// METHOD MetaCache::loadCompiled
 // ==========================================================================
-bool CommandHandler::setServiceOnBoot (const string &serviceName,
-									   bool onBoot)
+bool MetaCache::loadCompiled (const statstring &moduleName,
+							  const struct stat &st, value &into)
 {
-	log::write (log::info, "handler ", "Service onboot module=<%S> id=<%S> "
-				"name=<%S> status=<%s>" %format (module, transactionid,
-					serviceName, onBoot ? "on" : "off"));
+	string cpath;
+	cpath = rootPath (PATH_METASTORE "/%s.shox" %format (moduleName));
 	
-	if (! guard.checkServiceAccess(module, serviceName, lasterror))
+	into.clear ();
+	if (! fs.exists (cpath)) return false;
+	if (! into.loadshox (cpath)) return false;
+	
+	if (! sameSource (into, st))
 	{
-		lasterrorcode = ERR_POLICY;
+		AUTHDLOG (log::info, "metacch ", "Compiled metadata for <%S> "
+					"is stale" %format (moduleName));
+		into.clear ();
 		return false;
 	}
 	
-	if (DEMO) return true;
-	return runScript ("control-service-boot", $(serviceName)->$(onBoot?1:0));
+	return true;
 }
 
 // ==========================================================================
-// METHOD CommandHandler::setServiceOnBoot
+// METHOD MetaCache::setSource
 // ==========================================================================
-void CommandHandler::setModule (const string &moduleName)
+void MetaCache::setSource (value &meta, const struct stat &st)
 {
-	module = moduleName;
-	transactionid = strutil::uuid();
-	
-	log::write (log::info, "handler ", "Started transaction module=<%S> "
-				"id=<%S>" %format (module, transactionid));
+	// Sizes and inode numbers can outgrow 32 bits, a double holds them
+	// exactly well beyond that.
+	meta ("srcmtime") = (unsigned int) st.st_mtime;
+	meta ("srcmtimens") = (unsigned int) st.st_mtim.tv_nsec;
+	meta ("srcino") = (double) st.st_ino;
+	meta ("srcsize") = (double) st.st_size;
 }
 
 // ==========================================================================
-// METHOD CommandHandler::triggerSoftwareUpdate
+// METHOD MetaCache::sameSource
 // ==========================================================================
-bool CommandHandler::triggerSoftwareUpdate (void)
+bool MetaCache::sameSource (const value &meta, const struct stat &st)
 {
-	tcpsocket s;
+	return ((meta("srcmtime").uval() == (unsigned int) st.st_mtime) &&
+			(meta("srcmtimens").uval() == (unsigned int) st.st_mtim.tv_nsec) &&
+			(meta("srcino").dval() == (double) st.st_ino) &&
+			(meta("srcsize").dval() == (double) st.st_size));
+}
+
+// ==========================================================================
+// METHOD MetaCache::compile
+// ==========================================================================
+bool MetaCache::compile (const statstring &moduleName, value &into)
+{
+	static xmlschema S ("schema:com.openpanel.opencore.module.schema.xml");
 	
-	if (! guard.checkCommandAccess(module, "osupdate", "", lasterror))
-	{
-		lasterrorcode = ERR_POLICY;
-		return false;
-	}
+	string mxmlpath;
+	string cpath;
+	string tpath;
+	struct stat st;
+	value full;
+	
+	mxmlpath = rootPath (PATH_MODULES "/%s.module/module.xml"
+						 %format (moduleName));
+	cpath = rootPath (PATH_METASTORE "/%s.shox" %format (moduleName));
+	
+	// Threads compiling the same module each get their own temporary.
+	tpath = rootPath (PATH_METASTORE "/.%s.shox.%i.%i.tmp"
+					  %format (moduleName, (int) getpid(),
+							   (int) syscall (SYS_gettid)));
 	
-	if (DEMO) return true;
+	into.clear ();
+	if (stat (mxmlpath.str(), &st)) return false;
 	
-	if (! s.uconnect (PATH_SWUPD_SOCKET))
+	if (! full.loadxml (mxmlpath, S))
 	{
-		log::write (log::error, "handler", "Could not connect to swupd "
-					"socket");
+		AUTHDLOG (log::error, "metacch ", "Could not load module.xml "
+					"for <%S>" %format (moduleName));
 		return false;
 	}
 	
-	try
+	// The rest of the module.xml (classes, enums, ...) is none of our
+	// business, just keep the authdops.
+	into["authdops"] = full["authdops"];
+	setSource (into, st);
+	
+	// Write the compiled form through a temporary file, so a concurrent
+	// reader never sees a partial file. Failure to write it is not fatal,
+	// we'll just parse the xml again next time.
+	if (fs.isdir (rootPath (PATH_METASTORE)))
 	{
-		s.puts ("update\n");
-		string line = s.gets();
-		if (! line) line = s.gets();
-		s.close ();
-		if (line[0] == '+')
+		if (into.saveshox (tpath) && (rename (tpath.str(), cpath.str())==0))
 		{
-			log::write (log::info, "handler", "Triggered software "
-						"update");
-			return true;
+			AUTHDLOG (log::info, "metacch ", "Compiled metadata for "
+						"module <%S>" %format (moduleName));
 		}
 		else
 		{
-			log::write (log::info, "handler", "Error from swupd: %S"
-						%format (line));
+			AUTHDLOG (log::warning, "metacch ", "Could not write compiled "
+						"metadata for module <%S>" %format (moduleName));
+			if (fs.exists (tpath)) fs.rm (tpath);
 		}
 	}
-	catch (exception e)
-	{
-		log::write (log::info, "handler", "Exception: %S"
-					%format (e.description));
-	}
 	
-	s.close ();
-	log::write (log::error, "handler", "Error from swupd");
-	return false;
+	return true;
 }
 
 // ==========================================================================
-// CONSTRUCTOR MetaCache
+// CONSTRUCTOR PrewarmGroup
 // ==========================================================================
-MetaCache::MetaCache (void)
+PrewarmGroup::PrewarmGroup (void)
 {
 }
 
 // ==========================================================================
-// DESTRUCTOR MetaCache
+// DESTRUCTOR PrewarmGroup
 // ==========================================================================
-MetaCache::~MetaCache (void)
+PrewarmGroup::~PrewarmGroup (void)
 {
 }
 
 // ==========================================================================
-// METHOD MetaCache::get
+// METHOD PrewarmGroup::run
 // ==========================================================================
-value *MetaCache::get (const statstring &moduleName)
+int PrewarmGroup::run (int nthreads)
 {
-	static string AlphaNumeric ("abcdefghijklmnopqrstuvwxyz"
-								"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-								"0123456789_.-");
+	exclusivesection (queue)
+	{
+		queue = MCache.listModules ();
+	}
 	
-	static xmlschema S ("schema:com.openpanel.opencore.module.schema.xml");
-	unsigned int NOW = kernel.time.now ();
+	for (int i=0; i<nthreads; ++i)
+	{
+		new PrewarmWorker (this);
+	}
 	
-	if (! moduleName.sval().validate (AlphaNumeric))
+	while (true)
 	{
-		return NULL;
+		gc ();
+		if (count()) usleep (10000);
+		else break;
 	}
+	
+	int res = 0;
+	sharedsection (results)
+	{
+		res = results["loaded"].ival();
+	}
+	return res;
+}
 
-	returnclass (value) res retain;
-
-	sharedsection (cache)
+// ==========================================================================
+// METHOD PrewarmGroup::next
+// ==========================================================================
+bool PrewarmGroup::next (statstring &into)
+{
+	bool res = false;
+	
+	// A background prewarm has no business delaying a shutdown.
+	if (! AUTHD->shouldRun) return false;
+	
+	exclusivesection (queue)
 	{
-		if (cache.exists (moduleName))
+		if (queue.count())
 		{
-			res = cache[moduleName];
-			if ((NOW - res("time").uval()) < 60)
-			{
-				breaksection return &res;
-			}
+			into = queue[-1].sval();
+			queue.rmindex (queue.count() - 1);
+			res = true;
 		}
 	}
 	
-	string mxmlpath;
-	mxmlpath = "/var/openpanel/modules/%s.module/module.xml" %format (moduleName);
-	if (! fs.exists (mxmlpath)) return &res;
-	
-	res.loadxml (mxmlpath, S);
-	res ("time") = NOW;
-	
-	exclusivesection (cache)
+	return res;
+}
+
+// ==========================================================================
+// METHOD PrewarmGroup::done
+// ==========================================================================
+void PrewarmGroup::done (bool success)
+{
+	exclusivesection (results)
 	{
-		cache[moduleName] = res;
+		if (success) results["loaded"] = results["loaded"].ival() + 1;
+		else results["failed"] = results["failed"].ival() + 1;
 	}
+}
+
+// ==========================================================================
+// CONSTRUCTOR PrewarmWorker
+// ==========================================================================
+PrewarmWorker::PrewarmWorker (PrewarmGroup *grp) : groupthread (*grp)
+{
+	group = grp;
+	spawn ();
+}
+
+// ==========================================================================
+// DESTRUCTOR PrewarmWorker
+// ==========================================================================
+PrewarmWorker::~PrewarmWorker (void)
+{
+}
+
+// ==========================================================================
+// METHOD PrewarmWorker::run
+// ==========================================================================
+void PrewarmWorker::run (void)
+{
+	statstring mname;
 	
-	return &res;
+	while (group->next (mname))
+	{
+		value meta;
+		bool success = true;
+		meta = MCache.get (mname);
+		
+		if (! meta)
+		{
+			AUTHDLOG (log::warning, "prewarm ", "Could not load module "
+						"<%S>" %format (mname));
+			success = false;
+		}
+		
+		group->done (success);
+	}
+}
+
+// ==========================================================================
+// CONSTRUCTOR PrewarmThread
+// ==========================================================================
+PrewarmThread::PrewarmThread (void)
+{
+	running = false;
+}
+
+// ==========================================================================
+// DESTRUCTOR PrewarmThread
+// ==========================================================================
+PrewarmThread::~PrewarmThread (void)
+{
+}
+
+// ==========================================================================
+// METHOD PrewarmThread::run
+// ==========================================================================
+void PrewarmThread::run (void)
+{
+	AuthdApp::prewarmCache ();
+	running = false;
+}
+
+// ==========================================================================
+// METHOD PrewarmThread::start
+// ==========================================================================
+void PrewarmThread::start (void)
+{
+	running = true;
+	spawn ();
+}
+
+// ==========================================================================
+// METHOD PrewarmThread::stop
+// ==========================================================================
+void PrewarmThread::stop (void)
+{
+	// The MetaCache goes away once main() returns.
+	while (running) usleep (10000);
 }
 
 // ==========================================================================
@@ -1683,8 +3260,11 @@ PathGuard::~PathGuard (void)
 // ==========================================================================
 string *PathGuard::translateSource (const statstring &moduleName,
 								   const string &fileName,
+								   int &fd,
 								   string &error)
 {
+	StatTimer policytime (STATPOLICY);
+	TraceSpan policyspan ("translateSource", "policy");
 	static string validFileName ("abcdefghijklmnopqrstuvwxyz"
 								 "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 								 "0123456789.:_-@+ /");
@@ -1701,71 +3281,108 @@ string *PathGuard::translateSource (const statstring &moduleName,
 		error = "Filename contains relative path elements";
 		return NULL;
 	}
+	
+	returnclass (string) res retain;
+	fd = -1;
+	
+	value dec;
+	string key = PCache.makeKey (moduleName, "source", fileName);
+	
+	if (! PCache.lookup (key, dec))
+	{
+		dec["ok"] = evalSource (moduleName, fileName, error);
+		if (! dec["ok"].bval()) dec["error"] = error;
+		PCache.store (key, dec);
+	}
+	
+	if (! dec["ok"].bval())
+	{
+		error = dec["error"].sval();
+		return &res;
+	}
+	
+	res = rootPath (PATH_STAGING "/%s/%s" %format (moduleName, fileName));
+	
+	// Open the file once and do all checks on the descriptor, so nobody
+	// can swap the file between our checks and the copy.
+	struct stat st;
+	fd = open (res.str(), O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_NOCTTY);
+	if (fd < 0)
+	{
+		if (errno == ELOOP) error = "Source file is a symbolic link";
+		else error = "Source file does not exist";
+		res.crop ();
+		return &res;
+	}
+	
+	if (fstat (fd, &st) || (! S_ISREG (st.st_mode)))
+	{
+		error = "Source file is not a regular file";
+	}
+	else if (st.st_nlink > 1)
+	{
+		AUTHDLOG (log::error, "pathgrd ", "Denied hardlinked file "
+					"<%S>" %format (fileName));
+		error = "Source file is hardlinked";
+	}
+	else if (st.st_uid != COREUID)
+	{
+		AUTHDLOG (log::error, "pathgrd ", "Owner mismatch "
+					"on file <%S>: %u" %format (fileName,
+												(unsigned int) st.st_uid));
+		error = "File owner mismatch (not openpanel-core)";
+	}
+	else if (st.st_gid != COREGID)
+	{
+		AUTHDLOG (log::error, "pathgrd ", "Group mismatch "
+					"on file <%S>: %u" %format (fileName,
+												(unsigned int) st.st_gid));
+		error = "File group mismatch (not openpanel-core)";
+	}
+	else if (st.st_mode & S_IWOTH)
+	{
+		AUTHDLOG (log::error, "pathgrd ", "Denied world-"
+					"writable file <%S>" %format (fileName));
+		error = "File is world-writable";
+	}
+	else
+	{
+		// We opened non-blocking to be safe from fifos, the reads
+		// should block.
+		fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+		return &res;
+	}
+	
+	close (fd);
+	fd = -1;
+	res.crop ();
+	return &res;
+}
 
+// ==========================================================================
+// METHOD PathGuard::evalSource
+// ==========================================================================
+bool PathGuard::evalSource (const statstring &moduleName,
+							const string &fileName,
+							string &error)
+{
 	value meta;
 	meta = cache.get (moduleName);
 	if (! meta)
 	{
 		error = "Could not find module";
-		log::write (log::error, "pathgrd ", "Could not load module <%S>"
+		AUTHDLOG (log::error, "pathgrd ", "Could not load module <%S>"
 						%format (moduleName));
-		return NULL;
+		return false;
 	}
 	
-	returnclass (string) res retain;
-	
 	foreach (op, meta["authdops"]["fileops"])
 	{
-		if (fileName.globcmp (op.id().sval()))
-		{
-			res.printf ("/var/openpanel/conf/staging/%s/%s",
-						moduleName.str(), fileName.str());
-			
-			if (! fs.exists (res))
-			{
-				error = "Source file does not exist";
-				res.crop ();
-			}
-			else
-			{
-				unsigned int perms;
-				value finf;
-				finf = fs.getinfo (res);
-				if (finf["user"] != "openpanel-core")
-				{
-					log::write (log::error, "pathgrd ", "Owner mismatch "
-								"on file <%S>: %s" %format (fileName,
-															finf["user"]));
-					error = "File owner mismatch (not openpanel-core)";
-					res.crop();
-				}
-				else if (finf["group"] != "openpanel-core")
-				{
-					log::write (log::error, "pathgrd ", "Group mismatch "
-								"on file <%S>: %s" %format (fileName,
-															finf["group"]));
-					error = "File group mismatch (not openpanel-core)";
-					res.crop();
-				}
-				else
-				{
-					perms = finf["mode"].uval();
-					if (perms & 1)
-					{
-						log::write (log::error, "pathgrd ", "Denied world-"
-									"writable file <%S>" %format (fileName));
-						error = "File is world-writable";
-						res.crop();
-					}
-				}
-				
-			}
-			return &res;
-		}
+		if (fileName.globcmp (op.id().sval())) return true;
 	}
 	
 	error = "No matching fileop found in module.xml";
-	return &res;
+	return false;
 }
 
 // ==========================================================================
@@ -1776,6 +3393,43 @@ bool PathGuard::checkDestination (const statstring &moduleName,
 								  const string &filePath,
 								  value &perms,
 								  string &error)
+{
+	StatTimer policytime (STATPOLICY);
+	TraceSpan policyspan ("checkDestination", "policy");
+	value dec;
+	string key = PCache.makeKey (moduleName, "dest", sourceFile, filePath);
+	
+	if (PCache.lookup (key, dec))
+	{
+		if (dec["ok"].bval())
+		{
+			perms = dec["perms"];
+			return true;
+		}
+		
+		error = dec["error"].sval();
+		AUTHDLOG (log::warning, "pathgrd ", "Denied module=<%S> file=<%S> "
+					"destpath=<%S>" %format (moduleName, sourceFile,filePath));
+		return false;
+	}
+	
+	dec["ok"] = evalDestination (moduleName, sourceFile, filePath,
+								 perms, error);
+	if (dec["ok"].bval()) dec["perms"] = perms;
+	else dec["error"] = error;
+	
+	PCache.store (key, dec);
+	return dec["ok"].bval();
+}
+
+// ==========================================================================
+// METHOD PathGuard::evalDestination
+// ==========================================================================
+bool PathGuard::evalDestination (const statstring &moduleName,
+								 const string &sourceFile,
+								 const string &filePath,
+								 value &perms,
+								 string &error)
 {
 	value meta;
 	meta = cache.get (moduleName);
@@ -1814,7 +3468,7 @@ bool PathGuard::checkDestination (const statstring &moduleName,
 	}
 	
 	error = "No matching destination path found in fileop";
-	log::write (log::warning, "pathgrd ", "Denied module=<%S> file=<%S> "
+	AUTHDLOG (log::warning, "pathgrd ", "Denied module=<%S> file=<%S> "
 				"destpath=<%S>" %format (moduleName, sourceFile,filePath));
 	
 	return false;
@@ -1868,6 +3522,8 @@ bool PathGuard::checkDelete (const statstring &moduleName,
 							 const string &fullPath,
 							 string &error)
 {
+	StatTimer policytime (STATPOLICY);
+	TraceSpan policyspan ("checkDelete", "policy");
 	value meta;
 	string match;
 	meta = cache.get (moduleName);
@@ -1887,7 +3543,7 @@ bool PathGuard::checkDelete (const statstring &moduleName,
 	}
 	
 	error = "No matching destination path found in any fileop for the module";
-	log::write (log::warning, "pathgrd ", "Denied delete module=<%S> "
+	AUTHDLOG (log::warning, "pathgrd ", "Denied delete module=<%S> "
 				"file=<%S>" %format (moduleName, fullPath));
 	
 	return false;
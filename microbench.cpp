@@ -0,0 +1,417 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <ftw.h>
+#include <new>
+
+#define MB_TARGETUSEC	100000
+
+/// Number of C++ allocations done by the current thread. Allocations
+/// that bypass operator new are not seen, so this is a lower bound.
+__thread unsigned long long MBALLOCS = 0;
+
+// Replacing the global allocator is only done in the separate
+// microbenchmark build (make microbench), never in the daemon.
+#ifdef MICROBENCH_ALLOCS
+
+void *operator new (size_t sz)
+{
+	MBALLOCS++;
+	void *res = malloc (sz ? sz : 1);
+	if (! res) throw std::bad_alloc ();
+	return res;
+}
+
+void *operator new[] (size_t sz)
+{
+	MBALLOCS++;
+	void *res = malloc (sz ? sz : 1);
+	if (! res) throw std::bad_alloc ();
+	return res;
+}
+
+void operator delete (void *p) throw ()
+{
+	free (p);
+}
+
+void operator delete[] (void *p) throw ()
+{
+	free (p);
+}
+
+#endif
+
+static const char *MBNAMES[MB_NUMOPS] = {
+	"compile", "get-cold", "get-warm", "dest-hit", "dest-miss",
+	"source", "delete", "script-hit", "script-miss"
+};
+
+static int MBSIZES[] = { 10, 100, 1000, 10000, 0 };
+static int MBTHREADS[] = { 1, 4, 16, 64, 0 };
+
+static int rmentry (const char *path, const struct stat *st, int flag,
+					struct FTW *ftw)
+{
+	return remove (path);
+}
+
+// ==========================================================================
+// METHOD AuthdApp::microBench
+// ==========================================================================
+int AuthdApp::microBench (void)
+{
+	MicroBench mb;
+	return mb.run ();
+}
+
+// ==========================================================================
+// CONSTRUCTOR MicroBench
+// ==========================================================================
+MicroBench::MicroBench (void)
+{
+	nops = 0;
+	curop = 0;
+	iterations = 0;
+	pass = 0;
+	go = false;
+}
+
+// ==========================================================================
+// DESTRUCTOR MicroBench
+// ==========================================================================
+MicroBench::~MicroBench (void)
+{
+}
+
+// ==========================================================================
+// METHOD MicroBench::run
+// ==========================================================================
+int MicroBench::run (void)
+{
+	char tmpl[] = "/tmp/authd-microbench.XXXXXX";
+	if (! mkdtemp (tmpl))
+	{
+		ferr.writeln ("%% Could not create scratch directory");
+		return 1;
+	}
+	
+	// Everything happens under the scratch root, staged files are
+	// owned by us.
+	ROOTPREFIX = tmpl;
+	COREUID = getuid ();
+	COREGID = getgid ();
+	
+	// Keep log formatting out of the numbers.
+	LOGMASK = log::error;
+	
+	fs.mkdir (rootPath ("/var"));
+	fs.mkdir (rootPath ("/var/openpanel"));
+	fs.mkdir (rootPath ("/var/openpanel/modules"));
+	fs.mkdir (rootPath ("/var/openpanel/cache"));
+	fs.mkdir (rootPath (PATH_METASTORE));
+	fs.mkdir (rootPath ("/var/openpanel/conf"));
+	fs.mkdir (rootPath (PATH_STAGING));
+	
+	fout.writeln ("%-6s %-7s %-12s %12s %12s %12s" %format ("ops",
+				  "threads", "operation", "ns/op", "allocs/op", "ops/s"));
+	
+	for (int s=0; MBSIZES[s]; ++s)
+	{
+		module = "Bench%i" %format (MBSIZES[s]);
+		nops = MBSIZES[s];
+		
+		// Every lookup targets the last entry, the worst case for
+		// the linear matches.
+		srcname = "file.op%i" %format (nops-1);
+		destpath = "/srv/bench/op%i" %format (nops-1);
+		scriptname = "script%i" %format (nops-1);
+		
+		if (! makeModule (module, nops))
+		{
+			ferr.writeln ("%% Could not create module %s" %format (module));
+			nftw (tmpl, rmentry, 16, FTW_DEPTH|FTW_PHYS);
+			return 1;
+		}
+		
+		// Load it once, so the compiled copy exists for the cold
+		// loads and the warm cache is primed.
+		value meta = MCache.get (module);
+		if (! meta.count())
+		{
+			ferr.writeln ("%% Could not load module %s" %format (module));
+			nftw (tmpl, rmentry, 16, FTW_DEPTH|FTW_PHYS);
+			return 1;
+		}
+		
+		for (int op=0; op<MB_NUMOPS; ++op)
+		{
+			for (int t=0; MBTHREADS[t]; ++t) measure (op, MBTHREADS[t]);
+		}
+	}
+	
+	nftw (tmpl, rmentry, 16, FTW_DEPTH|FTW_PHYS);
+	return 0;
+}
+
+// ==========================================================================
+// METHOD MicroBench::makeModule
+// ==========================================================================
+bool MicroBench::makeModule (const statstring &name, int n)
+{
+	string mdir = rootPath (PATH_MODULES "/%s.module" %format (name));
+	string sdir = rootPath (PATH_STAGING "/%s" %format (name));
+	string fileops;
+	string objects;
+	string scripts;
+	
+	fs.mkdir (mdir);
+	fs.mkdir (sdir);
+	
+	for (int i=0; i<n; ++i)
+	{
+		fileops.strcat ("      <fileop pattern=\"*.op%i\" perms=\"0640\">"
+						"/srv/bench/op%i</fileop>\n" %format (i, i));
+		objects.strcat ("      <object id=\"obj%i\">/srv/bench/op%i/obj"
+						"</object>\n" %format (i, i));
+		scripts.strcat ("      <script id=\"script%i\"/>\n" %format (i));
+	}
+	
+	string xml;
+	xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		  "<com.openpanel.opencore.module>\n"
+		  "  <name>%s</name>\n"
+		  "  <version>1</version>\n"
+		  "  <authdops>\n"
+		  "    <fileops>\n%s    </fileops>\n"
+		  "    <objects>\n%s    </objects>\n"
+		  "    <scripts>\n%s    </scripts>\n"
+		  "  </authdops>\n"
+		  "</com.openpanel.opencore.module>\n"
+		  %format (name, fileops, objects, scripts);
+	
+	file f;
+	if (! f.openwrite ("%s/module.xml" %format (mdir))) return false;
+	f.puts (xml);
+	f.close ();
+	
+	string src = "%s/%s" %format (sdir, srcname);
+	int fd = open (src.str(), O_WRONLY|O_CREAT|O_TRUNC, 0640);
+	if (fd < 0) return false;
+	bool res = (::write (fd, "bench\n", 6) == 6);
+	close (fd);
+	
+	return res;
+}
+
+// ==========================================================================
+// METHOD MicroBench::calibrate
+// ==========================================================================
+unsigned int MicroBench::calibrate (int op)
+{
+	unsigned int n = 1;
+	
+	while (true)
+	{
+		unsigned long long start = usecnow ();
+		for (unsigned int i=0; i<n; ++i) once (op, -1, i);
+		unsigned long long spent = usecnow () - start;
+		
+		if ((spent >= (MB_TARGETUSEC/4)) || (n >= 1000000))
+		{
+			if (! spent) spent = 1;
+			unsigned long long res = (n * MB_TARGETUSEC) / spent;
+			if (res < 1) res = 1;
+			if (res > 1000000) res = 1000000;
+			return (unsigned int) res;
+		}
+		
+		n *= 4;
+	}
+}
+
+// ==========================================================================
+// METHOD MicroBench::measure
+// ==========================================================================
+void MicroBench::measure (int op, int nthreads)
+{
+	curop = op;
+	pass++;
+	iterations = calibrate (op);
+	go = false;
+	
+	exclusivesection (results)
+	{
+		results.clear ();
+	}
+	
+	for (int i=0; i<nthreads; ++i)
+	{
+		new MicroWorker (this, i);
+	}
+	
+	unsigned long long start = usecnow ();
+	go = true;
+	
+	while (true)
+	{
+		gc ();
+		if (count()) usleep (1000);
+		else break;
+	}
+	
+	unsigned long long wall = usecnow () - start;
+	unsigned long long nsec = 0;
+	unsigned long long allocs = 0;
+	
+	sharedsection (results)
+	{
+		foreach (r, results)
+		{
+			nsec += r["usec"].uval() * 1000ULL;
+			allocs += (unsigned long long) r["allocs"].dval();
+		}
+	}
+	
+	unsigned long long total = (unsigned long long) iterations * nthreads;
+	if (! wall) wall = 1;
+	
+	string allocstr = "-";
+#ifdef MICROBENCH_ALLOCS
+	allocstr = "%.1f" %format ((double) allocs / total);
+#endif
+	
+	fout.writeln ("%-6i %-7i %-12s %12.1f %12s %12.0f" %format (nops,
+				  nthreads, MBNAMES[op], (double) nsec / total, allocstr,
+				  ((double) total * 1000000.0) / wall));
+}
+
+// ==========================================================================
+// METHOD MicroBench::work
+// ==========================================================================
+void MicroBench::work (int idx)
+{
+	while (! go) usleep (100);
+	
+	unsigned long long allocs = MBALLOCS;
+	unsigned long long start = usecnow ();
+	
+	for (unsigned int i=0; i<iterations; ++i) once (curop, idx, i);
+	
+	unsigned long long spent = usecnow () - start;
+	allocs = MBALLOCS - allocs;
+	
+	exclusivesection (results)
+	{
+		value &r = results.newval ();
+		r["usec"] = (unsigned int) spent;
+		r["allocs"] = (double) allocs;
+	}
+}
+
+// ==========================================================================
+// METHOD MicroBench::once
+// ==========================================================================
+bool MicroBench::once (int op, int idx, unsigned int iter)
+{
+	PathGuard guard;
+	string error;
+	value perms;
+	string user;
+	int fd;
+	
+	switch (op)
+	{
+		case MB_COMPILE:
+		{
+			value meta;
+			return MCache.compile (module, meta);
+		}
+		
+		case MB_GETCOLD:
+		{
+			MetaCache cold;
+			value meta;
+			meta = cold.get (module);
+			return meta.count();
+		}
+		
+		case MB_GETWARM:
+		{
+			value meta;
+			meta = MCache.get (module);
+			return meta.count();
+		}
+		
+		case MB_DESTHIT:
+			return guard.checkDestination (module, srcname, destpath, perms,
+										   error);
+		
+		case MB_DESTMISS:
+			// A unique file name for every call defeats the PolicyCache.
+			return guard.checkDestination (module, "f%u-%i-%u.op%i"
+										   %format (pass, idx, iter, nops-1),
+										   destpath, perms, error);
+		
+		case MB_SOURCE:
+		{
+			string res;
+			res = guard.translateSource (module, srcname, fd, error);
+			if (fd >= 0) close (fd);
+			return res.strlen();
+		}
+		
+		case MB_DELETE:
+			return guard.checkDelete (module, "%s/file" %format (destpath),
+									  error);
+		
+		case MB_SCRIPTHIT:
+			user = "root";
+			return guard.checkScriptAccess (module.sval(), scriptname, user,
+											error);
+		
+		case MB_SCRIPTMISS:
+			user = "u%u-%i-%u" %format (pass, idx, iter);
+			return guard.checkScriptAccess (module.sval(), scriptname, user,
+											error);
+	}
+	
+	return false;
+}
+
+// ==========================================================================
+// CONSTRUCTOR MicroWorker
+// ==========================================================================
+MicroWorker::MicroWorker (MicroBench *grp, int idx) : groupthread (*grp)
+{
+	group = grp;
+	index = idx;
+	spawn ();
+}
+
+// ==========================================================================
+// DESTRUCTOR MicroWorker
+// ==========================================================================
+MicroWorker::~MicroWorker (void)
+{
+}
+
+// ==========================================================================
+// METHOD MicroWorker::run
+// ==========================================================================
+void MicroWorker::run (void)
+{
+	group->work (index);
+}
@@ -0,0 +1,178 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+
+#include "authd.h"
+#include <string.h>
+
+ObjectCache OCache;
+
+// ==========================================================================
+// CONSTRUCTOR ObjectCache
+// ==========================================================================
+ObjectCache::ObjectCache (void)
+{
+	limit = size = tick = 0;
+	hits = misses = 0;
+	memset (ticks, 0, sizeof (ticks));
+	entries.meter ("objectcache");
+}
+
+// ==========================================================================
+// DESTRUCTOR ObjectCache
+// ==========================================================================
+ObjectCache::~ObjectCache (void)
+{
+}
+
+// ==========================================================================
+// METHOD ObjectCache::setLimit
+// ==========================================================================
+void ObjectCache::setLimit (unsigned int bytes)
+{
+	exclusivesection (entries)
+	{
+		limit = bytes;
+		if (! limit)
+		{
+			entries.clear ();
+			memset (ticks, 0, sizeof (ticks));
+			size = 0;
+		}
+	}
+}
+
+// ==========================================================================
+// METHOD ObjectCache::wants
+// ==========================================================================
+bool ObjectCache::wants (off_t sz)
+{
+	// Don't let a single object push out more than an eighth of
+	// the cache.
+	if (! limit) return false;
+	return (sz <= (off_t) (limit / 8));
+}
+
+// ==========================================================================
+// METHOD ObjectCache::lookup
+// ==========================================================================
+bool ObjectCache::lookup (const string &path, const struct stat &st,
+						  string &into)
+{
+	bool found = false;
+	if (! limit) return false;
+	
+	// Readers only look, the LRU stamp is a plain word outside of the
+	// entry. A stale entry is left for store() to replace, which the
+	// caller does right after a miss.
+	sharedsection (entries)
+	{
+		if (entries.exists (path))
+		{
+			value &e = entries[path];
+			if ((e("dev").uval() == (unsigned int) st.st_dev) &&
+				(e("ino").uval() == (unsigned int) st.st_ino) &&
+				(e("mtime").uval() == (unsigned int) st.st_mtime) &&
+				(e("mtimens").uval() == (unsigned int) st.st_mtim.tv_nsec) &&
+				(e("size").uval() == (unsigned int) st.st_size))
+			{
+				into = e.sval();
+				ticks[e("slot").ival()] = __sync_add_and_fetch (&tick, 1);
+				found = true;
+			}
+		}
+	}
+	
+	if (found) __sync_add_and_fetch (&hits, 1);
+	else __sync_add_and_fetch (&misses, 1);
+	return found;
+}
+
+// ==========================================================================
+// METHOD ObjectCache::store
+// ==========================================================================
+void ObjectCache::store (const string &path, const struct stat &st,
+						 const string &data)
+{
+	if (! wants (data.strlen())) return;
+	
+	exclusivesection (entries)
+	{
+		if (entries.exists (path)) evict (entries[path]("slot").ival());
+		
+		// Throw out the least recently used entries until the new
+		// object fits and a slot is free.
+		int slot = -1;
+		while (slot < 0)
+		{
+			int oldest = -1;
+			bool fits = ((size + data.strlen()) <= limit);
+			
+			for (int i=0; i<OBJECTCACHE_SLOTS; ++i)
+			{
+				if (! ticks[i])
+				{
+					if (fits && (slot < 0)) slot = i;
+				}
+				else if ((oldest < 0) || (ticks[i] < ticks[oldest]))
+				{
+					oldest = i;
+				}
+			}
+			
+			if (slot >= 0) break;
+			if (oldest < 0) breaksection return;
+			evict (oldest);
+		}
+		
+		value &e = entries[path];
+		e = data;
+		e("dev") = (unsigned int) st.st_dev;
+		e("ino") = (unsigned int) st.st_ino;
+		e("mtime") = (unsigned int) st.st_mtime;
+		e("mtimens") = (unsigned int) st.st_mtim.tv_nsec;
+		e("size") = (unsigned int) st.st_size;
+		e("slot") = slot;
+		ticks[slot] = __sync_add_and_fetch (&tick, 1);
+		slotpath[slot] = path;
+		size += data.strlen();
+	}
+}
+
+// ==========================================================================
+// METHOD ObjectCache::evict
+// ==========================================================================
+void ObjectCache::evict (int slot)
+{
+	// Called with the exclusive lock held.
+	size -= entries[slotpath[slot]].sval().strlen();
+	entries.rmval (slotpath[slot]);
+	slotpath[slot].crop (0);
+	ticks[slot] = 0;
+}
+
+// ==========================================================================
+// METHOD ObjectCache::stats
+// ==========================================================================
+value *ObjectCache::stats (void)
+{
+	returnclass (value) res retain;
+	
+	sharedsection (entries)
+	{
+		res["entries"] = entries.count();
+		res["bytes"] = size;
+		res["limit"] = limit;
+	}
+	
+	res["hits"] = hits;
+	res["misses"] = misses;
+	return &res;
+}
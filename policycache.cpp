@@ -0,0 +1,158 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+
+PolicyCache PCache;
+
+// Rough per-entry bookkeeping cost on top of the key and decision data.
+#define POLICYCACHE_OVERHEAD 192
+
+// ==========================================================================
+// CONSTRUCTOR PolicyCache
+// ==========================================================================
+PolicyCache::PolicyCache (void)
+{
+	for (int i=0; i<POLICYCACHE_SHARDS; ++i)
+	{
+		sizes[i] = 0;
+		shards[i].meter ("policycache");
+	}
+	hits = misses = evictions = 0;
+}
+
+// ==========================================================================
+// DESTRUCTOR PolicyCache
+// ==========================================================================
+PolicyCache::~PolicyCache (void)
+{
+}
+
+// ==========================================================================
+// METHOD PolicyCache::makeKey
+// ==========================================================================
+string *PolicyCache::makeKey (const statstring &moduleName, const char *op,
+							  const string &a, const string &b)
+{
+	returnclass (string) res retain;
+	
+	unsigned int gen = MCache.generation (moduleName);
+	if (! gen) return &res;
+	
+	// The arguments come from the client and may hold tabs of their
+	// own, the length prefixes keep two different pairs apart.
+	res.printf ("%s\t%u\t%s\t%u:%s\t%u:%s", moduleName.str(), gen, op,
+				a.strlen(), a.str(), b.strlen(), b.str());
+	return &res;
+}
+
+// ==========================================================================
+// METHOD PolicyCache::shardFor
+// ==========================================================================
+int PolicyCache::shardFor (const string &key)
+{
+	// FNV-1a
+	unsigned int h = 2166136261U;
+	const char *c = key.str();
+	
+	for (int i=0; i<key.strlen(); ++i)
+	{
+		h ^= (unsigned char) c[i];
+		h *= 16777619U;
+	}
+	
+	return h % POLICYCACHE_SHARDS;
+}
+
+// ==========================================================================
+// METHOD PolicyCache::lookup
+// ==========================================================================
+bool PolicyCache::lookup (const string &key, value &into)
+{
+	if (! key) return false;
+	
+	bool found = false;
+	meteredlock<value> &shard = shards[shardFor (key)];
+	
+	sharedsection (shard)
+	{
+		if (shard.exists (key))
+		{
+			into = shard[key];
+			found = true;
+		}
+	}
+	
+	if (found) __sync_add_and_fetch (&hits, 1);
+	else __sync_add_and_fetch (&misses, 1);
+	return found;
+}
+
+// ==========================================================================
+// METHOD PolicyCache::store
+// ==========================================================================
+void PolicyCache::store (const string &key, const value &decision)
+{
+	if (! key) return;
+	
+	int idx = shardFor (key);
+	meteredlock<value> &shard = shards[idx];
+	unsigned int sz = key.strlen() + POLICYCACHE_OVERHEAD;
+	
+	sz += decision["error"].sval().strlen();
+	sz += decision["user"].sval().strlen();
+	sz += decision["perms"].count() * POLICYCACHE_OVERHEAD;
+	
+	exclusivesection (shard)
+	{
+		if (shard.count() >= POLICYCACHE_SHARDSIZE)
+		{
+			__sync_add_and_fetch (&evictions, shard.count());
+			shard.clear ();
+			sizes[idx] = 0;
+		}
+		
+		if (! shard.exists (key))
+		{
+			shard[key] = decision;
+			sizes[idx] += sz;
+		}
+	}
+}
+
+// ==========================================================================
+// METHOD PolicyCache::stats
+// ==========================================================================
+value *PolicyCache::stats (void)
+{
+	returnclass (value) res retain;
+	unsigned int entries = 0;
+	unsigned int bytes = 0;
+	
+	for (int i=0; i<POLICYCACHE_SHARDS; ++i)
+	{
+		sharedsection (shards[i])
+		{
+			entries += shards[i].count();
+			bytes += sizes[i];
+		}
+	}
+	
+	unsigned long long h = hits;
+	unsigned long long m = misses;
+	
+	res["hits"] = h;
+	res["misses"] = m;
+	res["evictions"] = evictions;
+	res["entries"] = entries;
+	res["bytes"] = bytes;
+	res["hitratio"] = (h+m) ? ((double) h / (double) (h+m)) : 0.0;
+	return &res;
+}
@@ -0,0 +1,57 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#ifndef _authd_probes_H
+#define _authd_probes_H 1
+
+/* ======================================================================== *\
+ | Static tracepoints (USDT) for bpftrace, perf and systemtap. The probes   |
+ | are nops in the instruction stream until a tracer attaches, so they are  |
+ | always compiled in when sys/sdt.h is around (systemtap-sdt-dev). On      |
+ | other systems they compile to nothing.                                   |
+ |                                                                          |
+ | Provider "authd":                                                        |
+ |                                                                          |
+ |  command__start   (module, command)                                      |
+ |  command__end     (module, command, status, usec)                        |
+ |  metacache__hit   (module)                                               |
+ |  metacache__miss  (module)                                               |
+ |  metacache__reload(module, usec)                                         |
+ |  script__spawn    (module, script)                                       |
+ |  script__exit     (module, script, retval, usec)                         |
+ |  tx__begin        (module, transaction)                                  |
+ |  tx__commit       (module, transaction, usec)                            |
+ |  tx__rollback     (module, transaction, usec)                            |
+ |                                                                          |
+ | Strings are NUL-terminated char pointers, status is one of the           |
+ | EVSTATUS_* values, usec is the duration of the operation (for the        |
+ | transaction probes, the time since tx__begin).                           |
+\* ======================================================================== */
+
+#if defined (__has_include)
+  #if __has_include (<sys/sdt.h>)
+    #define HAVE_SYS_SDT_H 1
+  #endif
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+  #include <sys/sdt.h>
+  #define AUTHD_PROBE1(n,a)			STAP_PROBE1(authd,n,a)
+  #define AUTHD_PROBE2(n,a,b)		STAP_PROBE2(authd,n,a,b)
+  #define AUTHD_PROBE3(n,a,b,c)		STAP_PROBE3(authd,n,a,b,c)
+  #define AUTHD_PROBE4(n,a,b,c,d)	STAP_PROBE4(authd,n,a,b,c,d)
+#else
+  #define AUTHD_PROBE1(n,a)			do {} while (0)
+  #define AUTHD_PROBE2(n,a,b)		do {} while (0)
+  #define AUTHD_PROBE3(n,a,b,c)		do {} while (0)
+  #define AUTHD_PROBE4(n,a,b,c,d)	do {} while (0)
+#endif
+
+#endif
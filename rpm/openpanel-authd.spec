@@ -10,6 +10,7 @@ Source: 	%{name}-%{version}.tar.bz2
 Source1:	openpanel-authd.init
 Requires:	grace
 BuildRequires:	grace-devel
+BuildRequires:	systemtap-sdt-devel
 BuildRoot:	%{_tmppath}/%{name}-%{version}-%{release}-root-%(%{__id_u} -n)
 
 %description
@@ -59,6 +60,7 @@ fi
 %{_localstatedir}/openpanel/bin/openpanel-authd.app/
 %{_localstatedir}/openpanel/tools/
 %dir %attr(0750, root, openpanel-authd) %{_localstatedir}/openpanel/sockets/authd
+%dir %attr(0700, root, root) %{_localstatedir}/openpanel/cache/authd
 
 %changelog
 * Wed Jan 18 2011 Igmar Palsenberg <igmar@palsenberg.com>
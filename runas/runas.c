@@ -42,7 +42,11 @@ int main (int argc, char *argv[])
 	}
 	else
 	{
-		sprintf (cmdpath, "/var/openpanel/tools/%s", argv[3]);
+		/* Tools live under the sandbox root when one is set */
+		const char *root = getenv ("OPENPANEL_ROOT");
+		if (! root) root = "";
+		if (strlen (root) > 512) return 1;
+		sprintf (cmdpath, "%s/var/openpanel/tools/%s", root, argv[3]);
 	}
 	
 	if (setregid (gid,gid)) return 1;
@@ -0,0 +1,575 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+#include <string.h>
+#include <sched.h>
+
+StatsCollector Stats;
+
+__thread unsigned long long STATPOLICY = 0;
+__thread unsigned long long STATSCRIPT = 0;
+
+/// The shard the current thread records into, -1 if not assigned yet.
+static __thread int STATSHARD = -1;
+
+// ==========================================================================
+// CONSTRUCTOR StatHistogram
+// ==========================================================================
+StatHistogram::StatHistogram (void)
+{
+	memset (counts, 0, sizeof (counts));
+	count = sum = 0;
+	max = 0;
+}
+
+// ==========================================================================
+// DESTRUCTOR StatHistogram
+// ==========================================================================
+StatHistogram::~StatHistogram (void)
+{
+}
+
+// ==========================================================================
+// METHOD StatHistogram::add
+// ==========================================================================
+void StatHistogram::add (unsigned int usec)
+{
+	int b;
+	
+	// Values below 16 get a bucket each, above that every power of two
+	// is split in eight.
+	if (usec < 16) b = usec;
+	else
+	{
+		int e = 31 - __builtin_clz (usec);
+		b = 16 + ((e-4) * 8) + ((usec >> (e-3)) & 7);
+	}
+	
+	counts[b]++;
+	count++;
+	sum += usec;
+	if (usec > max) max = usec;
+}
+
+// ==========================================================================
+// METHOD StatHistogram::merge
+// ==========================================================================
+void StatHistogram::merge (const StatHistogram &o)
+{
+	for (int i=0; i<STAT_BUCKETS; ++i) counts[i] += o.counts[i];
+	count += o.count;
+	sum += o.sum;
+	if (o.max > max) max = o.max;
+}
+
+// ==========================================================================
+// METHOD StatHistogram::percentile
+// ==========================================================================
+unsigned int StatHistogram::percentile (double pct) const
+{
+	if (! count) return 0;
+	
+	unsigned long long want = (unsigned long long) ((count * pct) / 100.0);
+	unsigned long long seen = 0;
+	if (want >= count) want = count - 1;
+	
+	for (int b=0; b<STAT_BUCKETS; ++b)
+	{
+		seen += counts[b];
+		if (seen <= want) continue;
+		
+		// Report the upper edge of the bucket, but never more than
+		// what was actually measured.
+		unsigned int res = bucketLimit (b);
+		return (res > max) ? max : res;
+	}
+	
+	return max;
+}
+
+// ==========================================================================
+// METHOD StatHistogram::bucketLimit
+// ==========================================================================
+unsigned int StatHistogram::bucketLimit (int b)
+{
+	if (b < 16) return b;
+	
+	int e = ((b-16) / 8) + 4;
+	unsigned int width = 1U << (e-3);
+	return ((8 + ((b-16) % 8)) << (e-3)) + width - 1;
+}
+
+// ==========================================================================
+// METHOD StatHistogram::since
+// ==========================================================================
+void StatHistogram::since (const StatHistogram &base)
+{
+	unsigned int top = 0;
+	
+	for (int i=0; i<STAT_BUCKETS; ++i)
+	{
+		counts[i] -= base.counts[i];
+		if (counts[i]) top = bucketLimit (i);
+	}
+	
+	count -= base.count;
+	sum -= base.sum;
+	
+	// The real maximum of the difference is unknown, the edge of the
+	// highest bucket in use is the best estimate.
+	if (top < max) max = top;
+}
+
+// ==========================================================================
+// METHOD StatHistogram::report
+// ==========================================================================
+void StatHistogram::report (value &into) const
+{
+	into["count"] = (unsigned int) count;
+	into["mean"] = count ? (unsigned int) (sum / count) : 0;
+	into["p50"] = percentile (50.0);
+	into["p90"] = percentile (90.0);
+	into["p99"] = percentile (99.0);
+	into["p999"] = percentile (99.9);
+	into["max"] = max;
+}
+
+// ==========================================================================
+// CONSTRUCTOR StatEntry
+// ==========================================================================
+StatEntry::StatEntry (void)
+{
+	calls = ok = fail = unknown = denied = 0;
+}
+
+// ==========================================================================
+// DESTRUCTOR StatEntry
+// ==========================================================================
+StatEntry::~StatEntry (void)
+{
+}
+
+// ==========================================================================
+// METHOD StatEntry::merge
+// ==========================================================================
+void StatEntry::merge (const StatEntry &o)
+{
+	calls += o.calls;
+	ok += o.ok;
+	fail += o.fail;
+	unknown += o.unknown;
+	denied += o.denied;
+	policy.merge (o.policy);
+	script.merge (o.script);
+	total.merge (o.total);
+}
+
+// ==========================================================================
+// METHOD StatEntry::report
+// ==========================================================================
+void StatEntry::report (value &into) const
+{
+	into["calls"] = (unsigned int) calls;
+	into["ok"] = (unsigned int) ok;
+	into["fail"] = (unsigned int) fail;
+	into["unknown"] = (unsigned int) unknown;
+	into["denied"] = (unsigned int) denied;
+	policy.report (into["policy"]);
+	script.report (into["script"]);
+	total.report (into["total"]);
+}
+
+// ==========================================================================
+// CONSTRUCTOR StatShard
+// ==========================================================================
+StatShard::StatShard (void)
+{
+	memset (slots, 0, sizeof (slots));
+	used = 0;
+}
+
+// ==========================================================================
+// DESTRUCTOR StatShard
+// ==========================================================================
+StatShard::~StatShard (void)
+{
+	for (int i=0; i<used; ++i) delete slots[i];
+}
+
+// ==========================================================================
+// CONSTRUCTOR StatsCollector
+// ==========================================================================
+StatsCollector::StatsCollector (void)
+{
+	nextshard = 0;
+	dropped = 0;
+}
+
+// ==========================================================================
+// DESTRUCTOR StatsCollector
+// ==========================================================================
+StatsCollector::~StatsCollector (void)
+{
+}
+
+// ==========================================================================
+// METHOD StatsCollector::record
+// ==========================================================================
+void StatsCollector::record (const string &cmd, const string &module,
+							 int status, bool denied, unsigned int usec,
+							 unsigned int policyusec, unsigned int scriptusec)
+{
+	if (STATSHARD < 0)
+	{
+		STATSHARD = __sync_fetch_and_add (&nextshard, 1) % STAT_SHARDS;
+	}
+	
+	StatShard &shard = shards[STATSHARD];
+	
+	recordKey (shard, "c:%s" %format (cmd), status, denied, usec,
+			   policyusec, scriptusec);
+	
+	// The module name comes from the greeting, before anything was
+	// checked. Names that don't resolve to a module share one entry,
+	// so they can't crowd out the real ones.
+	statstring mkey = STAT_OTHER_MODULE;
+	if (MCache.generation (module)) mkey = "m:%s" %format (module);
+	recordKey (shard, mkey, status, denied, usec, policyusec, scriptusec);
+}
+
+// ==========================================================================
+// METHOD StatsCollector::recordKey
+// ==========================================================================
+void StatsCollector::recordKey (StatShard &shard, const statstring &key,
+								int status, bool denied, unsigned int usec,
+								unsigned int policyusec,
+								unsigned int scriptusec)
+{
+	exclusivesection (shard.index)
+	{
+		StatEntry *e;
+		
+		if (shard.index.exists (key))
+		{
+			e = shard.slots[shard.index[key].ival()];
+		}
+		else
+		{
+			statstring nkey = key;
+			
+			// The last two slots are kept for the (other) entries,
+			// new names that don't fit are counted there.
+			if (shard.used >= (STAT_SLOTS - 2))
+			{
+				__sync_add_and_fetch (&dropped, 1);
+				nkey = (key.str()[0] == 'c') ? STAT_OTHER_COMMAND
+											 : STAT_OTHER_MODULE;
+			}
+			
+			if (shard.index.exists (nkey))
+			{
+				e = shard.slots[shard.index[nkey].ival()];
+			}
+			else
+			{
+				e = shard.slots[shard.used] = new StatEntry;
+				shard.index[nkey] = shard.used++;
+			}
+		}
+		
+		e->calls++;
+		if (status == EVSTATUS_OK) e->ok++;
+		else if (status == EVSTATUS_UNKNOWN) e->unknown++;
+		else e->fail++;
+		if (denied) e->denied++;
+		
+		e->policy.add (policyusec);
+		e->script.add (scriptusec);
+		e->total.add (usec);
+	}
+}
+
+// ==========================================================================
+// METHOD StatsCollector::report
+// ==========================================================================
+value *StatsCollector::report (void)
+{
+	returnclass (value) res retain;
+	value keys;
+	StatEntry *merged[STAT_SLOTS * 2];
+	int nmerged = 0;
+	unsigned int nkeysdropped = 0;
+	
+	for (int s=0; s<STAT_SHARDS; ++s)
+	{
+		StatShard &shard = shards[s];
+		
+		exclusivesection (shard.index)
+		{
+			foreach (k, shard.index)
+			{
+				const StatEntry *e = shard.slots[k.ival()];
+				statstring key = k.id();
+				
+				// Same as in recordKey(), the last two are kept for
+				// whatever doesn't fit.
+				if ((! keys.exists (key)) &&
+					(nmerged >= ((STAT_SLOTS * 2) - 2)))
+				{
+					nkeysdropped++;
+					key = (key.str()[0] == 'c') ? STAT_OTHER_COMMAND
+												: STAT_OTHER_MODULE;
+				}
+				
+				if (! keys.exists (key))
+				{
+					keys[key] = nmerged;
+					merged[nmerged++] = new StatEntry;
+				}
+				
+				merged[keys[key].ival()]->merge (*e);
+			}
+		}
+	}
+	
+	foreach (k, keys)
+	{
+		string key = k.id().sval();
+		const char *section = (key[0] == 'c') ? "commands" : "modules";
+		
+		merged[k.ival()]->report (res[section][key.mid (2)]);
+		delete merged[k.ival()];
+	}
+	
+	// Commands recorded under (other) because a shard was full, and
+	// names folded into (other) by this report.
+	res["dropped"]["records"] = (double) dropped;
+	res["dropped"]["keys"] = nkeysdropped;
+	
+	return &res;
+}
+
+// ==========================================================================
+// METHOD StatsCollector::totals
+// ==========================================================================
+void StatsCollector::totals (StatHistogram &into)
+{
+	for (int s=0; s<STAT_SHARDS; ++s)
+	{
+		StatShard &shard = shards[s];
+		
+		exclusivesection (shard.index)
+		{
+			foreach (k, shard.index)
+			{
+				if (k.id().sval()[0] != 'c') continue;
+				into.merge (shard.slots[k.ival()]->total);
+			}
+		}
+	}
+}
+
+volatile bool LOCKSTATS = false;
+
+/// All meters, created on demand. Meters get registered from global
+/// constructors, so the registry is guarded by a spinlock that needs
+/// no construction of its own.
+static LockMeter *LOCKMETERS[LOCKMETER_MAX];
+static int NLOCKMETERS = 0;
+static volatile int LOCKMETERSPIN = 0;
+
+/// A section held by the current thread.
+struct LockHeld
+{
+	const void			*obj;
+	unsigned long long	 start;
+	void				*caller;
+};
+
+static __thread LockHeld LOCKHELD[LOCKMETER_DEPTH];
+static __thread int NLOCKHELD = 0;
+
+// ==========================================================================
+// CONSTRUCTOR LockMeter
+// ==========================================================================
+LockMeter::LockMeter (const char *n)
+{
+	name = n;
+	shared = exclusive = contended = 0;
+	waitusec = maxwait = holdusec = maxhold = 0;
+	memset (slowusec, 0, sizeof (slowusec));
+	memset (slowcaller, 0, sizeof (slowcaller));
+}
+
+// ==========================================================================
+// METHOD LockMeter::get
+// ==========================================================================
+LockMeter *LockMeter::get (const char *name)
+{
+	LockMeter *res = NULL;
+	
+	while (__sync_lock_test_and_set (&LOCKMETERSPIN, 1)) sched_yield ();
+	
+	for (int i=0; i<NLOCKMETERS; ++i)
+	{
+		if (strcmp (LOCKMETERS[i]->name, name) == 0)
+		{
+			res = LOCKMETERS[i];
+			break;
+		}
+	}
+	
+	if ((! res) && (NLOCKMETERS < LOCKMETER_MAX))
+	{
+		res = new LockMeter (name);
+		LOCKMETERS[NLOCKMETERS++] = res;
+	}
+	
+	__sync_lock_release (&LOCKMETERSPIN);
+	return res;
+}
+
+// ==========================================================================
+// METHOD LockMeter::acquired
+// ==========================================================================
+void LockMeter::acquired (const void *obj, unsigned long long waited,
+						  bool excl, void *caller)
+{
+	if (excl) __sync_fetch_and_add (&exclusive, 1);
+	else __sync_fetch_and_add (&shared, 1);
+	
+	// An uncontended lock still costs a microsecond now and then, don't
+	// count that as waiting.
+	if (waited)
+	{
+		__sync_fetch_and_add (&contended, 1);
+		__sync_fetch_and_add (&waitusec, waited);
+		
+		unsigned long long cur = maxwait;
+		while ((waited > cur) &&
+			   (! __sync_bool_compare_and_swap (&maxwait, cur, waited)))
+		{
+			cur = maxwait;
+		}
+	}
+	
+	// Deeper nesting than we can track goes unmeasured for hold time.
+	if (NLOCKHELD >= LOCKMETER_DEPTH) return;
+	
+	LockHeld &h = LOCKHELD[NLOCKHELD++];
+	h.obj = obj;
+	h.start = usecnow ();
+	h.caller = caller;
+}
+
+// ==========================================================================
+// METHOD LockMeter::released
+// ==========================================================================
+void LockMeter::released (const void *obj)
+{
+	// Sections nest, so the match is nearly always on top. Metering
+	// may also have been switched on while this lock was held, in
+	// which case there is no match at all. An entry left behind by
+	// switching it off is dropped by the next release of its lock.
+	int i;
+	for (i=NLOCKHELD-1; i>=0; --i)
+	{
+		if (LOCKHELD[i].obj == obj) break;
+	}
+	if (i < 0) return;
+	
+	unsigned long long held = usecnow () - LOCKHELD[i].start;
+	void *caller = LOCKHELD[i].caller;
+	
+	for (; i<NLOCKHELD-1; ++i) LOCKHELD[i] = LOCKHELD[i+1];
+	NLOCKHELD--;
+	
+	__sync_fetch_and_add (&holdusec, held);
+	
+	unsigned long long cur = maxhold;
+	while ((held > cur) &&
+		   (! __sync_bool_compare_and_swap (&maxhold, cur, held)))
+	{
+		cur = maxhold;
+	}
+	
+	if (held > slowusec[LOCKMETER_SAMPLES-1]) sample (held, caller);
+}
+
+// ==========================================================================
+// METHOD LockMeter::sample
+// ==========================================================================
+void LockMeter::sample (unsigned long long held, void *caller)
+{
+	unsigned int usec = (held > 0xffffffffULL) ? 0xffffffff : held;
+	
+	exclusivesection (samplelock)
+	{
+		// Samples are sorted slowest first, an existing entry for
+		// the same call site is only ever improved upon.
+		int pos = LOCKMETER_SAMPLES - 1;
+		for (int i=0; i<LOCKMETER_SAMPLES; ++i)
+		{
+			if (slowcaller[i] == caller)
+			{
+				pos = i;
+				break;
+			}
+		}
+		
+		if (usec <= slowusec[pos]) breaksection return;
+		
+		while ((pos > 0) && (slowusec[pos-1] < usec))
+		{
+			slowusec[pos] = slowusec[pos-1];
+			slowcaller[pos] = slowcaller[pos-1];
+			pos--;
+		}
+		
+		slowusec[pos] = usec;
+		slowcaller[pos] = caller;
+	}
+}
+
+// ==========================================================================
+// METHOD LockMeter::reportAll
+// ==========================================================================
+void LockMeter::reportAll (value &into)
+{
+	int n = NLOCKMETERS;
+	
+	for (int i=0; i<n; ++i)
+	{
+		LockMeter *m = LOCKMETERS[i];
+		value &r = into[m->name];
+		
+		// Totals in microseconds outgrow 32 bits within the hour.
+		r["shared"] = (unsigned int) m->shared;
+		r["exclusive"] = (unsigned int) m->exclusive;
+		r["contended"] = (unsigned int) m->contended;
+		r["waitusec"] = (double) m->waitusec;
+		r["maxwait"] = (unsigned int) m->maxwait;
+		r["holdusec"] = (double) m->holdusec;
+		r["maxhold"] = (unsigned int) m->maxhold;
+		
+		sharedsection (m->samplelock)
+		{
+			for (int s=0; s<LOCKMETER_SAMPLES; ++s)
+			{
+				if (! m->slowcaller[s]) break;
+				value &sv = r["slowest"].newval ();
+				sv("caller") = "0x%lx" %format ((unsigned long)
+										   m->slowcaller[s]);
+				sv = m->slowusec[s];
+			}
+		}
+	}
+}
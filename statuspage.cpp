@@ -0,0 +1,202 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+/// The latency window restarts this often (in microseconds).
+#define STATUS_WINDOW	60000000ULL
+
+StatusPage Status;
+
+/// Wall clock in microseconds.
+static unsigned long long wallclock (void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return ((unsigned long long) tv.tv_sec * 1000000ULL) + tv.tv_usec;
+}
+
+// ==========================================================================
+// CONSTRUCTOR StatusPage
+// ==========================================================================
+StatusPage::StatusPage (void)
+{
+	page = NULL;
+	workers = busy = transactions = 0;
+	accepted = commands = 0;
+	started = wallclock ();
+	basetime = usecnow ();
+}
+
+// ==========================================================================
+// DESTRUCTOR StatusPage
+// ==========================================================================
+StatusPage::~StatusPage (void)
+{
+	if (page) munmap (page, sizeof (authdstatus));
+}
+
+// ==========================================================================
+// METHOD StatusPage::open
+// ==========================================================================
+bool StatusPage::open (const string &path)
+{
+	void *map;
+	string tmp = "%s.new" %format (path);
+	
+	// Build the page in a new file and move it in place, a reader that
+	// still has the previous daemon's page mapped keeps reading that.
+	unlink (tmp.str());
+	int fd = ::open (tmp.str(), O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+					 0644);
+	if (fd < 0) return false;
+	
+	if (ftruncate (fd, sizeof (authdstatus)))
+	{
+		close (fd);
+		unlink (tmp.str());
+		return false;
+	}
+	
+	map = mmap (NULL, sizeof (authdstatus), PROT_READ|PROT_WRITE,
+				MAP_SHARED, fd, 0);
+	close (fd);
+	
+	if (map == MAP_FAILED)
+	{
+		unlink (tmp.str());
+		return false;
+	}
+	
+	page = (authdstatus *) map;
+	memset (page, 0, sizeof (authdstatus));
+	page->magic = STATUSPAGE_MAGIC;
+	page->version = STATUSPAGE_VERSION;
+	page->pid = getpid ();
+	page->started = started;
+	
+	if (rename (tmp.str(), path.str()))
+	{
+		munmap (page, sizeof (authdstatus));
+		page = NULL;
+		unlink (tmp.str());
+		return false;
+	}
+	
+	update ();
+	return true;
+}
+
+// ==========================================================================
+// METHOD StatusPage::update
+// ==========================================================================
+void StatusPage::update (void)
+{
+	if (! page) return;
+	
+	// Gather everything up front, so the page is only marked as being
+	// written for as short as possible.
+	StatHistogram cur;
+	StatHistogram win;
+	unsigned long long now = usecnow ();
+	
+	Stats.totals (cur);
+	win = cur;
+	win.since (base);
+	
+	value pcs = PCache.stats ();
+	unsigned int modules = MCache.count ();
+	
+	page->seq++;
+	__sync_synchronize ();
+	
+	page->updated = wallclock ();
+	page->workers = workers;
+	page->busy = busy;
+	page->transactions = transactions;
+	page->modules = modules;
+	page->accepted = accepted;
+	page->commands = commands;
+	page->metahits = MCache.hits;
+	page->metareloads = MCache.reloads;
+	page->metacompiles = MCache.compiles;
+	page->metafailures = MCache.failures;
+	page->policyhits = pcs["hits"].uval();
+	page->policymisses = pcs["misses"].uval();
+	page->window = (now - basetime) / 1000000ULL;
+	page->wcommands = win.count;
+	page->p50 = win.percentile (50.0);
+	page->p90 = win.percentile (90.0);
+	page->p99 = win.percentile (99.0);
+	page->max = win.max;
+	
+	__sync_synchronize ();
+	page->seq++;
+	
+	if ((now - basetime) >= STATUS_WINDOW)
+	{
+		base = cur;
+		basetime = now;
+	}
+}
+
+// ==========================================================================
+// CONSTRUCTOR StatusThread
+// ==========================================================================
+StatusThread::StatusThread (void)
+{
+	running = false;
+}
+
+// ==========================================================================
+// DESTRUCTOR StatusThread
+// ==========================================================================
+StatusThread::~StatusThread (void)
+{
+}
+
+// ==========================================================================
+// METHOD StatusThread::run
+// ==========================================================================
+void StatusThread::run (void)
+{
+	while (AUTHD->shouldRun)
+	{
+		sleep (1);
+		Status.update ();
+	}
+	
+	running = false;
+}
+
+// ==========================================================================
+// METHOD StatusThread::start
+// ==========================================================================
+void StatusThread::start (void)
+{
+	running = true;
+	spawn ();
+}
+
+// ==========================================================================
+// METHOD StatusThread::stop
+// ==========================================================================
+void StatusThread::stop (void)
+{
+	// Status and the statistics it reads are torn down once main()
+	// returns, so the last update has to be out of the way.
+	while (running) usleep (10000);
+}
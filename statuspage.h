@@ -0,0 +1,61 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#ifndef _authd_statuspage_H
+#define _authd_statuspage_H 1
+
+/* ======================================================================== *\
+ | Layout of the status page that authd publishes as a memory mapped file.  |
+ | This header is shared with the authdstat tool, so it should stay plain   |
+ | C.                                                                       |
+ |                                                                          |
+ | There is only one writer. It makes seq odd before it changes anything    |
+ | and even again when it is done, so a reader copies the page and retries  |
+ | if seq was odd or changed during the copy.                               |
+\* ======================================================================== */
+
+#include <stdint.h>
+
+#define STATUSPAGE_PATH		"/var/openpanel/sockets/authd/authd.status"
+#define STATUSPAGE_MAGIC	0x41535450 /* "ASTP" */
+#define STATUSPAGE_VERSION	1
+
+typedef struct
+{
+	uint32_t	magic;			/* STATUSPAGE_MAGIC */
+	uint32_t	version;		/* STATUSPAGE_VERSION */
+	uint32_t	seq;			/* Odd while being written */
+	uint32_t	pid;			/* Process id of the daemon */
+	uint64_t	started;		/* Start time, microseconds since epoch */
+	uint64_t	updated;		/* Last update, same */
+	
+	uint32_t	workers;		/* Socket worker threads */
+	uint32_t	busy;			/* Workers handling a connection */
+	uint32_t	transactions;	/* Transactions in flight */
+	uint32_t	modules;		/* Modules in the MetaCache */
+	uint64_t	accepted;		/* Connections accepted */
+	uint64_t	commands;		/* Commands handled */
+	
+	uint64_t	metahits;		/* MetaCache: served from memory */
+	uint64_t	metareloads;	/* MetaCache: loaded from disk */
+	uint64_t	metacompiles;	/* MetaCache: parsed from module.xml */
+	uint64_t	metafailures;	/* MetaCache: failed loads */
+	uint64_t	policyhits;		/* PolicyCache hits */
+	uint64_t	policymisses;	/* PolicyCache misses */
+	
+	uint32_t	window;			/* Seconds covered by the percentiles */
+	uint32_t	wcommands;		/* Commands in that window */
+	uint32_t	p50;			/* Command latency, microseconds */
+	uint32_t	p90;
+	uint32_t	p99;
+	uint32_t	max;
+} authdstatus;
+
+#endif
@@ -0,0 +1,160 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+TraceLog Trace;
+
+static __thread char TRACEBUF[TRACE_BUFSZ]; ///< Pending events, this thread.
+static __thread unsigned int TRACELEN = 0; ///< Bytes in TRACEBUF.
+static __thread char TRACEMOD[64]; ///< Module of the current connection.
+static __thread char TRACETID[64]; ///< Transaction of the current connection.
+static __thread int TRACETHREAD = 0; ///< Kernel thread id, 0 if unknown.
+
+/// Copy a string for use inside a JSON string, dropping anything that
+/// would need an escape. Names and ids never contain those, this is
+/// just to keep a module from breaking the file.
+static void traceEscape (char *into, size_t sz, const char *from)
+{
+	size_t i = 0;
+	
+	while (from && *from && (i < (sz-1)))
+	{
+		char c = *from++;
+		if ((c == '"') || (c == '\\') || ((unsigned char) c < 32)) continue;
+		into[i++] = c;
+	}
+	
+	into[i] = 0;
+}
+
+// ==========================================================================
+// CONSTRUCTOR TraceLog
+// ==========================================================================
+TraceLog::TraceLog (void)
+{
+	enabled = false;
+	fd = -1;
+	maxsize = 0;
+	cursize = 0;
+}
+
+// ==========================================================================
+// DESTRUCTOR TraceLog
+// ==========================================================================
+TraceLog::~TraceLog (void)
+{
+	if (fd >= 0) ::close (fd);
+}
+
+// ==========================================================================
+// METHOD TraceLog::open
+// ==========================================================================
+bool TraceLog::open (const string &path, unsigned int sz)
+{
+	struct stat st;
+	
+	fd = ::open (path.str(), O_WRONLY|O_APPEND|O_CREAT|O_NOFOLLOW|O_CLOEXEC,
+				 0600);
+	if (fd < 0) return false;
+	
+	if (fstat (fd, &st))
+	{
+		::close (fd);
+		fd = -1;
+		return false;
+	}
+	
+	// The JSON array format does not need a closing bracket, so a file
+	// that is still being written to can be loaded as it is.
+	if ((st.st_size == 0) && (::write (fd, "[\n", 2) != 2))
+	{
+		::close (fd);
+		fd = -1;
+		return false;
+	}
+	
+	maxsize = sz;
+	cursize = (st.st_size == 0) ? 2 : st.st_size;
+	enabled = (! maxsize) || (cursize < maxsize);
+	return true;
+}
+
+// ==========================================================================
+// METHOD TraceLog::setContext
+// ==========================================================================
+void TraceLog::setContext (const string &module, const string &tid)
+{
+	if (! enabled) return;
+	
+	traceEscape (TRACEMOD, sizeof (TRACEMOD), module.str());
+	traceEscape (TRACETID, sizeof (TRACETID), tid.str());
+}
+
+// ==========================================================================
+// METHOD TraceLog::span
+// ==========================================================================
+void TraceLog::span (const char *name, const char *cat, const char *detail,
+					 unsigned long long start, unsigned long long end)
+{
+	char ename[64];
+	char edetail[128];
+	char ev[512];
+	int len;
+	
+	if (! enabled) return;
+	if (! TRACETHREAD) TRACETHREAD = (int) syscall (SYS_gettid);
+	
+	traceEscape (ename, sizeof (ename), name);
+	traceEscape (edetail, sizeof (edetail), detail);
+	
+	len = snprintf (ev, sizeof (ev), "{\"name\":\"%s\",\"cat\":\"%s\","
+					"\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%i,"
+					"\"tid\":%i,\"args\":{\"module\":\"%s\",\"transaction\":"
+					"\"%s\",\"detail\":\"%s\"}},\n", ename, cat, start,
+					end - start, (int) getpid(), TRACETHREAD, TRACEMOD,
+					TRACETID, edetail);
+	
+	if ((len <= 0) || (len >= (int) sizeof (ev))) return;
+	if ((TRACELEN + len) > TRACE_BUFSZ) flush ();
+	
+	memcpy (TRACEBUF + TRACELEN, ev, len);
+	TRACELEN += len;
+}
+
+// ==========================================================================
+// METHOD TraceLog::flush
+// ==========================================================================
+void TraceLog::flush (void)
+{
+	if (! TRACELEN) return;
+	
+	// Every buffer goes out in one append, so the events of different
+	// threads never get mixed up within a line.
+	if (enabled && (::write (fd, TRACEBUF, TRACELEN) == (ssize_t) TRACELEN))
+	{
+		unsigned int sz = __sync_add_and_fetch (&cursize, TRACELEN);
+		if (maxsize && (sz >= maxsize))
+		{
+			enabled = false;
+			AUTHDLOG (log::warning, "trace   ", "Trace file full, tracing "
+						"stopped");
+		}
+	}
+	
+	TRACELEN = 0;
+}
@@ -0,0 +1,570 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+#include <grace/strutil.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#define TREE_MAXDEPTH	32
+#define TREE_MAXFILES	8192
+
+// ==========================================================================
+// CONSTRUCTOR TreeInstaller
+// ==========================================================================
+TreeInstaller::TreeInstaller (const string &tid)
+{
+	transactionid = tid;
+	nextjob = 0;
+	failed = false;
+	syncdata = false;
+}
+
+// ==========================================================================
+// DESTRUCTOR TreeInstaller
+// ==========================================================================
+TreeInstaller::~TreeInstaller (void)
+{
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::scan
+// ==========================================================================
+bool TreeInstaller::scan (const statstring &moduleName, const string &srcDir,
+						  const string &destDir, value &into)
+{
+	struct stat st;
+	
+	module = moduleName;
+	srcrel = srcDir;
+	destbase = destDir;
+	srcbase = rootPath (PATH_STAGING "/%s/%s" %format (moduleName, srcDir));
+	
+	if (lstat (srcbase.str(), &st) || (! S_ISDIR (st.st_mode)))
+	{
+		error = "Source is not a directory";
+		return false;
+	}
+	
+	return walk ("", 0, into);
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::walk
+// ==========================================================================
+bool TreeInstaller::walk (const string &rel, int depth, value &into)
+{
+	string spath = srcbase;
+	string dpath = destbase;
+	struct stat st;
+	DIR *dir;
+	struct dirent *de;
+	
+	if (depth > TREE_MAXDEPTH)
+	{
+		error = "Source tree too deep";
+		return false;
+	}
+	
+	if (rel)
+	{
+		spath.strcat ("/%s" %format (rel));
+		dpath.strcat ("/%s" %format (rel));
+	}
+	
+	// Directories that are already there are left alone, anything
+	// else in the way is an error.
+	string iopath = rootPath (dpath);
+	if (lstat (iopath.str(), &st) == 0)
+	{
+		if (! S_ISDIR (st.st_mode))
+		{
+			error = "Destination is not a directory: ";
+			error.strcat (dpath);
+			return false;
+		}
+	}
+	else
+	{
+		value &d = into.newval ();
+		d["type"] = "dir";
+		d["dest"] = dpath;
+	}
+	
+	dir = opendir (spath.str());
+	if (! dir)
+	{
+		error = "Could not read source directory";
+		return false;
+	}
+	
+	value subdirs;
+	
+	while ((de = readdir (dir)))
+	{
+		string name = de->d_name;
+		if ((name == ".") || (name == "..")) continue;
+		
+		string srel = rel;
+		if (srel) srel.strcat ('/');
+		srel.strcat (name);
+		
+		string epath = "%s/%s" %format (spath, name);
+		
+		// Staged trees hold nothing but plain files and directories,
+		// symbolic links in particular are refused.
+		if (lstat (epath.str(), &st))
+		{
+			error = "Could not stat source: ";
+			error.strcat (srel);
+			closedir (dir);
+			return false;
+		}
+		
+		if (S_ISDIR (st.st_mode))
+		{
+			subdirs.newval() = srel;
+		}
+		else if (S_ISREG (st.st_mode))
+		{
+			if (into.count() >= TREE_MAXFILES)
+			{
+				error = "Source tree too large";
+				closedir (dir);
+				return false;
+			}
+			
+			value &f = into.newval ();
+			f["type"] = "file";
+			f["src"] = "%s/%s" %format (srcrel, srel);
+			f["dest"] = "%s/%s" %format (destbase, srel);
+		}
+		else
+		{
+			error = "Source is not a plain file or directory: ";
+			error.strcat (srel);
+			closedir (dir);
+			return false;
+		}
+	}
+	
+	closedir (dir);
+	
+	foreach (sub, subdirs)
+	{
+		if (! walk (sub.sval(), depth+1, into)) return false;
+	}
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::addDir
+// ==========================================================================
+void TreeInstaller::addDir (const string &path, uid_t uid, gid_t gid,
+							unsigned int mode)
+{
+	value &d = dirs.newval ();
+	d["path"] = rootPath (path);
+	d["uid"] = (unsigned int) uid;
+	d["gid"] = (unsigned int) gid;
+	d["mode"] = mode;
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::addFile
+// ==========================================================================
+void TreeInstaller::addFile (const string &src, const string &dest,
+							 uid_t uid, gid_t gid, unsigned int mode)
+{
+	exclusivesection (files)
+	{
+		value &f = files.newval ();
+		f["src"] = src;
+		f["dest"] = rootPath (dest);
+		f["uid"] = (unsigned int) uid;
+		f["gid"] = (unsigned int) gid;
+		f["mode"] = mode;
+	}
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::run
+// ==========================================================================
+bool TreeInstaller::run (const statstring &moduleName, int nthreads)
+{
+	string base;
+	
+	module = moduleName;
+	
+	// Reserve a directory to keep the original content of the files
+	// we replace. Installing the same tree twice in one transaction
+	// gets a fresh one, the rollback-tool will undo them in turn.
+	base = FileInstaller::rollbackBase (transactionid, destbase, error);
+	if (! base) return false;
+	
+	for (int i=1; ! savedir; ++i)
+	{
+		string dir = base;
+		if (i == 1) dir.strcat (".tree");
+		else dir.strcat (".tree%i" %format (i));
+		
+		if (mkdir (dir.str(), 0700) == 0) savedir = dir;
+		else if ((errno != EEXIST) || (i > 64))
+		{
+			error = "Error creating rollback directory";
+			return false;
+		}
+	}
+	
+	bool res = true;
+	
+	// Every directory is reached from a descriptor of the deepest
+	// existing ancestor of the tree, one component at a time, so a
+	// symbolic link swapped in anywhere below it is refused.
+	string top = rootPath (destbase);
+	if (dirs.count() && (dirs[0]["path"] == top))
+	{
+		top = top.left (top.strrchr ('/'));
+	}
+	if (! top) top = "/";
+	
+	int topfd = -1;
+	if (dirs.count())
+	{
+		topfd = open (top.str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (topfd < 0)
+		{
+			error = "Error opening destination directory";
+			res = false;
+		}
+	}
+	
+	// Parents come before their children, so this is a plain walk
+	// down the list.
+	for (int i=0; res && (i<dirs.count()); ++i)
+	{
+		value &d = dirs[i];
+		string rel = d["path"].sval().mid (top.strlen());
+		if (rel[0] == '/') rel = rel.mid (1);
+		
+		if (! makeDir (topfd, rel, d))
+		{
+			AUTHDLOG (log::error, "tree    ", "Cannot create dir <%S>"
+						%format (d["path"]));
+			res = false;
+		}
+	}
+	
+	if (topfd >= 0) close (topfd);
+	
+	if (res)
+	{
+		int cnt = 0;
+		sharedsection (files)
+		{
+			cnt = files.count();
+		}
+		if (nthreads > cnt) nthreads = cnt;
+		
+		for (int i=0; i<nthreads; ++i)
+		{
+			new TreeWorker (this);
+		}
+		
+		while (true)
+		{
+			gc ();
+			if (count()) usleep (5000);
+			else break;
+		}
+		
+		// A tree is installed as a whole or not at all, the caller
+		// rolls back the transaction.
+		sharedsection (files)
+		{
+			foreach (f, files)
+			{
+				if (f["status"] == "installed") continue;
+				if (f["status"] == "unchanged") continue;
+				
+				error = "Error installing file: %s" %format (f["dest"]);
+				if (f.exists ("error"))
+				{
+					error.strcat (": %s" %format (f["error"]));
+				}
+				res = false;
+				break;
+			}
+		}
+	}
+	
+	// Even a half-finished tree needs its rollback record.
+	if (! writeManifest ()) res = false;
+	return res;
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::makeDir
+// ==========================================================================
+bool TreeInstaller::makeDir (int topfd, const string &rel, value &d)
+{
+	value elements = strutil::split (rel, '/');
+	int last = elements.count() - 1;
+	int dfd = dup (topfd);
+	
+	// The parents exist by now, only the last component is new. It is
+	// created by root, like makedir does, and handed to its owner
+	// through the descriptor.
+	for (int i=0; (dfd >= 0) && (i<=last); ++i)
+	{
+		string name = elements[i].sval();
+		
+		if ((i == last) && mkdirat (dfd, name.str(), 0700))
+		{
+			close (dfd);
+			error = "Error creating directory: ";
+			error.strcat (d["path"].sval());
+			return false;
+		}
+		if (i == last) d["done"] = true;
+		
+		int nfd = openat (dfd, name.str(),
+						  O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		close (dfd);
+		dfd = nfd;
+	}
+	
+	if ((dfd < 0) || fchown (dfd, d["uid"].uval(), d["gid"].uval()) ||
+		fchmod (dfd, d["mode"].uval()))
+	{
+		if (dfd >= 0) close (dfd);
+		error = "Error setting up directory: ";
+		error.strcat (d["path"].sval());
+		return false;
+	}
+	
+	close (dfd);
+	return true;
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::next
+// ==========================================================================
+bool TreeInstaller::next (int &idx, value &job)
+{
+	bool res = false;
+	
+	exclusivesection (files)
+	{
+		// No point in going on once a file failed.
+		if (failed) breaksection return false;
+		if (nextjob < files.count())
+		{
+			idx = nextjob++;
+			job = files[idx];
+			res = true;
+		}
+	}
+	
+	return res;
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::done
+// ==========================================================================
+void TreeInstaller::done (int idx, const value &res)
+{
+	exclusivesection (files)
+	{
+		if (res["status"] == "failed") failed = true;
+		files[idx]["status"] = res["status"];
+		files[idx]["existed"] = res["existed"];
+		files[idx]["oldmode"] = res["oldmode"];
+		if (res.exists ("error")) files[idx]["error"] = res["error"];
+	}
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::summary
+// ==========================================================================
+string *TreeInstaller::summary (void)
+{
+	returnclass (string) res retain;
+	
+	foreach (d, dirs)
+	{
+		if (d["done"].bval()) res.strcat ("created %s\n" %format (d["path"]));
+	}
+	
+	sharedsection (files)
+	{
+		foreach (f, files)
+		{
+			if (! f.exists ("status")) res.strcat ("skipped ");
+			else res.strcat ("%s " %format (f["status"]));
+			res.strcat (f["dest"].sval());
+			if (f.exists ("error")) res.strcat (": %s" %format (f["error"]));
+			res.strcat ('\n');
+		}
+	}
+	
+	return &res;
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::collect
+// ==========================================================================
+void TreeInstaller::collect (SyncBatch &into)
+{
+	foreach (d, dirs)
+	{
+		if (d["done"].bval()) into.add (d["path"].sval());
+	}
+	
+	sharedsection (files)
+	{
+		foreach (f, files)
+		{
+			if (f["status"] == "installed") into.add (f["dest"].sval());
+		}
+	}
+}
+
+// ==========================================================================
+// METHOD TreeInstaller::writeManifest
+// ==========================================================================
+bool TreeInstaller::writeManifest (void)
+{
+	// One line per change, the rollback-tool undoes them from the
+	// bottom up. Original file content is kept in savedir, named after
+	// the job index.
+	string tdest = rootPath (destbase);
+	string out = "TREE %s\n" %format (tdest);
+	
+	foreach (d, dirs)
+	{
+		if (! d["done"].bval()) break;
+		out.strcat ("MKDIR %u %u %o - %s\n" %format (d["uid"].uval(),
+					d["gid"].uval(), d["mode"].uval(), d["path"]));
+	}
+	
+	sharedsection (files)
+	{
+		for (int i=0; i<files.count(); ++i)
+		{
+			const value &f = files[i];
+			statstring st = f["status"].sval();
+			
+			// An unchanged file was left alone, there is nothing to
+			// undo.
+			if (st != "installed") continue;
+			if (f["existed"].bval())
+			{
+				out.strcat ("UPDATE %u %u %o %i %s\n" %format (f["uid"].uval(),
+							f["gid"].uval(), f["oldmode"].uval(), i,
+							f["dest"]));
+			}
+			else
+			{
+				out.strcat ("CREATE %u %u - - %s\n" %format (f["uid"].uval(),
+							f["gid"].uval(), f["dest"]));
+			}
+		}
+	}
+	
+	string fn = "%s.rollback" %format (savedir);
+	int fd = open (fn.str(), O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0600);
+	if (fd < 0)
+	{
+		error = "Error writing rollback manifest";
+		return false;
+	}
+	
+	bool res = (::write (fd, out.str(), out.strlen()) == out.strlen());
+	close (fd);
+	
+	if (! res) error = "Error writing rollback manifest";
+	return res;
+}
+
+// ==========================================================================
+// CONSTRUCTOR TreeWorker
+// ==========================================================================
+TreeWorker::TreeWorker (TreeInstaller *grp) : groupthread (*grp)
+{
+	group = grp;
+	spawn ();
+}
+
+// ==========================================================================
+// DESTRUCTOR TreeWorker
+// ==========================================================================
+TreeWorker::~TreeWorker (void)
+{
+}
+
+// ==========================================================================
+// METHOD TreeWorker::run
+// ==========================================================================
+void TreeWorker::run (void)
+{
+	int idx;
+	value job;
+	
+	while (group->next (idx, job))
+	{
+		value res;
+		string err;
+		int srcfd = -1;
+		
+		res["status"] = "failed";
+		
+		// The policy was checked by the caller, this opens and verifies
+		// the source file itself.
+		string src;
+		src = guard.translateSource (group->module, job["src"].sval(),
+									 srcfd, err);
+		if (! src)
+		{
+			res["error"] = err;
+			group->done (idx, res);
+			continue;
+		}
+		
+		FileInstaller inst ("", job["dest"].sval(), job["uid"].uval(),
+							job["gid"].uval(), job["mode"].uval());
+		inst.setSavePath ("%s/%i" %format (group->savedir, idx));
+		inst.setSyncData (group->syncdata);
+		
+		if (inst.skipUnchanged (srcfd))
+		{
+			res["status"] = "unchanged";
+		}
+		else if (inst.prepare() && inst.copyFrom (srcfd) && inst.commit())
+		{
+			res["status"] = "installed";
+		}
+		else
+		{
+			AUTHDLOG (log::error, "tree    ", "Error installing <%S>: %s"
+						%format (job["dest"], inst.error));
+			res["error"] = inst.error;
+		}
+		
+		close (srcfd);
+		res["existed"] = inst.existed;
+		res["oldmode"] = inst.oldmode;
+		group->done (idx, res);
+	}
+}
@@ -0,0 +1,307 @@
+// This file is part of OpenPanel - The Open Source Control Panel
+// OpenPanel is free software: you can redistribute it and/or modify it 
+// under the terms of the GNU General Public License as published by the Free 
+// Software Foundation, using version 3 of the License.
+//
+// Please note that use of the OpenPanel trademark may be subject to additional 
+// restrictions. For more information, please visit the Legal Information 
+// section of the OpenPanel website on http://www.openpanel.com/
+
+
+#include "authd.h"
+#include <grace/system.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <pwd.h>
+#include <grp.h>
+
+UserDB UDB;
+
+/// Fold the identity of both files into a single number, which
+/// changes whenever either file is edited or replaced. Returns 0 if
+/// either file can't be found.
+static unsigned long long userdbStamp (void)
+{
+	struct stat st[2];
+	unsigned long long res = 14695981039346656037ULL;
+	string pwpath = rootPath ("/etc/passwd");
+	string grpath = rootPath ("/etc/group");
+	
+	if (stat (pwpath.str(), &st[0]) || stat (grpath.str(), &st[1]))
+	{
+		return 0;
+	}
+	
+	for (int i=0; i<2; ++i)
+	{
+		unsigned long long parts[4] = {
+			(unsigned long long) st[i].st_ino,
+			(unsigned long long) st[i].st_size,
+			(unsigned long long) st[i].st_mtim.tv_sec,
+			(unsigned long long) st[i].st_mtim.tv_nsec
+		};
+		
+		for (int p=0; p<4; ++p)
+		{
+			res ^= parts[p];
+			res *= 1099511628211ULL;
+		}
+	}
+	
+	return res ? res : 1;
+}
+
+// ==========================================================================
+// CONSTRUCTOR UserDB
+// ==========================================================================
+UserDB::UserDB (void)
+{
+	stamp = 0;
+	hits = fallbacks = reloads = 0;
+	db.meter ("userdb");
+}
+
+// ==========================================================================
+// DESTRUCTOR UserDB
+// ==========================================================================
+UserDB::~UserDB (void)
+{
+}
+
+// ==========================================================================
+// METHOD UserDB::invalidate
+// ==========================================================================
+void UserDB::invalidate (void)
+{
+	stamp = 0;
+	__sync_synchronize ();
+}
+
+// ==========================================================================
+// METHOD UserDB::refresh
+// ==========================================================================
+void UserDB::refresh (void)
+{
+	unsigned long long cur = userdbStamp ();
+	if (cur && (cur == stamp)) return;
+	
+	exclusivesection (db)
+	{
+		// Another thread may have beaten us to it.
+		if (cur && (cur == stamp)) breaksection return;
+		
+		// Without the files, everything goes to NSS.
+		if (cur) load ();
+		else db.clear ();
+		stamp = cur;
+	}
+}
+
+// ==========================================================================
+// METHOD UserDB::load
+// ==========================================================================
+void UserDB::load (void)
+{
+	FILE *f;
+	string pwpath = rootPath ("/etc/passwd");
+	string grpath = rootPath ("/etc/group");
+	
+	db.clear ();
+	
+	// The first entry for a name or gid wins, as it does for the
+	// libc lookups.
+	if ((f = fopen (pwpath.str(), "r")))
+	{
+		struct passwd *pw;
+		value &users = db["pw"];
+		
+		while ((pw = fgetpwent (f)))
+		{
+			if (users.exists (pw->pw_name)) continue;
+			
+			value &u = users[pw->pw_name];
+			u["uid"] = (unsigned int) pw->pw_uid;
+			u["gid"] = (unsigned int) pw->pw_gid;
+			u["home"] = pw->pw_dir;
+			u["shell"] = pw->pw_shell;
+		}
+		
+		fclose (f);
+	}
+	
+	if ((f = fopen (grpath.str(), "r")))
+	{
+		struct group *gr;
+		value &groups = db["gr"];
+		value &gids = db["gid"];
+		
+		while ((gr = fgetgrent (f)))
+		{
+			if (groups.exists (gr->gr_name)) continue;
+			
+			value &g = groups[gr->gr_name];
+			g["gid"] = (unsigned int) gr->gr_gid;
+			for (int i=0; gr->gr_mem && gr->gr_mem[i]; ++i)
+			{
+				g["members"][gr->gr_mem[i]] = true;
+			}
+			
+			string gidkey = "%u" %format ((unsigned int) gr->gr_gid);
+			if (! gids.exists (gidkey)) gids[gidkey] = gr->gr_name;
+		}
+		
+		fclose (f);
+	}
+	
+	__sync_add_and_fetch (&reloads, 1);
+	AUTHDLOG (log::info, "userdb  ", "Loaded %u users and %u groups"
+				%format (db["pw"].count(), db["gr"].count()));
+}
+
+// ==========================================================================
+// METHOD UserDB::getpwnam
+// ==========================================================================
+value *UserDB::getpwnam (const string &name)
+{
+	returnclass (value) res retain;
+	bool found = false;
+	
+	refresh ();
+	
+	// Only look at nodes that exist, a shared section must not
+	// create any.
+	sharedsection (db)
+	{
+		if (db.exists ("pw") && db["pw"].exists (name))
+		{
+			res = db["pw"][name];
+			found = true;
+		}
+	}
+	
+	if (found)
+	{
+		__sync_add_and_fetch (&hits, 1);
+		return &res;
+	}
+	
+	__sync_add_and_fetch (&fallbacks, 1);
+	res = kernel.userdb.getpwnam (name);
+	return &res;
+}
+
+// ==========================================================================
+// METHOD UserDB::getgrnam
+// ==========================================================================
+value *UserDB::getgrnam (const string &name)
+{
+	returnclass (value) res retain;
+	bool found = false;
+	
+	refresh ();
+	
+	sharedsection (db)
+	{
+		if (db.exists ("gr") && db["gr"].exists (name))
+		{
+			res["gid"] = db["gr"][name]["gid"].uval();
+			found = true;
+		}
+	}
+	
+	if (found)
+	{
+		__sync_add_and_fetch (&hits, 1);
+		return &res;
+	}
+	
+	__sync_add_and_fetch (&fallbacks, 1);
+	value gr = kernel.userdb.getgrnam (name);
+	if (gr) res["gid"] = gr["gid"].uval();
+	return &res;
+}
+
+// ==========================================================================
+// METHOD UserDB::getgrgid
+// ==========================================================================
+value *UserDB::getgrgid (gid_t gid)
+{
+	returnclass (value) res retain;
+	string gidkey = "%u" %format ((unsigned int) gid);
+	bool found = false;
+	
+	refresh ();
+	
+	sharedsection (db)
+	{
+		if (db.exists ("gid") && db["gid"].exists (gidkey))
+		{
+			res["name"] = db["gid"][gidkey];
+			res["gid"] = (unsigned int) gid;
+			found = true;
+		}
+	}
+	
+	if (found)
+	{
+		__sync_add_and_fetch (&hits, 1);
+		return &res;
+	}
+	
+	__sync_add_and_fetch (&fallbacks, 1);
+	value gr = kernel.userdb.getgrgid (gid);
+	if (gr)
+	{
+		res["name"] = gr["name"];
+		res["gid"] = (unsigned int) gid;
+	}
+	return &res;
+}
+
+// ==========================================================================
+// METHOD UserDB::isMember
+// ==========================================================================
+bool UserDB::isMember (const string &group, const string &user)
+{
+	int res = -1;
+	
+	refresh ();
+	
+	sharedsection (db)
+	{
+		if (db.exists ("gr") && db["gr"].exists (group))
+		{
+			value &g = db["gr"][group];
+			res = (g.exists ("members") && g["members"].exists (user));
+		}
+	}
+	
+	if (res >= 0)
+	{
+		__sync_add_and_fetch (&hits, 1);
+		return res;
+	}
+	
+	__sync_add_and_fetch (&fallbacks, 1);
+	value gr = kernel.userdb.getgrnam (group);
+	return gr["members"].exists (user);
+}
+
+// ==========================================================================
+// METHOD UserDB::stats
+// ==========================================================================
+value *UserDB::stats (void)
+{
+	returnclass (value) res retain;
+	
+	sharedsection (db)
+	{
+		res["users"] = db.exists ("pw") ? db["pw"].count() : 0;
+		res["groups"] = db.exists ("gr") ? db["gr"].count() : 0;
+	}
+	
+	res["hits"] = hits;
+	res["fallbacks"] = fallbacks;
+	res["reloads"] = reloads;
+	return &res;
+}